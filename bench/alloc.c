@@ -0,0 +1,65 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+/* The wrappers themselves call the real thing */
+#undef malloc
+#undef calloc
+#undef realloc
+#undef reallocarray
+#undef strdup
+#undef strndup
+#undef asprintf
+
+unsigned long long bench_allocs;
+
+void *
+bench_malloc(size_t n) {
+	bench_allocs++;
+	return malloc(n);
+}
+
+void *
+bench_calloc(size_t n, size_t s) {
+	bench_allocs++;
+	return calloc(n, s);
+}
+
+void *
+bench_realloc(void *p, size_t n) {
+	bench_allocs++;
+	return realloc(p, n);
+}
+
+void *
+bench_reallocarray(void *p, size_t n, size_t s) {
+	bench_allocs++;
+	return reallocarray(p, n, s);
+}
+
+char *
+bench_strdup(const char *s) {
+	bench_allocs++;
+	return strdup(s);
+}
+
+char *
+bench_strndup(const char *s, size_t n) {
+	bench_allocs++;
+	return strndup(s, n);
+}
+
+int
+bench_asprintf(char **p, const char *fmt, ...) {
+	va_list ap;
+	int ret;
+
+	bench_allocs++;
+	va_start(ap, fmt);
+	ret = vasprintf(p, fmt, ap);
+	va_end(ap);
+	return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef _BENCH_ALLOC_H
+#define _BENCH_ALLOC_H
+/*
+ * Included ahead of every source of the benchmark, so the allocations dnsfoo
+ * makes go through counting wrappers. Buffers libc and libutil allocate on
+ * their own behalf, like those of stdio or imsg_compose(), aren't counted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern unsigned long long bench_allocs;
+
+void *bench_malloc(size_t);
+void *bench_calloc(size_t, size_t);
+void *bench_realloc(void *, size_t);
+void *bench_reallocarray(void *, size_t, size_t);
+char *bench_strdup(const char *);
+char *bench_strndup(const char *, size_t);
+int bench_asprintf(char **, const char *, ...)
+	__attribute__((__format__ (printf, 2, 3)));
+
+#define malloc(n)		bench_malloc(n)
+#define calloc(n, s)		bench_calloc(n, s)
+#define realloc(p, n)		bench_realloc(p, n)
+#define reallocarray(p, n, s)	bench_reallocarray(p, n, s)
+#define strdup(s)		bench_strdup(s)
+#define strndup(s, n)		bench_strndup(s, n)
+#define asprintf(...)		bench_asprintf(__VA_ARGS__)
+#endif /* _BENCH_ALLOC_H */
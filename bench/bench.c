@@ -0,0 +1,905 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/icmp6.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "dnsfoo.h"
+#include "config.h"
+#include "handlers.h"
+#include "upstream_update.h"
+#include "serverrepo.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Microbenchmarks for the code every update runs through. Each one drives a
+ * single function with synthetic input of a few sizes, doubling the number
+ * of calls until they take long enough, and prints the time and the number
+ * of allocations per call. What a call needs set up of its own, like a
+ * message to pass to the repository, isn't measured.
+ *
+ * The repository benchmarks send their updates to a socket that is drained
+ * between calls, the way the upstream updater would read them.
+ */
+
+struct bench {
+	size_t n;
+	uint64_t ns;
+	unsigned long long allocs;
+	uint64_t t_start;
+	unsigned long long allocs_start;
+	/* Calls answered from a cache, for those that have one */
+	size_t hits;
+	/* Processes forked and the peak resident set of whatever parsed, in KB */
+	size_t procs;
+	long maxrss;
+};
+
+struct benchmark {
+	const char *name;
+	/* What the sizes are a number of */
+	const char *param;
+	void (*fn)(struct bench *, size_t);
+	/* Sizes to run it with, a 0 ends the list early */
+	size_t sizes[4];
+	/* Whether to print the share of calls that were cache hits */
+	int hitrate;
+	/* Whether to print the processes forked per call and their memory */
+	int footprint;
+};
+
+/* Defined by dnsfoo.c, which isn't part of the benchmark */
+int handlers_inline;
+
+int
+privdrop(struct config *config) {
+	/* Nothing the benchmark runs drops privileges */
+	return 1;
+}
+
+static time_t bench_now = 1000000000;
+
+static time_t
+bench_clock(time_t *t) {
+	if (t != NULL)
+		*t = bench_now;
+	return bench_now;
+}
+
+static void
+bench_start(struct bench *b) {
+	b->allocs_start = bench_allocs;
+	b->t_start = metrics_now();
+}
+
+static void
+bench_stop(struct bench *b) {
+	b->ns += metrics_now() - b->t_start;
+	b->allocs += bench_allocs - b->allocs_start;
+}
+
+/* A message with `nservers' name servers and a search domain from device `dev' */
+static void
+bench_msg(struct upstream_update_msg *msg, size_t dev, size_t nservers, unsigned int variant) {
+	char buf[INET_ADDRSTRLEN];
+	size_t idx;
+
+	memset(msg, 0x00, sizeof(*msg));
+	msg->type = SRC_DHCPV4;
+	msg->lifetime = 3600;
+	if (asprintf(&msg->device, "em%zu", dev) < 0)
+		err(1, "asprintf");
+	for (idx = 0; idx < nservers; idx++) {
+		snprintf(buf, sizeof(buf), "10.%u.%zu.%zu", variant % 256, idx / 256, idx % 256);
+		if (!upstream_update_msg_append_ns(msg, buf))
+			err(1, "upstream_update_msg_append_ns");
+	}
+	if (!upstream_update_msg_append_domain(msg, "example.org"))
+		err(1, "upstream_update_msg_append_domain");
+}
+
+static void
+bench_append_ns(struct bench *b, size_t nservers) {
+	struct upstream_update_msg msg;
+	size_t i, idx;
+
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		memset(&msg, 0x00, sizeof(msg));
+		for (idx = 0; idx < nservers; idx++) {
+			if (!upstream_update_msg_append_ns(&msg, "2001:db8::53"))
+				err(1, "upstream_update_msg_append_ns");
+		}
+		upstream_update_msg_cleanup(&msg);
+	}
+	bench_stop(b);
+}
+
+static void
+bench_pack(struct bench *b, size_t nservers) {
+	struct upstream_update_msg msg;
+	size_t i, len;
+	char *p;
+
+	bench_msg(&msg, 0, nservers, 0);
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		if ((p = upstream_update_msg_pack(&msg, &len)) == NULL)
+			errx(1, "upstream_update_msg_pack");
+	}
+	bench_stop(b);
+	upstream_update_msg_cleanup(&msg);
+}
+
+static void
+bench_unpack(struct bench *b, size_t nservers) {
+	struct upstream_update_msg msg, out;
+	size_t i, len;
+	char *p;
+
+	bench_msg(&msg, 0, nservers, 0);
+	if ((p = upstream_update_msg_pack(&msg, &len)) == NULL)
+		errx(1, "upstream_update_msg_pack");
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		memset(&out, 0x00, sizeof(out));
+		if (!upstream_update_msg_unpack(&out, p, len))
+			errx(1, "upstream_update_msg_unpack");
+	}
+	bench_stop(b);
+	upstream_update_msg_cleanup(&msg);
+}
+
+/* A lease file the way dhclient(8) writes it, with `nleases' leases */
+static char *
+bench_lease_file(size_t nleases, size_t *len) {
+	char *buf = NULL, *lease;
+	size_t idx;
+
+	*len = 0;
+	for (idx = 0; idx < nleases; idx++) {
+		if (asprintf(&lease,
+		    "lease {\n"
+		    "  bootp;\n"
+		    "  interface \"em0\";\n"
+		    "  fixed-address 192.0.2.%zu;\n"
+		    "  option subnet-mask 255.255.255.0;\n"
+		    "  option routers 192.0.2.1;\n"
+		    "  option domain-name-servers 192.0.2.53,192.0.2.54;\n"
+		    "  option domain-name \"example.org\";\n"
+		    "  option domain-search \"example.org\", \"example.net\";\n"
+		    "  option dhcp-lease-time 86400;\n"
+		    "  option dhcp-message-type 5;\n"
+		    "  option dhcp-server-identifier 192.0.2.1;\n"
+		    "  renew 3 2026/10/14 12:00:00 UTC;\n"
+		    "  rebind 3 2026/10/14 21:00:00 UTC;\n"
+		    "  expire 4 2026/10/15 00:00:00 UTC;\n"
+		    "}\n", idx % 254 + 1) < 0)
+			err(1, "asprintf");
+		if ((buf = realloc(buf, *len + strlen(lease) + 1)) == NULL)
+			err(1, "realloc");
+		memcpy(buf + *len, lease, strlen(lease) + 1);
+		*len += strlen(lease);
+		free(lease);
+	}
+	return buf;
+}
+
+static void
+bench_dhcpv4_parse(struct bench *b, size_t nleases) {
+	struct upstream_update_msg msg;
+	size_t i, len;
+	char *buf;
+	FILE *f;
+
+	buf = bench_lease_file(nleases, &len);
+	if ((f = fmemopen(buf, len, "r")) == NULL)
+		err(1, "fmemopen");
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		rewind(f);
+		memset(&msg, 0x00, sizeof(msg));
+		if (!dhcpv4_parse(f, &msg))
+			errx(1, "dhcpv4_parse");
+		upstream_update_msg_cleanup(&msg);
+	}
+	bench_stop(b);
+	fclose(f);
+	free(buf);
+}
+
+/* A router advertisement with `nopts' RDNSS options of two servers each and a DNSSL option */
+static u_char *
+bench_ra(size_t nopts, size_t *len) {
+	/* example.org, then padding to a multiple of 8 octets */
+	const u_char dnssl[] = "\007example\003org\0\0\0\0";
+	struct nd_router_advert *ra;
+	struct nd_opt_rdnss *rdnss;
+	struct nd_opt_dnssl *dnsslopt;
+	struct in6_addr ns;
+	size_t rdnsslen = sizeof(*rdnss) + 2 * sizeof(ns), idx;
+	u_char *pkt, *p;
+
+	*len = sizeof(*ra) + nopts * rdnsslen + sizeof(*dnsslopt) + sizeof(dnssl) - 1;
+	if ((pkt = calloc(1, *len)) == NULL)
+		err(1, "calloc");
+	ra = (struct nd_router_advert *) pkt;
+	ra->nd_ra_type = ND_ROUTER_ADVERT;
+	p = pkt + sizeof(*ra);
+
+	for (idx = 0; idx < nopts; idx++) {
+		rdnss = (struct nd_opt_rdnss *) p;
+		rdnss->nd_opt_rdnss_type = ND_OPT_RDNSS;
+		rdnss->nd_opt_rdnss_len = rdnsslen / 8;
+		rdnss->nd_opt_rdnss_lifetime = htonl(1800);
+		inet_pton(AF_INET6, "2001:db8::53", &ns);
+		ns.s6_addr[13] = idx;
+		memcpy(p + sizeof(*rdnss), &ns, sizeof(ns));
+		ns.s6_addr[15] = 0x54;
+		memcpy(p + sizeof(*rdnss) + sizeof(ns), &ns, sizeof(ns));
+		p += rdnsslen;
+	}
+
+	dnsslopt = (struct nd_opt_dnssl *) p;
+	dnsslopt->nd_opt_dnssl_type = ND_OPT_DNSSL;
+	dnsslopt->nd_opt_dnssl_len = (sizeof(*dnsslopt) + sizeof(dnssl) - 1) / 8;
+	dnsslopt->nd_opt_dnssl_lifetime = htonl(1800);
+	memcpy(p + sizeof(*dnsslopt), dnssl, sizeof(dnssl) - 1);
+	return pkt;
+}
+
+static void
+bench_rtadv_parse(struct bench *b, size_t nopts) {
+	struct upstream_update_msg msg;
+	size_t i, len;
+	u_char *pkt;
+
+	pkt = bench_ra(nopts, &len);
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		memset(&msg, 0x00, sizeof(msg));
+		rtadv_parse(pkt, len, &msg);
+		upstream_update_msg_cleanup(&msg);
+	}
+	bench_stop(b);
+	free(pkt);
+}
+
+/* Read what the repository passed on, like the upstream updater does */
+static void
+bench_drain(int fd) {
+	char buf[65536];
+	ssize_t n;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		;
+	if (n == 0 || errno != EAGAIN)
+		err(1, "read");
+}
+
+/* A repository with `ndevices' devices of one source each, passing its updates on to `fds[0]' */
+static void
+bench_repo(struct srv_devlist *devices, struct config *config, size_t ndevices, int fds[2]) {
+	struct upstream_update_msg msg;
+	int bufsz = 1024 * 1024;
+	size_t idx;
+
+	memset(config, 0x00, sizeof(*config));
+	TAILQ_INIT(&config->devices);
+	memset(devices, 0x00, sizeof(*devices));
+	TAILQ_INIT(&devices->devices);
+	TAILQ_INIT(&devices->reloaded);
+	devices->expiry = (time_t) -1;
+	devices->save_at = (time_t) -1;
+	devices->clock = bench_clock;
+	devices->config = config;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		err(1, "socketpair");
+	/* Every device with a search domain makes for a message of its own */
+	(void) setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+	(void) setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0)
+		err(1, "fcntl");
+
+	for (idx = 0; idx < ndevices; idx++) {
+		bench_msg(&msg, idx, 2, 0);
+		msg.lifetime = ~0;
+		serverrepo_handle_msg(&msg, NULL, fds[0], devices);
+		upstream_update_msg_cleanup(&msg);
+		bench_drain(fds[1]);
+	}
+}
+
+static void
+bench_repo_free(struct srv_devlist *devices, int fds[2]) {
+	serverrepo_free_devices(devices);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void
+bench_handle_msg(struct bench *b, size_t ndevices) {
+	struct upstream_update_msg msg;
+	struct srv_devlist devices;
+	struct config config;
+	int fds[2];
+	size_t i;
+
+	bench_repo(&devices, &config, ndevices, fds);
+	for (i = 0; i < b->n; i++) {
+		/* Every update changes the servers of one of the devices */
+		bench_msg(&msg, i % ndevices, 2, i + 1);
+		bench_start(b);
+		serverrepo_handle_msg(&msg, NULL, fds[0], &devices);
+		bench_stop(b);
+		upstream_update_msg_cleanup(&msg);
+		bench_drain(fds[1]);
+	}
+	bench_repo_free(&devices, fds);
+}
+
+static void
+bench_handle_timeout(struct bench *b, size_t ndevices) {
+	struct upstream_update_msg msg;
+	struct srv_devlist devices;
+	struct config config;
+	int fds[2];
+	size_t i;
+
+	bench_repo(&devices, &config, ndevices, fds);
+	for (i = 0; i < b->n; i++) {
+		/* One source expires in every call, the others never do */
+		memset(&msg, 0x00, sizeof(msg));
+		msg.type = SRC_RTADV;
+		msg.lifetime = 1;
+		if (asprintf(&msg.device, "em%zu", i % ndevices) < 0)
+			err(1, "asprintf");
+		if (!upstream_update_msg_append_ns(&msg, "2001:db8::53"))
+			err(1, "upstream_update_msg_append_ns");
+		serverrepo_handle_msg(&msg, NULL, fds[0], &devices);
+		upstream_update_msg_cleanup(&msg);
+		bench_drain(fds[1]);
+		bench_now++;
+
+		bench_start(b);
+		serverrepo_handle_timeout(fds[0], &devices);
+		bench_stop(b);
+		bench_drain(fds[1]);
+	}
+	bench_repo_free(&devices, fds);
+}
+
+/*
+ * What the event loop does for a changed lease file, in a child of its own by
+ * default or right there with inline-parsers, see eventloop_run_handler().
+ * Allocations of the children aren't counted. The memory reported is the
+ * largest peak resident set of a child, or with inline-parsers how much our
+ * own peak grew while parsing, which is what the event loop would need on top.
+ */
+static void
+bench_handler(struct bench *b, size_t nleases, int inline_parsers) {
+	char path[] = "/tmp/dnsfoo-bench.XXXXXXXXXX";
+	struct handler_info info;
+	size_t i, len;
+	struct rusage ru;
+	int fd, fds[2], status;
+	pid_t child;
+	long rss;
+	char *buf;
+
+	buf = bench_lease_file(nleases, &len);
+	if ((fd = mkstemp(path)) < 0)
+		err(1, "mkstemp");
+	if (write(fd, buf, len) != (ssize_t) len)
+		err(1, "write");
+	free(buf);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+		err(1, "socketpair");
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) < 0)
+		err(1, "fcntl");
+
+	memset(&info, 0x00, sizeof(info));
+	info.device = "em0";
+	info.source = path;
+	info.type = SRC_DHCPV4;
+	handlers_inline = inline_parsers;
+	/* The children would flush our pending output again when they exit */
+	fflush(stdout);
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		err(1, "getrusage");
+	rss = ru.ru_maxrss;
+
+	for (i = 0; i < b->n; i++) {
+		bench_start(b);
+		if (inline_parsers)
+			dhcpv4_handle_update(fd, fds[0], &info);
+		else {
+			log_flush();
+			if ((child = fork()) == -1)
+				err(1, "fork");
+			else if (child == 0) {
+				dhcpv4_handle_update(fd, fds[0], &info);
+				exit(0);
+			}
+			if (wait4(child, &status, 0, &ru) < 0)
+				err(1, "wait4");
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				errx(1, "handler failed");
+			b->procs++;
+			if (ru.ru_maxrss > b->maxrss)
+				b->maxrss = ru.ru_maxrss;
+		}
+		bench_stop(b);
+		bench_drain(fds[1]);
+	}
+	if (inline_parsers) {
+		if (getrusage(RUSAGE_SELF, &ru) < 0)
+			err(1, "getrusage");
+		b->maxrss = ru.ru_maxrss - rss;
+	}
+
+	handlers_inline = 0;
+	close(fds[0]);
+	close(fds[1]);
+	close(fd);
+	unlink(path);
+}
+
+static void
+bench_handler_fork(struct bench *b, size_t nleases) {
+	bench_handler(b, nleases, 0);
+}
+
+static void
+bench_handler_inline(struct bench *b, size_t nleases) {
+	bench_handler(b, nleases, 1);
+}
+
+/* Write the snapshot of a repository with `ndevices' devices to a new temporary file `path' */
+static void
+bench_snapshot(char *path, size_t ndevices) {
+	struct upstream_update_msg msg;
+	struct srv_devlist devices;
+	struct config config;
+	int fd, fds[2];
+	size_t idx;
+
+	bench_repo(&devices, &config, ndevices, fds);
+	/* Every device also has servers from an advertisement, which expire */
+	for (idx = 0; idx < ndevices; idx++) {
+		memset(&msg, 0x00, sizeof(msg));
+		msg.type = SRC_RTADV;
+		msg.lifetime = 1800;
+		if (asprintf(&msg.device, "em%zu", idx) < 0)
+			err(1, "asprintf");
+		if (!upstream_update_msg_append_ns(&msg, "2001:db8::53"))
+			err(1, "upstream_update_msg_append_ns");
+		serverrepo_handle_msg(&msg, NULL, fds[0], &devices);
+		upstream_update_msg_cleanup(&msg);
+		bench_drain(fds[1]);
+	}
+
+	if ((fd = mkstemp(path)) < 0)
+		err(1, "mkstemp");
+	close(fd);
+	if (!serverrepo_save(&devices, path))
+		errx(1, "serverrepo_save");
+	bench_repo_free(&devices, fds);
+}
+
+static void
+bench_save(struct bench *b, size_t ndevices) {
+	char path[] = "/tmp/dnsfoo-bench.XXXXXXXXXX";
+	struct srv_devlist devices;
+	struct config config;
+	int fds[2];
+	size_t i;
+
+	bench_snapshot(path, ndevices);
+	bench_repo(&devices, &config, 0, fds);
+	if (!serverrepo_load(&devices, path))
+		errx(1, "serverrepo_load");
+	bench_start(b);
+	for (i = 0; i < b->n; i++) {
+		if (!serverrepo_save(&devices, path))
+			errx(1, "serverrepo_save");
+	}
+	bench_stop(b);
+	bench_repo_free(&devices, fds);
+	unlink(path);
+}
+
+/* What a restart costs before the repository can pass servers on */
+static void
+bench_load(struct bench *b, size_t ndevices) {
+	char path[] = "/tmp/dnsfoo-bench.XXXXXXXXXX";
+	struct srv_devlist devices;
+	struct config config;
+	int fds[2];
+	size_t i;
+
+	bench_snapshot(path, ndevices);
+	bench_repo(&devices, &config, 0, fds);
+	for (i = 0; i < b->n; i++) {
+		bench_start(b);
+		if (!serverrepo_load(&devices, path))
+			errx(1, "serverrepo_load");
+		bench_stop(b);
+		serverrepo_free_devices(&devices);
+	}
+	bench_repo_free(&devices, fds);
+	unlink(path);
+}
+
+/*
+ * Replaying a query mix after a forwarder switch, with a stub resolver in a
+ * child standing in for unbound: it answers names it has cached right away and
+ * marks them authoritative, the others after BENCH_UPSTREAM_DELAY
+ * milliseconds, caching them from then on. The mix picks from `nnames' names
+ * with a Zipf distribution, a third of which have AAAA records as well. The
+ * cache before the switch, which warmup_collect() ranks from the stub's
+ * dump_cache, is what a history of the same mix left. Each switch is followed
+ * by `nnames' queries, so the hit rate doesn't depend on how many are run.
+ */
+#define BENCH_UPSTREAM_DELAY	1
+/* Names prefetched, as `warmup 64' would */
+#define BENCH_WARMUP		64
+#define BENCH_CACHE_SIZE	8192
+
+struct bench_mix {
+	size_t nnames;
+	double *cdf;
+	uint64_t rng;
+};
+
+static uint64_t
+bench_rand(struct bench_mix *mix) {
+	mix->rng ^= mix->rng >> 12;
+	mix->rng ^= mix->rng << 25;
+	mix->rng ^= mix->rng >> 27;
+	return mix->rng * 2685821657736338717ULL;
+}
+
+static void
+bench_mix_init(struct bench_mix *mix, size_t nnames) {
+	double sum = 0;
+	size_t idx;
+
+	mix->nnames = nnames;
+	mix->rng = 0x9e3779b97f4a7c15ULL;
+	if ((mix->cdf = calloc(nnames, sizeof(double))) == NULL)
+		err(1, "calloc");
+	for (idx = 0; idx < nnames; idx++)
+		mix->cdf[idx] = (sum += 1.0 / (idx + 1));
+	for (idx = 0; idx < nnames; idx++)
+		mix->cdf[idx] /= sum;
+}
+
+/* The next query of `mix', name number `*name' with type `*type' */
+static void
+bench_mix_next(struct bench_mix *mix, size_t *name, int *type) {
+	double u = (bench_rand(mix) >> 11) / 9007199254740992.0;
+	size_t lo = 0, hi = mix->nnames - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (mix->cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*name = lo;
+	*type = (lo % 3 == 0 && bench_rand(mix) % 2)? T_AAAA: T_A;
+}
+
+/* Write the cache a history of `mix' leaves as unbound-control dump_cache prints it */
+static void
+bench_cache_dump(struct bench_mix *mix, const char *path) {
+	uint8_t *seen;
+	size_t idx, name;
+	int type;
+	FILE *f;
+
+	if ((seen = calloc(mix->nnames, 1)) == NULL)
+		err(1, "calloc");
+	for (idx = 0; idx < 8 * mix->nnames; idx++) {
+		bench_mix_next(mix, &name, &type);
+		seen[name] |= (type == T_A)? WARMUP_A: WARMUP_AAAA;
+	}
+	if ((f = fopen(path, "w")) == NULL)
+		err(1, "fopen");
+	fprintf(f, "START_RRSET_CACHE\nEND_RRSET_CACHE\nSTART_MSG_CACHE\n");
+	for (idx = 0; idx < mix->nnames; idx++) {
+		if (seen[idx] & WARMUP_A)
+			fprintf(f, "msg name%zu.example. IN A 33152 1 %llu 3 1 0 0\n", idx,
+			        (unsigned long long) (60 + bench_rand(mix) % 3600));
+		if (seen[idx] & WARMUP_AAAA)
+			fprintf(f, "msg name%zu.example. IN AAAA 33152 1 %llu 3 1 0 0\n", idx,
+			        (unsigned long long) (60 + bench_rand(mix) % 3600));
+	}
+	fprintf(f, "END_MSG_CACHE\nEOD\n");
+	fclose(f);
+	free(seen);
+}
+
+/* Whether the question of `pkt' is cached, caching it if it isn't */
+static int
+bench_cache_hit(char **cache, const u_char *pkt, size_t len) {
+	uint64_t h = 14695981039346656037ULL;
+	size_t idx, slot;
+
+	/* The question is all there is after the header */
+	for (idx = HFIXEDSZ; idx < len; idx++)
+		h = (h ^ pkt[idx]) * 1099511628211ULL;
+	for (slot = h % BENCH_CACHE_SIZE; cache[slot] != NULL; slot = (slot + 1) % BENCH_CACHE_SIZE) {
+		if ((size_t) cache[slot][0] == len - HFIXEDSZ &&
+		    !memcmp(cache[slot] + 1, pkt + HFIXEDSZ, len - HFIXEDSZ))
+			return 1;
+	}
+	if ((cache[slot] = malloc(len - HFIXEDSZ + 1)) == NULL)
+		err(1, "malloc");
+	cache[slot][0] = len - HFIXEDSZ;
+	memcpy(cache[slot] + 1, pkt + HFIXEDSZ, len - HFIXEDSZ);
+	return 0;
+}
+
+/* The stub resolver, answering on `fd' until it's killed */
+static __dead void
+bench_resolver(int fd) {
+	struct answer {
+		u_char pkt[PACKETSZ];
+		ssize_t len;
+		struct sockaddr_storage from;
+		socklen_t fromlen;
+		uint64_t due;
+	} *answers = NULL;
+	char **cache;
+	size_t nanswers = 0, idx;
+	struct pollfd pfd;
+	uint64_t now, due;
+	struct answer *a;
+	HEADER *hp;
+	int timeout;
+
+	if ((cache = calloc(BENCH_CACHE_SIZE, sizeof(*cache))) == NULL)
+		err(1, "calloc");
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		now = metrics_now();
+		for (idx = 0, due = 0; idx < nanswers; ) {
+			if (answers[idx].due > now) {
+				if (due == 0 || answers[idx].due < due)
+					due = answers[idx].due;
+				idx++;
+				continue;
+			}
+			(void) sendto(fd, answers[idx].pkt, answers[idx].len, 0,
+			              (struct sockaddr *) &answers[idx].from, answers[idx].fromlen);
+			answers[idx] = answers[--nanswers];
+		}
+		timeout = due? (int) ((due - now + 999999) / 1000000): -1;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		if ((answers = reallocarray(answers, nanswers + 1, sizeof(*answers))) == NULL)
+			err(1, "reallocarray");
+		a = &answers[nanswers];
+		a->fromlen = sizeof(a->from);
+		if ((a->len = recvfrom(fd, a->pkt, sizeof(a->pkt), 0, (struct sockaddr *) &a->from,
+		                       &a->fromlen)) < (ssize_t) HFIXEDSZ)
+			continue;
+		hp = (HEADER *) a->pkt;
+		hp->qr = 1;
+		hp->aa = bench_cache_hit(cache, a->pkt, a->len);
+		a->due = hp->aa? 0: metrics_now() + BENCH_UPSTREAM_DELAY * 1000000ULL;
+		nanswers++;
+	}
+}
+
+/*
+ * Replay up to `nqueries' queries of `mix' after a switch, warming up the
+ * stub's cache first if `warm'. Returns the number replayed.
+ */
+static size_t
+bench_replay_switch(struct bench *b, struct bench_mix *mix, size_t nqueries, int warm) {
+	char path[] = "/tmp/dnsfoo-bench.XXXXXXXXXX";
+	struct warmup_name *names;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	u_char buf[PACKETSZ];
+	HEADER *hp = (HEADER *) buf;
+	char qname[NS_MAXDNAME];
+	size_t i, nwarm, name;
+	pid_t resolver, pid;
+	int fd, sfd, qlen, type;
+
+	memset(&sin, 0x00, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((sfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		err(1, "socket");
+	if (bind(sfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+	    getsockname(sfd, (struct sockaddr *) &sin, &sinlen) < 0)
+		err(1, "bind");
+	warmup_port = ntohs(sin.sin_port);
+
+	fflush(stdout);
+	log_flush();
+	if ((resolver = fork()) == -1)
+		err(1, "fork");
+	else if (resolver == 0)
+		bench_resolver(sfd);
+	close(sfd);
+
+	if (warm) {
+		if ((fd = mkstemp(path)) < 0)
+			err(1, "mkstemp");
+		close(fd);
+		bench_cache_dump(mix, path);
+		setenv("STUB_CACHE", path, 1);
+		setenv("STUB_LOG", "/dev/null", 1);
+		names = warmup_collect(BENCH_STUB, NULL, 0, BENCH_WARMUP, &nwarm);
+		warmup_prefetch(names, nwarm, 0);
+		warmup_free(names, nwarm);
+		/* The prefetch is done once its child is, there's none without names */
+		if (nwarm == 0)
+			errx(1, "no names to warm up with");
+		while ((pid = wait(NULL)) != -1 && pid == resolver)
+			;
+		unlink(path);
+	}
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		err(1, "connect");
+	for (i = 0; i < nqueries; i++) {
+		bench_mix_next(mix, &name, &type);
+		snprintf(qname, sizeof(qname), "name%zu.example.", name);
+		if ((qlen = res_mkquery(QUERY, qname, C_IN, type, NULL, 0, NULL, buf, sizeof(buf))) < 0)
+			errx(1, "res_mkquery");
+		bench_start(b);
+		if (send(fd, buf, qlen, 0) < 0 || recv(fd, buf, sizeof(buf), 0) < (ssize_t) HFIXEDSZ)
+			err(1, "query");
+		bench_stop(b);
+		b->hits += hp->aa;
+	}
+	close(fd);
+
+	kill(resolver, SIGTERM);
+	waitpid(resolver, NULL, 0);
+	return nqueries;
+}
+
+/* Replay the mix of `nnames' names after as many switches as it takes */
+static void
+bench_replay(struct bench *b, size_t nnames, int warm) {
+	struct bench_mix mix;
+	size_t i = 0;
+
+	bench_mix_init(&mix, nnames);
+	while (i < b->n)
+		i += bench_replay_switch(b, &mix, b->n - i < nnames? b->n - i: nnames, warm);
+	free(mix.cdf);
+}
+
+static void
+bench_replay_cold(struct bench *b, size_t nnames) {
+	bench_replay(b, nnames, 0);
+}
+
+static void
+bench_replay_warm(struct bench *b, size_t nnames) {
+	bench_replay(b, nnames, 1);
+}
+
+static struct benchmark benchmarks[] = {
+	{ "append_ns", "servers", bench_append_ns, { 1, 4, 16, 64 } },
+	{ "pack", "servers", bench_pack, { 1, 4, 16, 64 } },
+	{ "unpack", "servers", bench_unpack, { 1, 4, 16, 64 } },
+	{ "dhcpv4_parse", "leases", bench_dhcpv4_parse, { 1, 4, 16, 64 } },
+	{ "rtadv_parse", "options", bench_rtadv_parse, { 1, 2, 4, 8 } },
+	{ "handle_msg", "devices", bench_handle_msg, { 1, 8, 32, 128 } },
+	{ "handle_timeout", "devices", bench_handle_timeout, { 1, 8, 32, 128 } },
+	{ "save", "devices", bench_save, { 1, 32, 256, 1024 } },
+	{ "load", "devices", bench_load, { 1, 32, 256, 1024 } },
+	{ "handler_fork", "leases", bench_handler_fork, { 1, 16 }, 0, 1 },
+	{ "handler_inline", "leases", bench_handler_inline, { 1, 16 }, 0, 1 },
+	{ "replay_cold", "names", bench_replay_cold, { 64, 256, 1024 }, 1 },
+	{ "replay_warm", "names", bench_replay_warm, { 64, 256, 1024 }, 1 },
+};
+
+/* Run `bm' with `size' until it took at least `mintime' nanoseconds */
+static void
+bench_run(struct benchmark *bm, size_t size, uint64_t mintime) {
+	struct bench b;
+	char name[64];
+	size_t n = 1;
+
+	for (;;) {
+		memset(&b, 0x00, sizeof(b));
+		b.n = n;
+		bm->fn(&b, size);
+		if (b.ns >= mintime || n >= (SIZE_MAX >> 1))
+			break;
+		n *= 2;
+	}
+
+	snprintf(name, sizeof(name), "%s/%s=%zu", bm->name, bm->param, size);
+	printf("%-28s %10zu %12.1f ns/op %8.2f allocs/op", name, b.n,
+	       (double) b.ns / b.n, (double) b.allocs / b.n);
+	if (bm->hitrate)
+		printf(" %6.1f%% hits", 100.0 * b.hits / b.n);
+	if (bm->footprint)
+		printf(" %5.2f procs/op %6ld KB RSS", (double) b.procs / b.n, b.maxrss);
+	printf("\n");
+}
+
+__dead void
+usage(void) {
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-t msec] [benchmark ...]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	uint64_t mintime = 500 * 1000000ULL;
+	const char *errstr;
+	size_t idx, size;
+	int ch, i, found;
+
+	while ((ch = getopt(argc, argv, "t:")) != -1) {
+		switch (ch) {
+			case 't':
+				mintime = strtonum(optarg, 1, 60000, &errstr) * 1000000ULL;
+				if (errstr != NULL)
+					errx(1, "time is %s: %s", errstr, optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* Only warnings, as the daemon would log them */
+	log_init(STDERR_FILENO, LOG_LVL_WARN);
+
+	for (idx = 0; idx < sizeof(benchmarks) / sizeof(benchmarks[0]); idx++) {
+		found = argc == 0;
+		for (i = 0; i < argc; i++) {
+			if (!strcmp(argv[i], benchmarks[idx].name))
+				found = 1;
+		}
+		if (!found)
+			continue;
+		for (size = 0; size < sizeof(benchmarks[idx].sizes) / sizeof(size_t) &&
+		     benchmarks[idx].sizes[size] != 0; size++)
+			bench_run(&benchmarks[idx], benchmarks[idx].sizes[size], mintime);
+		log_flush();
+	}
+
+	return 0;
+}
@@ -1,11 +1,16 @@
 #ifndef _CONFIG_H
 #define _CONFIG_H
 #include <pwd.h>
+#include <sys/types.h>
 #include <sys/queue.h>
 
 enum srctype {
 	SRC_DHCPV4,
 	SRC_RTADV,
+	SRC_ROUTE,
+	SRC_SLAACD,
+	SRC_DHCPACK,
+	SRC_PUSH,
 	SRC_UNKNOWN
 };
 
@@ -18,6 +23,8 @@ struct srcspec {
 	TAILQ_ENTRY(srcspec) entry;
 	enum srctype type;
 	char *source;
+	/* -1 if the source uses the priority of its device */
+	long long priority;
 };
 
 struct srcspec_l {
@@ -27,18 +34,68 @@ struct srcspec_l {
 struct device {
 	char *device;
 	struct srcspec_l *specs;
+	/* Servers of higher priority devices come first */
+	long long priority;
+	/* Routing domain the device is in, its servers only go to that domain's DNS server */
+	int rdomain;
 	TAILQ_ENTRY(device) entry;
 };
 
+/* Largest routing domain OpenBSD supports */
+#define RDOMAIN_MAX 255
+
+/* How to reach the DNS server of a routing domain other than the default */
+struct rdomain {
+	int rdomain;
+	/* unbound configuration passed to unbound-control -c, NULL for the default */
+	char *unbound;
+};
+
 struct config {
 	TAILQ_HEAD(, device) devices;
+	char *user;
 	struct passwd *pw;
 	enum srvtype srvtype;
+	/* Number of cached names to prefetch after a forwarder switch */
+	size_t warmup;
+	/* Seconds old forwarders are kept alongside new ones */
+	long long grace;
+	/* Whether an empty set of forwarders may be passed to the server */
+	int allow_empty;
+	/* Where the server repository keeps its snapshot, if anywhere */
+	char *statefile;
+	/* Socket external programs push name servers to, and who may use it besides root */
+	char *pushsocket;
+	uid_t *pushusers;
+	size_t npushusers;
+	/* Socket dnsfooctl talks to, only root may use it */
+	char *controlsocket;
+	/* Socket the metrics of all processes are served on, if any */
+	char *metricssocket;
+	/* Address family whose servers win ties, AF_UNSPEC for none */
+	int prefer;
+	/* Upper limit on the number of servers passed on, 0 for no limit */
+	size_t maxservers;
+	/* File to log to, or syslog if `logsyslog' is set, stderr if neither */
+	char *logfile;
+	int logsyslog;
+	/* A log_level, records above it are dropped */
+	int loglevel;
+	/* File the event loop records its input to, if any, see recorder.h */
+	char *recordfile;
+	/* Program run in place of unbound-control, NULL for unbound-control */
+	char *backend;
+	/* Whether handlers parse in the event loop rather than a child per event */
+	int inline_parsers;
+	/* DNS servers of routing domains, see struct rdomain */
+	struct rdomain *rdomains;
+	size_t nrdomains;
 };
 
 typedef struct {
 	union {
 		char *string;
+		long long number;
 		struct srcspec *spec;
 		struct srcspec_l *spec_l;
 	} v;
@@ -46,4 +103,6 @@ typedef struct {
 } YYSTYPE;
 
 struct config *parse_config(char *);
+void free_config(struct config *);
+void free_device(struct device *);
 #endif /* _CONFIG_H */
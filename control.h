@@ -0,0 +1,48 @@
+#ifndef _CONTROL_H
+#define _CONTROL_H
+#include <net/if.h>
+
+#include "config.h"
+
+/*
+ * Protocol spoken between dnsfooctl(8) and the server repository over the
+ * control socket. Every request is answered with CTL_OK or CTL_FAIL, except
+ * CTL_SHOW which is answered with a CTL_SOURCE per source and a CTL_SERVERS
+ * per routing domain, followed by CTL_END.
+ */
+#define CONTROL_SOCKET "/var/run/dnsfoo.sock"
+
+enum ctl_msg_type {
+	/* Requests */
+	CTL_SHOW,
+	/* Read a source again, carries a struct source_msg */
+	CTL_RESCAN,
+	/* Hand the current servers to the upstream server again */
+	CTL_REAPPLY,
+	/* Forget the rate limit state of push clients and routers */
+	CTL_CLEAR,
+
+	/* Replies */
+	/* A struct ctl_source followed by its name servers and domains */
+	CTL_SOURCE,
+	/* An int routing domain followed by its '\0'-separated servers, in the
+	 * order they're passed on */
+	CTL_SERVERS,
+	CTL_END,
+	CTL_OK,
+	/* Carries a '\0'-terminated reason */
+	CTL_FAIL
+};
+
+struct ctl_source {
+	char device[IF_NAMESIZE];
+	int up;
+	int rdomain;
+	enum srctype type;
+	char id[64];
+	/* Seconds until the servers of this source expire, -1 if they don't */
+	long long expires;
+	size_t nslen;
+	size_t domainslen;
+};
+#endif /* _CONTROL_H */
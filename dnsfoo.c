@@ -1,6 +1,10 @@
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,18 +13,70 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/event.h>
+#include <sys/queue.h>
 #include <sys/syslimits.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include <net/if.h>
 
 #include "dnsfoo.h"
 #include "config.h"
 #include "handlers.h"
 #include "upstream_update.h"
 #include "serverrepo.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "log.h"
+
+#define CONFIG_FILE "/etc/dnsfoo.conf"
 
 struct fileinfo {
+	TAILQ_ENTRY(fileinfo) entry;
 	int fd;
 	struct kevent ev;
 	void (*handler)(int, int, void*);
+	/* Handlers for trusted input run in the event loop instead of a child */
+	int inproc;
+};
+
+TAILQ_HEAD(fileinfo_l, fileinfo);
+
+/* Receive router advertisements for all rtadv sources, one per routing domain */
+struct handler_info **rtadv_rxs;
+size_t nrtadv_rxs;
+/* The recording played back instead of reading real sources, see dnsfoo -r */
+struct replay *replay;
+/* Set if handlers run in the event loop instead of a child of their own */
+int handlers_inline;
+
+const char *srcnames[] = {
+	[SRC_DHCPV4] = "DHCPv4",
+	[SRC_RTADV]  = "RTADV",
+	[SRC_ROUTE]  = "route",
+	[SRC_SLAACD] = "slaacd",
+	[SRC_DHCPACK] = "DHCPACK",
+	[SRC_PUSH]   = "push",
+};
+/* What the event loop reports on the metrics socket */
+enum { HIST_HANDLER };
+struct histogram evloop_hists[] = {
+	[HIST_HANDLER] = { "dnsfoo_handler_seconds",
+	                   "Time from an event until its handler, run in a child, is done" },
+};
+enum { CNT_RUNS, CNT_FAILURES, CNT_FILTERED, CNT_RATELIMITED };
+struct counter evloop_counters[] = {
+	[CNT_RUNS] = { "dnsfoo_handler_runs_total", "Handlers run in a child" },
+	[CNT_FAILURES] = { "dnsfoo_handler_failures_total", "Handlers that didn't exit cleanly" },
+	[CNT_FILTERED] = { "dnsfoo_rtadv_filtered_total",
+	                   "Router advertisements without name server information" },
+	[CNT_RATELIMITED] = { "dnsfoo_rtadv_ratelimited_total",
+	                      "Router advertisements over the rate limit" },
+};
+
+const char *srvnames[] = {
+	[SRV_UNBOUND] = "unbound",
+	[SRV_REBOUND] = "rebound",
 };
 
 int
@@ -44,122 +100,1263 @@ privdrop(struct config *conf) {
 	return 1;
 }
 
+/* Open the file or socket for a source. This needs root, so only the parent does it */
 int
-eventloop(struct fileinfo *fi, ssize_t nfi, int msg_fd, struct config *config) {
+source_open(struct source_msg *src) {
+	switch (src->type) {
+		case SRC_DHCPV4:
+			return dhcpv4_open(src->source);
+		case SRC_RTADV:
+			return rtadv_open(src->rdomain);
+		case SRC_DHCPACK:
+			return dhcpack_open(src->device);
+		default:
+			errx(1, "unknown source type %d", src->type);
+	}
+	return -1;
+}
+
+/* Sources fed by the routing socket have nothing of their own to open */
+int
+source_has_fd(enum srctype type) {
+	return type != SRC_SLAACD;
+}
+
+/* The receiver for router advertisements in `rdomain', NULL if there is none yet */
+struct handler_info *
+rtadv_rx_find(int rdomain) {
+	size_t idx;
+
+	for (idx = 0; idx < nrtadv_rxs; idx++) {
+		if (rtadv_rxs[idx]->v.rtadv.rdomain == rdomain)
+			return rtadv_rxs[idx];
+	}
+	return NULL;
+}
+
+/* The receiver reading from `sock', NULL if it isn't one */
+struct handler_info *
+rtadv_rx_lookup(int sock) {
+	size_t idx;
+
+	for (idx = 0; idx < nrtadv_rxs; idx++) {
+		if (rtadv_rxs[idx]->sock == sock)
+			return rtadv_rxs[idx];
+	}
+	return NULL;
+}
+
+/* Set up the handler for a source whose file or socket is already open */
+struct fileinfo *
+fileinfo_add(struct fileinfo_l *fil, enum srctype type, const char *device, const char *source,
+             int rdomain, int fd) {
+	static int replay_ifindex;
+	struct handler_info *info, *rx;
+	struct fileinfo *fi;
+
+	if ((fi = calloc(1, sizeof(*fi))) == NULL)
+		err(1, "calloc");
+
+	switch (type) {
+		case SRC_DHCPV4:
+			info = dhcpv4_setup_handler(device, source, fd);
+			fi->handler = dhcpv4_handle_update;
+			break;
+		case SRC_RTADV:
+			/* The first socket of a domain is kept for everyone in it, see eventloop_rtadv() */
+			if ((rx = rtadv_rx_find(rdomain)) == NULL) {
+				rtadv_rxs = reallocarray(rtadv_rxs, nrtadv_rxs + 1, sizeof(*rtadv_rxs));
+				if (rtadv_rxs == NULL)
+					err(1, "reallocarray");
+				rx = rtadv_rxs[nrtadv_rxs++] = rtadv_setup_receiver(fd, rdomain);
+			} else if (fd >= 0)
+				close(fd);
+			fd = -1;
+			/* Played back interfaces needn't exist, they're just numbered */
+			info = rtadv_setup_handler(device, rx, replay != NULL? ++replay_ifindex: 0);
+			fi->handler = rtadv_handle_update;
+			break;
+		case SRC_ROUTE:
+			info = route_setup_handler();
+			fi->handler = route_handle_update;
+			fi->inproc = 1;
+			break;
+		case SRC_SLAACD:
+			info = slaacd_setup_handler(device);
+			break;
+		case SRC_DHCPACK:
+			info = dhcpack_setup_handler(device, fd);
+			fi->handler = dhcpack_handle_update;
+			break;
+		default:
+			errx(1, "unknown source type %d", type);
+	}
+
+	if (info == NULL) {
+		if (fd >= 0)
+			close(fd);
+		free(fi);
+		return NULL;
+	}
+
+	/* rtadv and slaacd sources aren't watched themselves */
+	fi->fd = (type == SRC_RTADV || type == SRC_SLAACD)? -1: info->sock;
+	EV_SET(&fi->ev, fi->fd, info->kq_event, EV_ADD | EV_CLEAR, info->kq_note, 0, info);
+	TAILQ_INSERT_TAIL(fil, fi, entry);
+
+	return fi;
+}
+
+void
+fileinfo_remove(struct fileinfo_l *fil, struct fileinfo *fi) {
+	struct handler_info *info = fi->ev.udata;
+	struct handler_info *rx = (info->type == SRC_RTADV)? info->v.rtadv.rx: NULL;
+	size_t idx;
+
+	TAILQ_REMOVE(fil, fi, entry);
+	/* Closing the descriptor also removes it from the kqueue */
+	if (fi->fd >= 0)
+		close(fi->fd);
+	free(info->device);
+	free(info->source);
+	free(info);
+	free(fi);
+
+	if (rx == NULL)
+		return;
+	TAILQ_FOREACH(fi, fil, entry) {
+		info = fi->ev.udata;
+		if (info->type == SRC_RTADV && info->v.rtadv.rx == rx)
+			return;
+	}
+	for (idx = 0; rtadv_rxs[idx] != rx; idx++)
+		;
+	rtadv_rxs[idx] = rtadv_rxs[--nrtadv_rxs];
+	rtadv_free_receiver(rx);
+}
+
+/* Add `fi' to the kqueue */
+void
+fileinfo_watch(int kq, struct fileinfo *fi) {
 	struct kevent ev;
-	int kq, status;
-	off_t idx;
+
+	struct handler_info *info = fi->ev.udata;
+
+	if (fi->fd >= 0 && kevent(kq, &fi->ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent for FD %d", fi->fd);
+
+	/* Played back advertisements don't come from a socket */
+	if (info->type != SRC_RTADV || info->v.rtadv.rx->sock < 0)
+		return;
+	EV_SET(&ev, info->v.rtadv.rx->sock, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, info->v.rtadv.rx);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent for FD %d", info->v.rtadv.rx->sock);
+}
+
+/* Whether `fi' is the source described by `smsg' */
+int
+fileinfo_matches(struct fileinfo *fi, struct source_msg *smsg) {
+	struct handler_info *info = fi->ev.udata;
+
+	return info->type == smsg->type && !strcmp(info->device, smsg->device) &&
+	       (info->source == NULL || !strcmp(info->source, smsg->source));
+}
+
+/*
+ * Run the handler for `fi' in a child, so a bug in a parser can't take us down.
+ * With inline-parsers it runs right here, which saves a fork per event.
+ */
+void
+eventloop_run_handler(struct fileinfo *fi, int msg_fd) {
+	struct handler_info *info = fi->ev.udata;
+	int status;
+	pid_t child;
+
+	if (info->type == SRC_DHCPV4)
+		recorder_lease(info->device, fi->fd);
+
+	trace_begin();
+	if (handlers_inline) {
+		fi->handler(fi->fd, msg_fd, fi->ev.udata);
+		metrics_observe(&evloop_hists[HIST_HANDLER], metrics_now() - trace_current.t_event);
+		evloop_counters[CNT_RUNS].value++;
+		return;
+	}
+
+	log_flush();
+	child = fork();
+
+	if (child == -1)
+		err(1, "fork");
+	else if (child == 0) {
+		fi->handler(fi->fd, msg_fd, fi->ev.udata);
+		exit(0);
+	}
+
+	waitpid(child, &status, 0);
+	metrics_observe(&evloop_hists[HIST_HANDLER], metrics_now() - trace_current.t_event);
+	evloop_counters[CNT_RUNS].value++;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		return;
+	evloop_counters[CNT_FAILURES].value++;
+	if (WIFEXITED(status))
+		log_warnx("handler failed pid=%d status=%d", child, WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		log_warnx("handler failed pid=%d signal=%d core=%d", child,
+		          WTERMSIG(status), WCOREDUMP(status)? 1: 0);
+}
+
+/* Send our metrics to the repository, at most once a second unless `force' is set */
+void
+eventloop_metrics(int msg_fd, int force) {
+	static time_t last;
+	unsigned long long filtered, ratelimited;
+	size_t idx;
+
+	if (!force && last == time(NULL))
+		return;
+	last = time(NULL);
+
+	/* Receivers that went away take their counts with them */
+	for (idx = 0, filtered = 0, ratelimited = 0; idx < nrtadv_rxs; idx++) {
+		filtered += rtadv_rxs[idx]->v.rtadv.filtered;
+		ratelimited += rtadv_rxs[idx]->v.rtadv.ratelimited;
+	}
+	evloop_counters[CNT_FILTERED].value = filtered;
+	evloop_counters[CNT_RATELIMITED].value = ratelimited;
+	metrics_send(msg_fd, evloop_hists, sizeof(evloop_hists) / sizeof(evloop_hists[0]),
+	             evloop_counters, sizeof(evloop_counters) / sizeof(evloop_counters[0]));
+}
+
+/* Ask the parent to open the sources the configuration has for `ifname' */
+void
+eventloop_request_sources(struct imsgbuf *pbuf, const char *ifname) {
+	struct link_state_msg ls;
+
+	memset(&ls, 0x00, sizeof(ls));
+	(void) strlcpy(ls.device, ifname, sizeof(ls.device));
+	ls.up = 1;
+
+	if (imsg_compose(pbuf, MSG_IFACE_ARRIVAL, 0, 0, -1, &ls, sizeof(ls)) < 0)
+		err(1, "imsg_compose");
+	if (imsg_flush(pbuf) < 0)
+		err(1, "imsg_flush");
+}
+
+/* Ask slaacd for its current proposals, they come in on the routing socket */
+void
+eventloop_slaacd_solicit(struct fileinfo_l *fil) {
+	struct handler_info *info;
+	struct fileinfo *fi;
+
+	TAILQ_FOREACH(fi, fil, entry) {
+		info = fi->ev.udata;
+		if (info->type == SRC_ROUTE) {
+			slaacd_solicit(fi->fd);
+			return;
+		}
+	}
+}
+
+/* Pass the name servers slaacd proposed on to the sources for their interfaces */
+void
+eventloop_proposals(struct fileinfo_l *fil, struct handler_info *rinfo, int msg_fd) {
+	struct route_proposal *p;
+	struct handler_info *info;
+	struct fileinfo *fi;
+	size_t idx;
+
+	for (idx = 0; idx < rinfo->v.route.nproposals; idx++) {
+		p = &rinfo->v.route.proposals[idx];
+		TAILQ_FOREACH(fi, fil, entry) {
+			info = fi->ev.udata;
+			if (info->type == SRC_SLAACD && info->v.slaacd.ifindex == p->ifindex)
+				slaacd_send_update(info, msg_fd, p->ns, p->nslen);
+		}
+		free(p->ns);
+	}
+
+	free(rinfo->v.route.proposals);
+	rinfo->v.route.proposals = NULL;
+	rinfo->v.route.nproposals = 0;
+}
+
+/* Hand advertisement `idx' of the last batch of `rx' to the source for the interface it arrived on */
+void
+eventloop_rtadv_packet(int kq, struct fileinfo_l *fil, int msg_fd, struct handler_info *rx,
+                       int idx) {
+	struct mmsghdr *m = &rx->v.rtadv.msgs[idx];
+	struct handler_info *info = NULL;
+	struct fileinfo *fi;
+	int ifindex, hlim;
+
+	rtadv_packet_info(rx, idx, &ifindex, &hlim);
+	TAILQ_FOREACH(fi, fil, entry) {
+		info = fi->ev.udata;
+		if (info->type == SRC_RTADV && info->v.rtadv.rx == rx &&
+		    info->v.rtadv.ifindex == ifindex)
+			break;
+	}
+	if (recorder_active())
+		recorder_rtadv(fi != NULL? info->device: NULL, &rx->v.rtadv.from[idx].sin6_addr,
+		               ifindex, hlim, m->msg_hdr.msg_iov[0].iov_base, m->msg_len);
+
+	if (rtadv_packet_ifindex(rx, idx) == 0 || fi == NULL)
+		return;
+
+	/* A router answered, no need to keep soliciting */
+	rtadv_solicit_stop(kq, info);
+
+	if (!rtadv_packet_has_dns(rx, idx)) {
+		rx->v.rtadv.filtered++;
+		return;
+	}
+	if (!rtadv_ratelimit(rx, info, idx))
+		return;
+	rx->v.rtadv.cur = idx;
+	eventloop_run_handler(fi, msg_fd);
+}
+
+/*
+ * Read everything queued on the rtadv socket of `rx', a batch at a time, and
+ * hand each advertisement to the source for the interface it arrived on.
+ * However many rtadv sources a routing domain has, an advertisement is only
+ * received once, and only those with name server information from routers
+ * and interfaces within their rate cost a fork.
+ */
+void
+eventloop_rtadv(int kq, struct fileinfo_l *fil, int msg_fd, struct handler_info *rx) {
+	int idx, n;
+
+	do {
+		n = rtadv_receive(rx);
+		for (idx = 0; idx < n; idx++)
+			eventloop_rtadv_packet(kq, fil, msg_fd, rx, idx);
+	} while (n == RTADV_BATCH);
+
+	log_debug("rtadv totals rdomain=%d filtered=%llu ratelimited=%llu", rx->v.rtadv.rdomain,
+	          rx->v.rtadv.filtered, rx->v.rtadv.ratelimited);
+}
+
+/*
+ * Solicit router advertisements on interfaces that just came up. Lease files
+ * of new interfaces may only have appeared by now, so the parent gets another
+ * chance to open them.
+ */
+void
+eventloop_links_up(int kq, struct fileinfo_l *fil, struct handler_info *rinfo,
+                   struct imsgbuf *pbuf) {
+	struct handler_info *info;
+	struct fileinfo *fi;
+	char ifname[IF_NAMESIZE];
+	size_t up;
+
+	for (up = 0; up < rinfo->v.route.ncame_up; up++) {
+		if (if_indextoname(rinfo->v.route.came_up[up], ifname) != NULL)
+			eventloop_request_sources(pbuf, ifname);
+
+		TAILQ_FOREACH(fi, fil, entry) {
+			info = fi->ev.udata;
+			if (info->type == SRC_RTADV &&
+			    info->v.rtadv.ifindex == rinfo->v.route.came_up[up])
+				rtadv_solicit_start(kq, info);
+		}
+	}
+	rinfo->v.route.ncame_up = 0;
+}
+
+/* A lease parser of the initial synchronization and the socket it writes to */
+struct sync_child {
+	pid_t pid;
+	struct imsgbuf ibuf;
+};
+
+/*
+ * Parse all lease files in parallel before we start waiting for changes and
+ * tell the server repository when we're done, so it can push one consolidated
+ * state instead of one update per file. Every parser writes to a socket of its
+ * own, and only whole messages are passed on to the repository, so partial
+ * writes of parsers running at the same time can't end up interleaved.
+ */
+void
+eventloop_sync(struct fileinfo_l *fil, int msg_fd) {
+	struct handler_info *info;
+	struct fileinfo *fi;
+	struct sync_child *children = NULL;
+	struct pollfd *pfds = NULL;
+	struct imsgbuf ibuf;
+	struct imsg imsg;
+	size_t nchildren = 0, running, idx;
+	ssize_t n;
+	pid_t child;
+	int sp[2];
+
+	imsg_init(&ibuf, msg_fd);
+
+	TAILQ_FOREACH(fi, fil, entry) {
+		info = fi->ev.udata;
+		if (info->type != SRC_DHCPV4)
+			continue;
+
+		recorder_lease(info->device, fi->fd);
+		if (handlers_inline) {
+			fi->handler(fi->fd, msg_fd, info);
+			continue;
+		}
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sp) < 0)
+			err(1, "socketpair");
+		log_flush();
+		child = fork();
+		if (child == -1)
+			err(1, "fork");
+		else if (child == 0) {
+			close(sp[0]);
+			fi->handler(fi->fd, sp[1], info);
+			exit(0);
+		}
+		close(sp[1]);
+
+		if ((children = reallocarray(children, nchildren + 1, sizeof(*children))) == NULL ||
+		    (pfds = reallocarray(pfds, nchildren + 1, sizeof(*pfds))) == NULL)
+			err(1, "reallocarray");
+		children[nchildren].pid = child;
+		imsg_init(&children[nchildren].ibuf, sp[0]);
+		pfds[nchildren].fd = sp[0];
+		pfds[nchildren].events = POLLIN;
+		nchildren++;
+	}
+
+	for (running = nchildren; running > 0;) {
+		if (poll(pfds, nchildren, INFTIM) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		for (idx = 0; idx < nchildren; idx++) {
+			if (pfds[idx].fd < 0 || pfds[idx].revents == 0)
+				continue;
+			if ((n = imsg_read(&children[idx].ibuf)) == -1 && errno == EAGAIN)
+				continue;
+			if (n > 0) {
+				while ((n = imsg_get(&children[idx].ibuf, &imsg)) > 0) {
+					if (imsg_compose(&ibuf, imsg.hdr.type, 0, 0, -1, imsg.data,
+					                 imsg.hdr.len - IMSG_HEADER_SIZE) < 0)
+						err(1, "imsg_compose");
+					imsg_free(&imsg);
+				}
+				if (imsg_flush(&ibuf) < 0)
+					err(1, "imsg_flush");
+				if (n == 0)
+					continue;
+			}
+			/* The parser is done, or failed and said why */
+			imsg_clear(&children[idx].ibuf);
+			close(pfds[idx].fd);
+			pfds[idx].fd = -1;
+			running--;
+		}
+	}
+
+	for (idx = 0; idx < nchildren; idx++) {
+		if (waitpid(children[idx].pid, NULL, 0) < 0)
+			err(1, "waitpid");
+	}
+	free(children);
+	free(pfds);
+
+	/* Everything the parsers sent is queued before this */
+	log_info("initial synchronization done");
+
+	if (imsg_compose(&ibuf, MSG_SYNC_DONE, 0, 0, -1, NULL, 0) < 0)
+		err(1, "imsg_compose");
+	if (imsg_flush(&ibuf) < 0)
+		err(1, "imsg_flush");
+}
+
+/* Close the sources matching `smsg' and forget what was learned from them */
+void
+eventloop_source_del(int kq, struct fileinfo_l *fil, int msg_fd, struct source_msg *smsg) {
+	struct handler_info *info;
+	struct fileinfo *fi, *tmp;
+	struct imsgbuf ibuf;
+
+	TAILQ_FOREACH_SAFE(fi, fil, entry, tmp) {
+		if (!fileinfo_matches(fi, smsg))
+			continue;
+		info = fi->ev.udata;
+		if (info->type == SRC_RTADV)
+			rtadv_solicit_stop(kq, info);
+		fileinfo_remove(fil, fi);
+	}
+	log_info("source removed dev=%s type=%s", smsg->device, srcnames[smsg->type]);
+
+	imsg_init(&ibuf, msg_fd);
+	if (imsg_compose(&ibuf, MSG_SOURCE_DEL, 0, 0, -1, smsg, sizeof(*smsg)) < 0)
+		err(1, "imsg_compose");
+	if (imsg_flush(&ibuf) < 0)
+		err(1, "imsg_flush");
+}
+
+/* Act on interfaces the routing socket saw arriving or departing */
+void
+eventloop_announce(int kq, struct fileinfo_l *fil, struct handler_info *rinfo, int msg_fd,
+                   struct imsgbuf *pbuf) {
+	struct link_announce *a;
+	struct handler_info *info;
+	struct source_msg smsg;
+	struct fileinfo *fi;
+	size_t idx;
+
+	for (idx = 0; idx < rinfo->v.route.nannounced; idx++) {
+		a = &rinfo->v.route.announced[idx];
+		if (a->arrived) {
+			eventloop_request_sources(pbuf, a->name);
+			continue;
+		}
+
+		/* Sources of a departed interface go away, they come back if it does */
+		for (;;) {
+			TAILQ_FOREACH(fi, fil, entry) {
+				info = fi->ev.udata;
+				if (info->type != SRC_ROUTE && !strcmp(info->device, a->name))
+					break;
+			}
+			if (fi == NULL)
+				break;
+			memset(&smsg, 0x00, sizeof(smsg));
+			smsg.type = info->type;
+			(void) strlcpy(smsg.device, info->device, sizeof(smsg.device));
+			if (info->source != NULL)
+				(void) strlcpy(smsg.source, info->source, sizeof(smsg.source));
+			eventloop_source_del(kq, fil, msg_fd, &smsg);
+		}
+	}
+
+	free(rinfo->v.route.announced);
+	rinfo->v.route.announced = NULL;
+	rinfo->v.route.nannounced = 0;
+}
+
+/* Have a source tell us what it knows right now */
+void
+eventloop_refresh(int kq, struct fileinfo_l *fil, struct fileinfo *fi, int msg_fd) {
+	struct handler_info *info = fi->ev.udata;
+
+	switch (info->type) {
+		case SRC_RTADV:
+			rtadv_solicit_start(kq, info);
+			break;
+		case SRC_SLAACD:
+			eventloop_slaacd_solicit(fil);
+			break;
+		case SRC_DHCPACK:
+			/* There's nothing to read before the next acknowledgement */
+			break;
+		default:
+			eventloop_run_handler(fi, msg_fd);
+			break;
+	}
+}
+
+/* Handle requests that dnsfooctl sent through the server repository */
+void
+eventloop_handle_repo(int kq, struct imsgbuf *rbuf, struct fileinfo_l *fil, int msg_fd) {
+	struct handler_info *info;
+	struct source_msg smsg;
+	struct fileinfo *fi;
+	struct imsg imsg;
+	size_t idx;
+	ssize_t n;
+
+	if ((n = imsg_read(rbuf)) == -1 || n == 0)
+		err(1, "imsg_read");
+
+	while ((n = imsg_get(rbuf, &imsg)) > 0) {
+		switch (imsg.hdr.type) {
+			case MSG_SOURCE_RESCAN:
+				if (imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(smsg))
+					errx(1, "invalid source message");
+				memcpy(&smsg, imsg.data, sizeof(smsg));
+				smsg.device[sizeof(smsg.device) - 1] = '\0';
+				smsg.source[sizeof(smsg.source) - 1] = '\0';
+				/* Without a source, every source of that type on the device is read */
+				TAILQ_FOREACH(fi, fil, entry) {
+					info = fi->ev.udata;
+					if (info->type != smsg.type || strcmp(info->device, smsg.device))
+						continue;
+					if (smsg.source[0] != '\0' &&
+					    (info->source == NULL || strcmp(info->source, smsg.source)))
+						continue;
+					log_info("source rescan dev=%s type=%s", smsg.device, srcnames[smsg.type]);
+					eventloop_refresh(kq, fil, fi, msg_fd);
+				}
+				break;
+			case MSG_RATELIMIT_CLEAR:
+				for (idx = 0; idx < nrtadv_rxs; idx++)
+					rtadv_rxs[idx]->v.rtadv.nrouters = 0;
+				TAILQ_FOREACH(fi, fil, entry) {
+					info = fi->ev.udata;
+					if (info->type == SRC_RTADV)
+						info->v.rtadv.bucket.last = 0;
+				}
+				break;
+			default:
+				errx(1, "unknown IMSG received: %d", imsg.hdr.type);
+		}
+		imsg_free(&imsg);
+	}
+	if (n == -1)
+		err(1, "imsg_get");
+}
+
+/* Add or remove sources as requested by the parent */
+void
+eventloop_handle_parent(int kq, struct imsgbuf *pbuf, struct fileinfo_l *fil, int msg_fd) {
+	struct source_msg smsg;
+	struct fileinfo *fi;
+	struct imsgbuf ibuf;
+	struct imsg imsg;
+	ssize_t n;
+
+	if ((n = imsg_read(pbuf)) == -1 || n == 0)
+		err(1, "imsg_read");
+
+	while ((n = imsg_get(pbuf, &imsg)) > 0) {
+		/* The device statements of a reload are for the repository */
+		if (imsg.hdr.type == MSG_CONFIG_DEVICE || imsg.hdr.type == MSG_CONFIG_DONE) {
+			imsg_init(&ibuf, msg_fd);
+			if (imsg_compose(&ibuf, imsg.hdr.type, 0, 0, -1, imsg.data,
+			                 imsg.hdr.len - IMSG_HEADER_SIZE) < 0)
+				err(1, "imsg_compose");
+			if (imsg_flush(&ibuf) < 0)
+				err(1, "imsg_flush");
+			imsg_free(&imsg);
+			continue;
+		}
+
+		if (imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(smsg))
+			errx(1, "invalid source message");
+		memcpy(&smsg, imsg.data, sizeof(smsg));
+		smsg.device[sizeof(smsg.device) - 1] = '\0';
+		smsg.source[sizeof(smsg.source) - 1] = '\0';
+
+		switch (imsg.hdr.type) {
+			case MSG_SOURCE_ADD:
+				if (imsg.fd < 0 && source_has_fd(smsg.type))
+					errx(1, "source message without descriptor");
+				/* The parent opens sources again whenever an interface comes up */
+				TAILQ_FOREACH(fi, fil, entry) {
+					if (fileinfo_matches(fi, &smsg))
+						break;
+				}
+				if (fi != NULL) {
+					if (imsg.fd >= 0)
+						close(imsg.fd);
+					break;
+				}
+				if ((fi = fileinfo_add(fil, smsg.type, smsg.device, smsg.source, smsg.rdomain,
+				                       imsg.fd)) == NULL)
+					break;
+				fileinfo_watch(kq, fi);
+				log_info("source added dev=%s type=%s", smsg.device, srcnames[smsg.type]);
+				/* Pick up what the new source already knows */
+				eventloop_refresh(kq, fil, fi, msg_fd);
+				break;
+			case MSG_SOURCE_DEL:
+				eventloop_source_del(kq, fil, msg_fd, &smsg);
+				break;
+			default:
+				errx(1, "unknown IMSG received: %d", imsg.hdr.type);
+		}
+		imsg_free(&imsg);
+	}
+	if (n == -1)
+		err(1, "imsg_get");
+}
+
+/* Feed a recorded entry to the source it was recorded for */
+void
+eventloop_replay_entry(int kq, struct fileinfo_l *fil, int msg_fd, struct rec_entry *e,
+                       char *data) {
+	struct handler_info *info;
+	struct fileinfo *fi;
+	int ifindex = 0;
+
+	switch (e->kind) {
+		case REC_LEASE:
+			TAILQ_FOREACH(fi, fil, entry) {
+				info = fi->ev.udata;
+				if (info->type == SRC_DHCPV4 && !strcmp(info->device, e->device))
+					break;
+			}
+			if (fi == NULL)
+				break;
+			if (ftruncate(fi->fd, 0) < 0 ||
+			    pwrite(fi->fd, data, e->len, 0) != (ssize_t) e->len)
+				err(1, "replay: lease file for %s", e->device);
+			eventloop_run_handler(fi, msg_fd);
+			break;
+		case REC_RTADV:
+			/* Recordings don't know about routing domains, everything is played back in one */
+			if (nrtadv_rxs == 0)
+				break;
+			/* Advertisements nobody wanted arrive on an interface without a source */
+			TAILQ_FOREACH(fi, fil, entry) {
+				info = fi->ev.udata;
+				if (info->type == SRC_RTADV && !strcmp(info->device, e->device))
+					ifindex = info->v.rtadv.ifindex;
+			}
+			rtadv_inject(rtadv_rxs[0], &e->from, ifindex, e->hlim, data, e->len);
+			eventloop_rtadv_packet(kq, fil, msg_fd, rtadv_rxs[0], 0);
+			break;
+	}
+}
+
+/*
+ * Play back the entries of the recording that are due and wait for the next
+ * one. Once everything has been played back, the upstream updater is told
+ * so, it reports and exits.
+ */
+void
+eventloop_replay(int kq, struct fileinfo_l *fil, int msg_fd) {
+	struct imsgbuf ibuf;
+	struct kevent ev;
+	uint64_t now, due;
+
+	if (replay->start == 0)
+		replay->start = metrics_now();
+
+	while (replay_peek(replay)) {
+		now = metrics_now();
+		due = replay->start + (replay->speed > 0? replay->next.t / replay->speed: 0);
+		if (due > now) {
+			/* Timers count milliseconds */
+			EV_SET(&ev, 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0,
+			       (due - now + 999999) / 1000000, NULL);
+			if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+				err(1, "kevent");
+			return;
+		}
+		eventloop_replay_entry(kq, fil, msg_fd, &replay->next, replay->data);
+		replay_consume(replay);
+	}
+
+	log_info("replay done");
+	eventloop_metrics(msg_fd, 1);
+	imsg_init(&ibuf, msg_fd);
+	if (imsg_compose(&ibuf, MSG_REPLAY_DONE, 0, 0, -1, NULL, 0) < 0)
+		err(1, "imsg_compose");
+	if (imsg_flush(&ibuf) < 0)
+		err(1, "imsg_flush");
+}
+
+int
+eventloop(struct fileinfo_l *fil, int msg_fd, int parent_fd, struct config *config) {
+	struct handler_info *info, *rx;
+	struct fileinfo *fi;
+	struct imsgbuf pbuf, rbuf;
+	struct kevent ev;
+	int kq;
 
 	setproctitle("event loop");
+	log_procname("event loop");
 
 	if (!privdrop(config))
 		err(1, "privdrop");
+	handlers_inline = config->inline_parsers;
 
 	if ((kq = kqueue()) < 0) {
 		err(1, "kqueue");
 	}
 
-	for (idx = 0; idx < nfi; idx++) {
-		if (kevent(kq, &fi[idx].ev, 1, NULL, 0, NULL) < 0) {
-			err(1, "kevent for FD %d", fi[idx].fd);
-		}
+	/* Played back sources only change when the recording says so */
+	TAILQ_FOREACH(fi, fil, entry) {
+		if (replay != NULL)
+			break;
+		fileinfo_watch(kq, fi);
+		info = fi->ev.udata;
+		if (info->type == SRC_RTADV)
+			rtadv_solicit_start(kq, info);
 	}
 
-	while (1) {
-		pid_t child;
+	imsg_init(&pbuf, parent_fd);
+	EV_SET(&ev, parent_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+
+	/* Handlers only write to the repository, requests come back the same way */
+	imsg_init(&rbuf, msg_fd);
+	EV_SET(&ev, msg_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+
+	eventloop_sync(fil, msg_fd);
+	eventloop_slaacd_solicit(fil);
+	if (replay != NULL)
+		eventloop_replay(kq, fil, msg_fd);
 
+	while (1) {
+		log_flush();
 		if (kevent(kq, NULL, 0, &ev, 1, NULL) < 1) {
 			err(1, "kevent");
 		}
 
-		child = fork();
+		/* Timers are for router solicitations and playback */
+		if (ev.filter == EVFILT_TIMER) {
+			if (ev.udata == NULL)
+				eventloop_replay(kq, fil, msg_fd);
+			else
+				rtadv_solicit(kq, ev.udata);
+			continue;
+		}
 
-		if (child == -1)
-			err(1, "fork");
-		else if (child == 0) {
-			for (idx = 0; idx < nfi; idx++) {
-				if (ev.ident != fi[idx].fd)
-					continue;
-				fi[idx].handler(ev.ident, msg_fd, ev.udata);
-				exit(0);
+		if (ev.ident == parent_fd) {
+			eventloop_handle_parent(kq, &pbuf, fil, msg_fd);
+			continue;
+		}
+
+		if (ev.ident == msg_fd) {
+			eventloop_handle_repo(kq, &rbuf, fil, msg_fd);
+			continue;
+		}
+
+		if ((rx = rtadv_rx_lookup(ev.ident)) != NULL) {
+			eventloop_rtadv(kq, fil, msg_fd, rx);
+			/* Floods are counted, but not reported more than once a second */
+			eventloop_metrics(msg_fd, 0);
+			continue;
+		}
+
+		TAILQ_FOREACH(fi, fil, entry) {
+			if (ev.ident == fi->fd)
+				break;
+		}
+		if (fi == NULL)
+			errx(1, "Unknown file handle %d", (int) ev.ident);
+
+		info = ev.udata;
+		if (fi->inproc) {
+			trace_begin();
+			fi->handler(ev.ident, msg_fd, ev.udata);
+			if (info->type == SRC_ROUTE) {
+				eventloop_proposals(fil, info, msg_fd);
+				eventloop_announce(kq, fil, info, msg_fd, &pbuf);
+				eventloop_links_up(kq, fil, info, &pbuf);
 			}
+			continue;
+		}
+
+		eventloop_run_handler(fi, msg_fd);
+		eventloop_metrics(msg_fd, 1);
+	}
 
-			err(1, "Unknown file handle %d", (int) ev.ident);
+	return 1;
+}
+
+/* Whether a device statement names a pattern rather than a single interface */
+int
+device_is_pattern(struct device *dev) {
+	return strpbrk(dev->device, "*?[") != NULL;
+}
+
+/* Copy the source template `tmpl' to `buf', replacing each "%s" with `ifname' */
+int
+source_expand(char *buf, size_t len, const char *tmpl, const char *ifname) {
+	const char *p;
+	size_t off = 0, n;
+
+	buf[0] = '\0';
+	if (tmpl == NULL)
+		return 1;
+
+	while ((p = strstr(tmpl, "%s")) != NULL) {
+		n = p - tmpl;
+		if (off + n + strlen(ifname) >= len)
+			return 0;
+		memcpy(buf + off, tmpl, n);
+		memcpy(buf + off + n, ifname, strlen(ifname));
+		off += n + strlen(ifname);
+		tmpl = p + 2;
+	}
+	if (off + strlen(tmpl) >= len)
+		return 0;
+	memcpy(buf + off, tmpl, strlen(tmpl) + 1);
+
+	return 1;
+}
+
+/* A source that moved to another routing domain is a different one */
+int
+source_msg_equal(struct source_msg *a, struct source_msg *b) {
+	return a->type == b->type && !strcmp(a->device, b->device) &&
+	       !strcmp(a->source, b->source) && a->rdomain == b->rdomain;
+}
+
+int
+source_list_contains(struct source_msg *srcs, size_t n, struct source_msg *s) {
+	size_t idx;
+
+	for (idx = 0; idx < n; idx++) {
+		if (source_msg_equal(&srcs[idx], s))
+			return 1;
+	}
+	return 0;
+}
+
+/* Append the sources of `dev' on interface `ifname' to `srcs' */
+struct source_msg *
+config_sources_append(struct source_msg *srcs, size_t *n, const char *ifname, struct device *dev) {
+	struct source_msg s;
+	struct srcspec *spec;
+
+	TAILQ_FOREACH(spec, &dev->specs->l, entry) {
+		memset(&s, 0x00, sizeof(s));
+		s.type = spec->type;
+		s.rdomain = dev->rdomain;
+		(void) strlcpy(s.device, ifname, sizeof(s.device));
+		if (!source_expand(s.source, sizeof(s.source), spec->source, ifname)) {
+			log_warnx("%s source for device %s is too long",
+			      srcnames[spec->type], ifname);
+			continue;
 		}
+		/* More than one pattern may match an interface */
+		if (source_list_contains(srcs, *n, &s))
+			continue;
+		if ((srcs = reallocarray(srcs, *n + 1, sizeof(*srcs))) == NULL)
+			err(1, "reallocarray");
+		srcs[(*n)++] = s;
+	}
 
-		waitpid(child, &status, 0);
-#ifndef NDEBUG
-		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+	return srcs;
+}
+
+/*
+ * List the sources `config' asks for on the interfaces that exist right now,
+ * or only those for `ifname' if it isn't NULL. Devices given by name are
+ * listed whether their interface exists or not.
+ */
+struct source_msg *
+config_sources(struct config *config, const char *ifname, size_t *n) {
+	struct if_nameindex *ifs = NULL, *ifp;
+	struct source_msg *srcs = NULL;
+	struct device *dev;
+
+	*n = 0;
+	TAILQ_FOREACH(dev, &config->devices, entry) {
+		if (!device_is_pattern(dev)) {
+			if (ifname == NULL || !strcmp(dev->device, ifname))
+				srcs = config_sources_append(srcs, n, dev->device, dev);
+			continue;
+		}
+
+		if (ifname != NULL) {
+			if (fnmatch(dev->device, ifname, 0) == 0)
+				srcs = config_sources_append(srcs, n, ifname, dev);
 			continue;
-		fprintf(stderr, "%llu: Event handler %d exited with ", time(NULL), child);
-		if (WIFEXITED(status)) {
-			fprintf(stderr, "%llu: status %d\n", time(NULL), WEXITSTATUS(status));
-		} else if (WIFSIGNALED(status)) {
-			fprintf(stderr, "%llu: signal %d%s\n",
-			        time(NULL),
-			        WTERMSIG(status),
-			        WCOREDUMP(status)? " (core dumped)": "");
 		}
-#endif
+
+		if (ifs == NULL && (ifs = if_nameindex()) == NULL)
+			err(1, "if_nameindex");
+		for (ifp = ifs; ifp->if_index != 0; ifp++) {
+			if (fnmatch(dev->device, ifp->if_name, 0) == 0)
+				srcs = config_sources_append(srcs, n, ifp->if_name, dev);
+		}
 	}
 
+	if (ifs != NULL)
+		if_freenameindex(ifs);
+	return srcs;
+}
+
+void
+parent_send_source(struct imsgbuf *ibuf, enum upstream_msg_type type, struct source_msg *smsg,
+                   int fd) {
+	/* imsg closes the descriptor once it's sent */
+	if (imsg_compose(ibuf, type, 0, 0, fd, smsg, sizeof(*smsg)) < 0)
+		err(1, "imsg_compose");
+	if (imsg_flush(ibuf) < 0)
+		err(1, "imsg_flush");
+}
+
+/*
+ * Send the device statements of `config' to the repository, through the event
+ * loop so they arrive before the updates of sources added with them.
+ */
+void
+parent_send_devices(struct imsgbuf *ibuf, struct config *config) {
+	struct device_msg dm;
+	struct device *dev;
+	struct srcspec *spec;
+	int type;
+
+	TAILQ_FOREACH(dev, &config->devices, entry) {
+		memset(&dm, 0x00, sizeof(dm));
+		(void) strlcpy(dm.device, dev->device, sizeof(dm.device));
+		dm.priority = dev->priority;
+		dm.rdomain = dev->rdomain;
+		for (type = 0; type < SRC_UNKNOWN; type++)
+			dm.priorities[type] = -1;
+		TAILQ_FOREACH(spec, &dev->specs->l, entry) {
+			if (dm.priorities[spec->type] == -1)
+				dm.priorities[spec->type] = spec->priority;
+		}
+		if (imsg_compose(ibuf, MSG_CONFIG_DEVICE, 0, 0, -1, &dm, sizeof(dm)) < 0)
+			err(1, "imsg_compose");
+	}
+	if (imsg_compose(ibuf, MSG_CONFIG_DONE, 0, 0, -1, NULL, 0) < 0)
+		err(1, "imsg_compose");
+	if (imsg_flush(ibuf) < 0)
+		err(1, "imsg_flush");
+}
+
+/* Open `src' and hand it to the event loop */
+void
+parent_add_source(struct imsgbuf *ibuf, struct source_msg *src) {
+	int fd = -1;
+
+	if (source_has_fd(src->type) && (fd = source_open(src)) < 0) {
+		log_warn("source open failed dev=%s type=%s", src->device, srcnames[src->type]);
+		return;
+	}
+	parent_send_source(ibuf, MSG_SOURCE_ADD, src, fd);
+}
+
+/*
+ * The event loop saw an interface arrive or come up, open its sources.
+ * Returns 0 if the event loop is gone.
+ */
+int
+parent_handle_msg(struct imsgbuf *ibuf, struct config *config) {
+	struct link_state_msg ls;
+	struct source_msg *srcs;
+	struct imsg imsg;
+	size_t nsrcs, idx;
+	ssize_t n;
+
+	if ((n = imsg_read(ibuf)) == -1)
+		err(1, "imsg_read");
+	if (n == 0)
+		return 0;
+
+	while ((n = imsg_get(ibuf, &imsg)) > 0) {
+		if (imsg.hdr.type != MSG_IFACE_ARRIVAL ||
+		    imsg.hdr.len - IMSG_HEADER_SIZE != sizeof(ls))
+			errx(1, "unexpected IMSG received: %d", imsg.hdr.type);
+		memcpy(&ls, imsg.data, sizeof(ls));
+		ls.device[sizeof(ls.device) - 1] = '\0';
+		imsg_free(&imsg);
+
+		/* The name ends up in paths we open as root, so only take real interfaces */
+		if (strchr(ls.device, '/') != NULL || if_nametoindex(ls.device) == 0) {
+			log_warnx("ignoring arrival of unknown interface dev=%s", ls.device);
+			continue;
+		}
+
+		srcs = config_sources(config, ls.device, &nsrcs);
+		for (idx = 0; idx < nsrcs; idx++)
+			parent_add_source(ibuf, &srcs[idx]);
+		free(srcs);
+	}
+	if (n == -1)
+		err(1, "imsg_get");
+
 	return 1;
 }
 
-const char *srcnames[] = {
-	[SRC_DHCPV4] = "DHCPv4",
-	[SRC_RTADV]  = "RTADV",
-};
-const char *srvnames[] = {
-	[SRV_UNBOUND] = "unbound",
-	[SRV_REBOUND] = "rebound",
-};
+/* Whether `a' and `b' use the same unbound in every routing domain */
+int
+config_rdomains_equal(struct config *a, struct config *b) {
+	size_t idx;
+
+	if (a->nrdomains != b->nrdomains)
+		return 0;
+	for (idx = 0; idx < a->nrdomains; idx++) {
+		if (a->rdomains[idx].rdomain != b->rdomains[idx].rdomain ||
+		    strcmp(a->rdomains[idx].unbound, b->rdomains[idx].unbound))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Reparse the configuration and tell the event loop which sources to add and
+ * which to remove. Sources present in both configurations are left alone, so
+ * everything learned from them is kept. Returns the configuration in use.
+ */
+struct config *
+parent_reload(struct config *config, struct imsgbuf *ibuf) {
+	struct config *nconfig;
+	struct source_msg *osrcs, *nsrcs;
+	size_t on, nn, idx;
+	/* getpwnam() reuses its buffer, so the old user is gone after parsing */
+	uid_t uid = config->pw->pw_uid;
+
+	log_info("reloading configuration");
+
+	if ((nconfig = parse_config(CONFIG_FILE)) == NULL) {
+		log_warnx("couldn't parse config, keeping the old one");
+		return config;
+	}
+
+	if (nconfig->srvtype != config->srvtype || nconfig->pw->pw_uid != uid ||
+	    nconfig->warmup != config->warmup || nconfig->grace != config->grace ||
+	    nconfig->allow_empty != config->allow_empty ||
+	    (nconfig->statefile == NULL) != (config->statefile == NULL) ||
+	    (nconfig->statefile != NULL && strcmp(nconfig->statefile, config->statefile)) ||
+	    (nconfig->pushsocket == NULL) != (config->pushsocket == NULL) ||
+	    (nconfig->pushsocket != NULL && strcmp(nconfig->pushsocket, config->pushsocket)) ||
+	    nconfig->npushusers != config->npushusers ||
+	    strcmp(nconfig->controlsocket, config->controlsocket) ||
+	    (nconfig->metricssocket == NULL) != (config->metricssocket == NULL) ||
+	    (nconfig->metricssocket != NULL && strcmp(nconfig->metricssocket, config->metricssocket)) ||
+	    nconfig->prefer != config->prefer || nconfig->maxservers != config->maxservers ||
+	    nconfig->logsyslog != config->logsyslog || nconfig->loglevel != config->loglevel ||
+	    (nconfig->logfile == NULL) != (config->logfile == NULL) ||
+	    (nconfig->logfile != NULL && strcmp(nconfig->logfile, config->logfile)) ||
+	    (nconfig->recordfile == NULL) != (config->recordfile == NULL) ||
+	    (nconfig->recordfile != NULL && strcmp(nconfig->recordfile, config->recordfile)) ||
+	    (nconfig->backend == NULL) != (config->backend == NULL) ||
+	    (nconfig->backend != NULL && strcmp(nconfig->backend, config->backend)) ||
+	    nconfig->inline_parsers != config->inline_parsers ||
+	    !config_rdomains_equal(nconfig, config))
+		log_warnx("only changes to devices take effect without a restart");
+
+	/* Priorities and routing domains of devices take effect right away */
+	parent_send_devices(ibuf, nconfig);
+
+	osrcs = config_sources(config, NULL, &on);
+	nsrcs = config_sources(nconfig, NULL, &nn);
+
+	for (idx = 0; idx < on; idx++) {
+		if (!source_list_contains(nsrcs, nn, &osrcs[idx]))
+			parent_send_source(ibuf, MSG_SOURCE_DEL, &osrcs[idx], -1);
+	}
+	for (idx = 0; idx < nn; idx++) {
+		if (!source_list_contains(osrcs, on, &nsrcs[idx]))
+			parent_add_source(ibuf, &nsrcs[idx]);
+	}
+
+	free(osrcs);
+	free(nsrcs);
+	free_config(config);
+	return nconfig;
+}
+
+__dead void
+usage(void) {
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-r recording [-s speed]]\n", __progname);
+	exit(1);
+}
+
+/* An unlinked file standing in for the lease file of a played back source */
+int
+replay_lease_file(void) {
+	char path[] = "/tmp/dnsfoo.replay.XXXXXXXXXX";
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0)
+		err(1, "mkstemp");
+	(void) unlink(path);
+	return fd;
+}
 
 int
-main(void) {
+main(int argc, char *argv[]) {
 	pid_t cpids[3] = { -1, -1, -1 };
-	struct fileinfo *fi = NULL;
-	struct device *sp;
+	struct fileinfo_l fil;
+	struct imsgbuf pbuf;
+	struct source_msg *srcs;
 	struct config *config;
-	int nchildren = 0, nfi = 0;
+	struct kevent ev;
+	size_t nsrcs, sidx;
+	int nchildren = 0, kq, fd, idx, evloop_alive = 1;
 	int msg_fds_handlers[2];
 	int msg_fds_upstream[2];
+	int msg_fds_parent[2];
+	int push_fd = -1;
+	int ctl_fd;
+	int metrics_fd = -1;
+	const char *errstr, *replay_path = NULL;
+	unsigned int speed = 1;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "r:s:")) != -1) {
+		switch (ch) {
+			case 'r':
+				replay_path = optarg;
+				break;
+			case 's':
+				speed = strtonum(optarg, 0, 1000000, &errstr);
+				if (errstr != NULL)
+					errx(1, "speed %s is %s", optarg, errstr);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc != optind)
+		usage();
 
 	setproctitle(NULL);
 
-	if ((config = parse_config("/etc/dnsfoo.conf")) == NULL) {
+	/* SIGHUP reloads the configuration, children ignore it */
+	signal(SIGHUP, SIG_IGN);
+
+	if ((config = parse_config(CONFIG_FILE)) == NULL) {
 		errx(1, "Couldn't parse config");
 	}
-#ifndef NDEBUG
-	fprintf(stderr, "%llu: upstream server type %s\n", time(NULL), srvnames[config->srvtype]);
-#endif
-	TAILQ_FOREACH(sp, &config->devices, entry) {
-		struct srcspec *src;
-		TAILQ_FOREACH(src, &sp->specs->l, entry) {
-			struct handler_info *info = NULL;
-			fi = reallocarray(fi, nfi + 1, sizeof(*fi));
-			if (src->type == SRC_DHCPV4) {
-				info = dhcpv4_setup_handler(sp->device, src->source);
-				fi[nfi].handler = dhcpv4_handle_update;
-			} else if (src->type == SRC_RTADV) {
-				info = rtadv_setup_handler(sp->device);
-				fi[nfi].handler = rtadv_handle_update;
-			} else {
-				errx(1, "unknown source type %d", src->type);
-			}
-			if (info->sock < 0) {
-				warn("%llu: failed to open %s handler for device %s",
-				     time(NULL), srcnames[info->type], info->device);
-				free(info->device);
-				free(info);
-				continue;
-			}
-			fi[nfi].fd = info->sock;
-			EV_SET(&fi[nfi].ev, fi[nfi].fd, info->kq_event,
-			       EV_ADD | EV_CLEAR, info->kq_note, 0, info);
-			nfi++;
+
+	/* Opened before any privileges are dropped, every process inherits it */
+	if (config->logsyslog)
+		fd = -1;
+	else if (config->logfile == NULL)
+		fd = STDERR_FILENO;
+	else if ((fd = open(config->logfile, O_WRONLY | O_APPEND | O_CREAT, 0640)) < 0)
+		err(1, "open %s", config->logfile);
+	log_init(fd, config->loglevel);
+
+	log_info("starting upstream=%s", srvnames[config->srvtype]);
+	TAILQ_INIT(&fil);
+	if (replay_path != NULL) {
+		/* The recording decides which sources there are */
+		replay = replay_open(replay_path, speed);
+		srcs = replay_sources(replay_path, &nsrcs);
+	} else {
+		if (config->recordfile != NULL)
+			recorder_open(config->recordfile);
+		/* Patterns only cost something for the interfaces they match */
+		srcs = config_sources(config, NULL, &nsrcs);
+	}
+	for (sidx = 0; sidx < nsrcs; sidx++) {
+		/* One socket per routing domain serves all rtadv sources, played back ones need none */
+		if ((srcs[sidx].type == SRC_RTADV &&
+		     (rtadv_rx_find(srcs[sidx].rdomain) != NULL || replay != NULL)) ||
+		    !source_has_fd(srcs[sidx].type)) {
+			(void) fileinfo_add(&fil, srcs[sidx].type, srcs[sidx].device, NULL,
+			                    srcs[sidx].rdomain, -1);
+			continue;
+		}
+		if ((fd = (replay != NULL)? replay_lease_file(): source_open(&srcs[sidx])) < 0) {
+			log_warn("source open failed dev=%s type=%s", srcs[sidx].device,
+			         srcnames[srcs[sidx].type]);
+			continue;
 		}
+		(void) fileinfo_add(&fil, srcs[sidx].type, srcs[sidx].device, srcs[sidx].source,
+		                    srcs[sidx].rdomain, fd);
 	}
+	free(srcs);
+
+	/* Watch the routing socket for links going up and down, played back links don't */
+	if (replay == NULL)
+		(void) fileinfo_add(&fil, SRC_ROUTE, "route", NULL, 0, -1);
+
+	if (config->pushsocket != NULL)
+		push_fd = push_open(config->pushsocket);
+	ctl_fd = control_open(config->controlsocket);
+	if (config->metricssocket != NULL)
+		metrics_fd = metrics_open(config->metricssocket);
 
 	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, msg_fds_handlers) == -1) {
 		err(1, "socketpair");
@@ -167,56 +1364,108 @@ main(void) {
 	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, msg_fds_upstream) == -1) {
 		err(1, "socketpair");
 	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, msg_fds_parent) == -1) {
+		err(1, "socketpair");
+	}
 
+	log_flush();
 	cpids[0] = fork();
 	if (cpids[0] == -1)
 		err(1, "fork");
 	else if (cpids[0] == 0)
 		exit(upstream_update_loop(msg_fds_upstream[0], config));
 	else {
-#ifndef NDEBUG
-		fprintf(stderr, "%llu: %s update loop forked (%d)\n",
-		        time(NULL), srvnames[config->srvtype], cpids[0]);
-#endif
+		log_debug("forked proc=%s pid=%d", "upstream update loop", cpids[0]);
 		nchildren++;
 	}
 
+	log_flush();
 	cpids[1] = fork();
 	if (cpids[1] == -1)
 		err(1, "fork");
-	else if (cpids[1] == 0)
-		exit(eventloop(fi, nfi, msg_fds_handlers[0], config));
-	else {
-#ifndef NDEBUG
-		fprintf(stderr, "%llu: event loop forked (%d)\n", time(NULL), cpids[1]);
-#endif
+	else if (cpids[1] == 0) {
+		close(msg_fds_parent[1]);
+		exit(eventloop(&fil, msg_fds_handlers[0], msg_fds_parent[0], config));
+	} else {
+		log_debug("forked proc=%s pid=%d", "event loop", cpids[1]);
 		nchildren++;
 	}
 
+	log_flush();
 	cpids[2] = fork();
 	if (cpids[2] == -1)
 		err(1, "fork");
 	else if (cpids[2] == 0) {
 		/* kill(getpid(), SIGSTOP); */
-		exit(serverrepo_loop(msg_fds_handlers[1], msg_fds_upstream[1], config));
+		exit(serverrepo_loop(msg_fds_handlers[1], msg_fds_upstream[1], push_fd, ctl_fd,
+		                     metrics_fd, config));
 	} else {
-#ifndef NDEBUG
-		fprintf(stderr, "%llu: server repo forked (%d)\n", time(NULL), cpids[2]);
-#endif
+		log_debug("forked proc=%s pid=%d", "server repository", cpids[2]);
 		nchildren++;
 	}
 
-	privdrop(config);
-
+	/*
+	 * The parent keeps its privileges so it can open the sources of a
+	 * reloaded configuration, but it never looks at any of their data.
+	 */
 	close(msg_fds_upstream[0]);
 	close(msg_fds_upstream[1]);
 	close(msg_fds_handlers[0]);
 	close(msg_fds_handlers[1]);
+	close(msg_fds_parent[0]);
+	if (push_fd != -1)
+		close(push_fd);
+	close(ctl_fd);
+	if (metrics_fd != -1)
+		close(metrics_fd);
+	while (!TAILQ_EMPTY(&fil))
+		fileinfo_remove(&fil, TAILQ_FIRST(&fil));
+
+	imsg_init(&pbuf, msg_fds_parent[1]);
+
+	if ((kq = kqueue()) < 0)
+		err(1, "kqueue");
+	EV_SET(&ev, SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+	EV_SET(&ev, msg_fds_parent[1], EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+	for (idx = 0; idx < 3; idx++) {
+		EV_SET(&ev, cpids[idx], EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+	}
 
 	while (nchildren > 0) {
 		int status;
 		char *which = "none";
-		pid_t chld = wait(&status);
+		pid_t chld;
+
+		log_flush();
+		if (kevent(kq, NULL, 0, &ev, 1, NULL) < 1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "kevent");
+		}
+
+		if (ev.filter == EVFILT_SIGNAL) {
+			/* Played back sources don't come from the configuration */
+			if (evloop_alive && replay == NULL)
+				config = parent_reload(config, &pbuf);
+			continue;
+		}
+
+		if (ev.filter == EVFILT_READ) {
+			if (!parent_handle_msg(&pbuf, config)) {
+				close(msg_fds_parent[1]);
+				evloop_alive = 0;
+			}
+			continue;
+		}
+
+		if ((chld = waitpid(ev.ident, &status, 0)) < 0)
+			err(1, "waitpid");
 
 		if (chld == cpids[0]) {
 			which = "upstream updater";
@@ -228,15 +1477,19 @@ main(void) {
 			which = "unknown";
 		}
 
-		fprintf(stderr, "%llu: Child %d (%s) exited with ", time(NULL), chld, which);
-		if (WIFEXITED(status)) {
-			fprintf(stderr, "status %d\n", WEXITSTATUS(status));
-		} else if (WIFSIGNALED(status)) {
-			fprintf(stderr, "signal %d%s\n",
-			        WTERMSIG(status),
-			        WCOREDUMP(status)? " (core dumped)": "");
-		}
+		if (WIFEXITED(status))
+			log_warnx("child exited proc=%s pid=%d status=%d", which, chld,
+			          WEXITSTATUS(status));
+		else if (WIFSIGNALED(status))
+			log_warnx("child exited proc=%s pid=%d signal=%d core=%d", which, chld,
+			          WTERMSIG(status), WCOREDUMP(status)? 1: 0);
 		nchildren--;
+
+		/* The upstream updater exits once it reported on a played back recording */
+		if (replay != NULL && chld == cpids[0]) {
+			for (idx = 1; idx < 3; idx++)
+				(void) kill(cpids[idx], SIGTERM);
+		}
 	}
 
 	return 0;
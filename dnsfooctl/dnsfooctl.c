@@ -0,0 +1,191 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include "config.h"
+#include "control.h"
+#include "upstream_update.h"
+
+const char *srcnames[] = {
+	[SRC_DHCPV4] = "dhcpv4",
+	[SRC_RTADV]  = "rtadv",
+	[SRC_ROUTE]  = "route",
+	[SRC_SLAACD] = "slaacd",
+	[SRC_DHCPACK] = "dhcpack",
+	[SRC_PUSH]   = "push",
+};
+
+__dead void
+usage(void) {
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-s socket] show | rescan device type [source] |\n"
+	        "       reapply | clear\n", __progname);
+	exit(1);
+}
+
+enum srctype
+parse_srctype(const char *name) {
+	int idx;
+
+	for (idx = 0; idx < SRC_UNKNOWN; idx++) {
+		if (srcnames[idx] != NULL && !strcmp(srcnames[idx], name))
+			return idx;
+	}
+	errx(1, "unknown source type %s", name);
+}
+
+/* Print a '\0'-separated list, one entry per line */
+void
+print_list(const char *prefix, const char *l, size_t len) {
+	const char *p;
+
+	for (p = l; p < l + len; p += strlen(p) + 1)
+		printf("%s%s\n", prefix, p);
+}
+
+void
+show_source(char *data, size_t len) {
+	struct ctl_source cs;
+
+	if (len < sizeof(cs))
+		errx(1, "short source message");
+	memcpy(&cs, data, sizeof(cs));
+	cs.device[sizeof(cs.device) - 1] = '\0';
+	cs.id[sizeof(cs.id) - 1] = '\0';
+	if (sizeof(cs) + cs.nslen + cs.domainslen != len || cs.type >= SRC_UNKNOWN)
+		errx(1, "invalid source message");
+
+	printf("%s%s %s%s%s", cs.device, cs.up? "": " (down)", srcnames[cs.type],
+	       cs.id[0] != '\0'? " ": "", cs.id);
+	if (cs.rdomain != 0)
+		printf(" in rdomain %d", cs.rdomain);
+	if (cs.expires == -1)
+		printf(", no expiry\n");
+	else
+		printf(", expires in %llds\n", cs.expires);
+	print_list("\tserver ", data + sizeof(cs), cs.nslen);
+	print_list("\tdomain ", data + sizeof(cs) + cs.nslen, cs.domainslen);
+}
+
+void
+show_servers(char *data, size_t len) {
+	int rdomain;
+
+	if (len < sizeof(rdomain))
+		errx(1, "short servers message");
+	memcpy(&rdomain, data, sizeof(rdomain));
+
+	if (rdomain == 0)
+		printf("in use:\n");
+	else
+		printf("in use in rdomain %d:\n", rdomain);
+	print_list("\tserver ", data + sizeof(rdomain), len - sizeof(rdomain));
+}
+
+int
+main(int argc, char *argv[]) {
+	const char *sockname = CONTROL_SOCKET;
+	struct sockaddr_un sun;
+	struct source_msg sm;
+	struct imsgbuf ibuf;
+	struct imsg imsg;
+	ssize_t n, datalen;
+	int ch, fd, done = 0;
+
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+			case 's':
+				sockname = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	memset(&sun, 0x00, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, sockname, sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+		errx(1, "socket path %s too long", sockname);
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "connect %s", sockname);
+
+	if (pledge("stdio", NULL) < 0)
+		err(1, "pledge");
+
+	imsg_init(&ibuf, fd);
+
+	if (!strcmp(argv[0], "show") && argc == 1) {
+		if (imsg_compose(&ibuf, CTL_SHOW, 0, 0, -1, NULL, 0) < 0)
+			err(1, "imsg_compose");
+	} else if (!strcmp(argv[0], "rescan") && (argc == 3 || argc == 4)) {
+		memset(&sm, 0x00, sizeof(sm));
+		if (strlcpy(sm.device, argv[1], sizeof(sm.device)) >= sizeof(sm.device))
+			errx(1, "device name %s too long", argv[1]);
+		sm.type = parse_srctype(argv[2]);
+		if (argc == 4 && strlcpy(sm.source, argv[3], sizeof(sm.source)) >= sizeof(sm.source))
+			errx(1, "source %s too long", argv[3]);
+		if (imsg_compose(&ibuf, CTL_RESCAN, 0, 0, -1, &sm, sizeof(sm)) < 0)
+			err(1, "imsg_compose");
+	} else if (!strcmp(argv[0], "reapply") && argc == 1) {
+		if (imsg_compose(&ibuf, CTL_REAPPLY, 0, 0, -1, NULL, 0) < 0)
+			err(1, "imsg_compose");
+	} else if (!strcmp(argv[0], "clear") && argc == 1) {
+		if (imsg_compose(&ibuf, CTL_CLEAR, 0, 0, -1, NULL, 0) < 0)
+			err(1, "imsg_compose");
+	} else
+		usage();
+
+	if (imsg_flush(&ibuf) < 0)
+		err(1, "imsg_flush");
+
+	while (!done) {
+		if ((n = imsg_read(&ibuf)) == -1 && errno != EAGAIN)
+			err(1, "imsg_read");
+		if (n == 0)
+			errx(1, "connection closed");
+
+		while (!done && (n = imsg_get(&ibuf, &imsg)) > 0) {
+			datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+			switch (imsg.hdr.type) {
+				case CTL_SOURCE:
+					show_source(imsg.data, datalen);
+					break;
+				case CTL_SERVERS:
+					show_servers(imsg.data, datalen);
+					break;
+				case CTL_END:
+				case CTL_OK:
+					done = 1;
+					break;
+				case CTL_FAIL:
+					if (datalen > 0)
+						((char *) imsg.data)[datalen - 1] = '\0';
+					errx(1, "%s", datalen > 0? (char *) imsg.data: "failed");
+				default:
+					errx(1, "unexpected reply %d", imsg.hdr.type);
+			}
+			imsg_free(&imsg);
+		}
+		if (n == -1)
+			err(1, "imsg_get");
+	}
+
+	close(fd);
+	return 0;
+}
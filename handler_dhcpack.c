@@ -0,0 +1,315 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/event.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include <arpa/inet.h>
+#include <net/bpf.h>
+#include <net/if.h>
+#include <net/if_dl.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include "handlers.h"
+#include "upstream_update.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Name servers straight from the DHCPACK that dhclient(8) receives, instead of
+ * waiting for it to rewrite its lease file. Only acknowledgements addressed to
+ * the interface's own hardware address are used, everything else on the
+ * segment is ignored. The repository then only believes those from the server
+ * the lease file says dhclient got its lease from.
+ */
+
+#define BOOTP_FIXED_LEN	236	/* op through file, RFC 2131, section 2 */
+#define BOOTP_CHADDR	28
+#define BOOTREPLY	2
+#define DHCP_COOKIE	0x63825363
+
+#define DHO_PAD			0
+#define DHO_DOMAIN_NAME_SERVERS	6
+#define DHO_DOMAIN_NAME		15
+#define DHO_DHCP_LEASE_TIME	51
+#define DHO_DHCP_MESSAGE_TYPE	53
+#define DHO_DHCP_SERVER_IDENTIFIER	54
+#define DHO_END			255
+#define DHCPACK			5
+
+/* IPv4 UDP to port 68 that isn't a fragment, see dhclient's bpf.c */
+static struct bpf_insn dhcpack_filter[] = {
+	BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, ETHERTYPE_IP, 0, 8),
+	BPF_STMT(BPF_LD + BPF_B + BPF_ABS, 23),
+	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, IPPROTO_UDP, 0, 6),
+	BPF_STMT(BPF_LD + BPF_H + BPF_ABS, 20),
+	BPF_JUMP(BPF_JMP + BPF_JSET + BPF_K, 0x1fff, 4, 0),
+	BPF_STMT(BPF_LDX + BPF_B + BPF_MSH, 14),
+	BPF_STMT(BPF_LD + BPF_H + BPF_IND, 16),
+	BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, 68, 0, 1),
+	BPF_STMT(BPF_RET + BPF_K, (u_int) -1),
+	BPF_STMT(BPF_RET + BPF_K, 0),
+};
+
+/* Open a packet filter on `device' that only passes DHCP replies, needs root */
+int
+dhcpack_open(const char *device) {
+	struct bpf_program prog;
+	struct ifreq ifr;
+	u_int flag = 1;
+	int fd;
+
+	if ((fd = open("/dev/bpf", O_RDONLY | O_NONBLOCK)) < 0)
+		return -1;
+
+	memset(&ifr, 0x00, sizeof(ifr));
+	(void) strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+
+	prog.bf_len = sizeof(dhcpack_filter) / sizeof(dhcpack_filter[0]);
+	prog.bf_insns = dhcpack_filter;
+
+	if (ioctl(fd, BIOCSETIF, &ifr) < 0 ||
+	    ioctl(fd, BIOCIMMEDIATE, &flag) < 0 ||
+	    ioctl(fd, BIOCSETF, &prog) < 0 ||
+	    ioctl(fd, BIOCLOCK, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct handler_info *
+dhcpack_setup_handler(const char *device, int fd) {
+	struct handler_info *info;
+	struct ifaddrs *ifap, *ifa;
+	struct sockaddr_dl *sdl;
+
+	if ((info = calloc(1, sizeof(*info))) == NULL)
+		err(1, "calloc");
+
+	if (ioctl(fd, BIOCGBLEN, &info->v.dhcpack.blen) < 0)
+		err(1, "BIOCGBLEN");
+
+	/* Acknowledgements for other hosts may be broadcast, so remember who we are */
+	if (getifaddrs(&ifap) < 0)
+		err(1, "getifaddrs");
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_LINK ||
+		    strcmp(ifa->ifa_name, device))
+			continue;
+		sdl = (struct sockaddr_dl *) ifa->ifa_addr;
+		if (sdl->sdl_alen != ETHER_ADDR_LEN)
+			continue;
+		memcpy(info->v.dhcpack.lladdr, LLADDR(sdl), ETHER_ADDR_LEN);
+		break;
+	}
+	freeifaddrs(ifap);
+
+	if (ifa == NULL) {
+		log_warnx("dhcpack: no hardware address dev=%s", device);
+		free(info);
+		return NULL;
+	}
+
+	info->sock = fd;
+	info->kq_event = EVFILT_READ;
+	info->type = SRC_DHCPACK;
+	info->device = strdup(device);
+
+	return info;
+}
+
+/*
+ * Parse the BOOTP message `pkt' and add the name servers, domain, lease time and
+ * server identifier of a DHCPACK for `lladdr' to `msg'. This has no side effects, so captured
+ * packets can be replayed through it. Returns 1 if `pkt' was such an ACK.
+ */
+int
+dhcpack_parse(const u_char *pkt, size_t len, const u_char *lladdr,
+              struct upstream_update_msg *msg) {
+	char ntopbuf[INET_ADDRSTRLEN], domain[256];
+	const u_char *opt, *end = pkt + len;
+	struct in_addr addr;
+	uint32_t cookie, lease;
+	int type = 0;
+	size_t off;
+
+	if (len < BOOTP_FIXED_LEN + sizeof(cookie) || pkt[0] != BOOTREPLY)
+		return 0;
+	if (memcmp(pkt + BOOTP_CHADDR, lladdr, ETHER_ADDR_LEN) != 0)
+		return 0;
+	memcpy(&cookie, pkt + BOOTP_FIXED_LEN, sizeof(cookie));
+	if (ntohl(cookie) != DHCP_COOKIE)
+		return 0;
+
+	/* The message type may come after the options we want, so look for it first */
+	for (opt = pkt + BOOTP_FIXED_LEN + sizeof(cookie); opt < end && *opt != DHO_END;) {
+		if (*opt == DHO_PAD) {
+			opt++;
+			continue;
+		}
+		if (opt + 2 > end || opt + 2 + opt[1] > end)
+			return 0;
+		if (opt[0] == DHO_DHCP_MESSAGE_TYPE && opt[1] == 1)
+			type = opt[2];
+		opt += 2 + opt[1];
+	}
+	if (type != DHCPACK)
+		return 0;
+
+	for (opt = pkt + BOOTP_FIXED_LEN + sizeof(cookie); opt < end && *opt != DHO_END;) {
+		if (*opt == DHO_PAD) {
+			opt++;
+			continue;
+		}
+
+		switch (opt[0]) {
+			case DHO_DOMAIN_NAME_SERVERS:
+				for (off = 0; off + sizeof(addr) <= opt[1]; off += sizeof(addr)) {
+					memcpy(&addr, opt + 2 + off, sizeof(addr));
+					if (inet_ntop(AF_INET, &addr, ntopbuf, sizeof(ntopbuf)) == NULL)
+						continue;
+					if (!upstream_update_msg_append_ns(msg, ntopbuf))
+						err(1, "upstream_update_msg_append_ns");
+				}
+				break;
+			case DHO_DHCP_LEASE_TIME:
+				if (opt[1] != sizeof(lease))
+					break;
+				memcpy(&lease, opt + 2, sizeof(lease));
+				msg->lifetime = ntohl(lease);
+				break;
+			case DHO_DHCP_SERVER_IDENTIFIER:
+				if (opt[1] == sizeof(msg->server))
+					memcpy(&msg->server, opt + 2, sizeof(msg->server));
+				break;
+			case DHO_DOMAIN_NAME:
+				if (opt[1] == 0)
+					break;
+				memcpy(domain, opt + 2, opt[1]);
+				domain[opt[1]] = '\0';
+				/* Some servers include a terminating '\0' or a trailing '.' */
+				if (strlen(domain) > 0 && domain[strlen(domain) - 1] == '.')
+					domain[strlen(domain) - 1] = '\0';
+				if (strlen(domain) > 0 && !upstream_update_msg_append_domain(msg, domain))
+					err(1, "upstream_update_msg_append_domain");
+				break;
+			default:
+				break;
+		}
+		opt += 2 + opt[1];
+	}
+
+	return 1;
+}
+
+/* Strip the link, IP and UDP headers off a captured frame and parse what's left */
+int
+dhcpack_parse_frame(const u_char *frame, size_t len, const u_char *lladdr,
+                    struct upstream_update_msg *msg) {
+	const struct ip *ip;
+	size_t hlen;
+
+	if (len < ETHER_HDR_LEN + sizeof(struct ip))
+		return 0;
+	ip = (const struct ip *) (frame + ETHER_HDR_LEN);
+	hlen = ip->ip_hl * 4;
+	if (hlen < sizeof(struct ip) || len < ETHER_HDR_LEN + hlen + sizeof(struct udphdr))
+		return 0;
+
+	hlen += ETHER_HDR_LEN + sizeof(struct udphdr);
+	return dhcpack_parse(frame + hlen, len - hlen, lladdr, msg);
+}
+
+void
+dhcpack_handle_update(int fd, int msg_fd, void *udata) {
+	struct handler_info *info = (struct handler_info *) udata;
+	struct upstream_update_msg msg, cur;
+	struct bpf_hdr *hdr;
+	struct imsgbuf ibuf;
+	u_char *buf;
+	char *data;
+	ssize_t len;
+	size_t off, msglen;
+	int found = 0;
+
+	if (!handlers_inline) {
+		setproctitle("dhcpack parser");
+		log_procname("dhcpack parser");
+
+		if (pledge("stdio", NULL) < 0)
+			err(1, "pledge");
+	}
+
+	if ((buf = malloc(info->v.dhcpack.blen)) == NULL)
+		err(1, "malloc");
+
+	if ((len = read(fd, buf, info->v.dhcpack.blen)) < 0) {
+		if (errno != EAGAIN)
+			log_warn("read from bpf");
+		free(buf);
+		return;
+	}
+
+	/* Only the last acknowledgement in the buffer counts */
+	memset(&msg, 0x00, sizeof(msg));
+	for (off = 0; off + sizeof(*hdr) <= len;
+	     off += BPF_WORDALIGN(hdr->bh_hdrlen + hdr->bh_caplen)) {
+		hdr = (struct bpf_hdr *) (buf + off);
+		if (off + hdr->bh_hdrlen + hdr->bh_caplen > len)
+			break;
+		if (hdr->bh_caplen != hdr->bh_datalen)
+			continue;
+
+		memset(&cur, 0x00, sizeof(cur));
+		cur.lifetime = ~0;
+		if (!dhcpack_parse_frame(buf + off + hdr->bh_hdrlen, hdr->bh_caplen,
+		                         info->v.dhcpack.lladdr, &cur)) {
+			upstream_update_msg_cleanup(&cur);
+			continue;
+		}
+		upstream_update_msg_cleanup(&msg);
+		msg = cur;
+		found = 1;
+	}
+	free(buf);
+
+	if (!found || msg.nslen == 0) {
+		upstream_update_msg_cleanup(&msg);
+		return;
+	}
+
+	log_debug("dhcpack: ack dev=%s nslen=%zu lifetime=%u", info->device, msg.nslen, msg.lifetime);
+
+	msg.device = strdup(info->device);
+	msg.type = info->type;
+	trace_stamp(&msg);
+	if ((data = upstream_update_msg_pack(&msg, &msglen)) == NULL)
+		err(1, "upstream_update_msg_pack");
+	imsg_init(&ibuf, msg_fd);
+	if (imsg_compose(&ibuf, MSG_UPSTREAM_UPDATE, 0, 0, -1, data, msglen) < 0)
+		err(1, "imsg_compose");
+	upstream_update_msg_cleanup(&msg);
+
+	do {
+		if (msgbuf_write(&ibuf.w) > 0)
+			return;
+	} while (errno == EAGAIN);
+
+	err(1, "msgbuf_write");
+}
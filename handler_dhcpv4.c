@@ -11,35 +11,46 @@
 #include <sys/socket.h>
 #include <imsg.h>
 
+#include <arpa/inet.h>
+
 #include "config.h"
 #include "handlers.h"
 #include "upstream_update.h"
+#include "metrics.h"
+#include "log.h"
 
-void
-dhcpv4_handle_update(int fd, int msg_fd, void *udata) {
-	const char *match[] = { "option domain-name-servers", "option dhcp-lease-time" };
-	struct handler_info *info = (struct handler_info*) udata;
-	struct upstream_update_msg msg;
-	struct imsgbuf ibuf;
-	char *buf, *data;
-	const char *errstr;
-	FILE *f;
-	size_t len;
-
-	if (pledge("stdio rpath", NULL) < 0)
-		err(1, "pledge");
+/* Add the domains from a quoted, comma or space separated list */
+int
+dhcpv4_append_domains(struct upstream_update_msg *msg, char *buf) {
+	char *p;
 
-	setproctitle("dhcpv4 lease parser");
-
-	if ((f = fdopen(fd, "r")) == NULL) {
-		err(1, "fdopen");
+	while ((p = strsep(&buf, ", \t\"")) != NULL) {
+		if (*p == '\0')
+			continue;
+		if (p[strlen(p) - 1] == '.')
+			p[strlen(p) - 1] = '\0';
+		if (!upstream_update_msg_append_domain(msg, p))
+			return 0;
 	}
-	fseek(f, 0, SEEK_SET);
+	return 1;
+}
 
-	memset(&msg, 0x00, sizeof(msg));
-	msg.device = strdup(info->device);
-	msg.lifetime = ~0;
-	msg.type = info->type;
+/*
+ * Parse the name servers, search domains, lifetime and server identifier of the
+ * lease file `f' into `msg'. Returns 0 if the lease is malformed.
+ */
+int
+dhcpv4_parse(FILE *f, struct upstream_update_msg *msg) {
+	const char *match[] = {
+		"option domain-name-servers",
+		"option dhcp-lease-time",
+		"option domain-search",
+		"option domain-name ",
+		"option dhcp-server-identifier"
+	};
+	char *buf, *data;
+	const char *errstr;
+	size_t len;
 
 	/* Skip lines until we found the ones we're interested in */
 	while ((data = fgetln(f, &len)) != NULL) {
@@ -60,33 +71,89 @@ dhcpv4_handle_update(int fd, int msg_fd, void *udata) {
 					break;
 				if (*p == '\0')
 					continue;
-				if (!upstream_update_msg_append_ns(&msg, p))
+				if (!upstream_update_msg_append_ns(msg, p))
 					err(1, "upstream_update_msg_append_ns");
-				fprintf(stderr, "%llu: appended %s to list of name servers, list is now %ld bytes\n",
-				        time(NULL), p, msg.nslen);
+				log_debug("dhcpv4: ns=%s nslen=%zu", p, msg->nslen);
 			}
 		} else if ((buf = strstr(data, match[1])) != NULL) {
 			/* Handle lifetime */
 			long long lifetime = strtonum(buf + strlen(match[1]), 0, INT32_MAX, &errstr);
 			if (errstr != NULL) {
-				warn("%llu: The life time is %s", time(NULL), errstr);
-				goto exit_fail;
+				log_warnx("dhcpv4: lifetime is %s", errstr);
+				return 0;
 			}
-			msg.lifetime = (uint32_t) lifetime;
+			msg->lifetime = (uint32_t) lifetime;
+		} else if ((buf = strstr(data, match[4])) != NULL) {
+			/* Acknowledgements a dhcpack source sees are checked against this */
+			if (inet_pton(AF_INET, buf + strlen(match[4]) + 1, &msg->server) != 1) {
+				log_warnx("dhcpv4: invalid server identifier");
+				return 0;
+			}
+		} else if ((buf = strstr(data, match[2])) != NULL ||
+		           (buf = strstr(data, match[3])) != NULL) {
+			/* Handle search domains, skipping the option name */
+			buf = strchr(buf + strlen("option "), ' ');
+			if (buf != NULL && !dhcpv4_append_domains(msg, buf))
+				err(1, "upstream_update_msg_append_domain");
 		}
 	}
 
+	return 1;
+}
+
+void
+dhcpv4_handle_update(int fd, int msg_fd, void *udata) {
+	struct handler_info *info = (struct handler_info*) udata;
+	struct upstream_update_msg msg;
+	struct imsgbuf ibuf;
+	char *data;
+	FILE *f;
+	size_t len;
+
+	if (!handlers_inline) {
+		if (pledge("stdio rpath", NULL) < 0)
+			err(1, "pledge");
+
+		setproctitle("dhcpv4 lease parser");
+		log_procname("dhcpv4 lease parser");
+	}
+
+	/* The event loop keeps watching `fd', only the duplicate is closed */
+	if ((fd = dup(fd)) < 0)
+		err(1, "dup");
+	if ((f = fdopen(fd, "r")) == NULL) {
+		err(1, "fdopen");
+	}
+	fseek(f, 0, SEEK_SET);
+
+	memset(&msg, 0x00, sizeof(msg));
+	msg.device = strdup(info->device);
+	msg.lifetime = ~0;
+	msg.type = info->type;
+
+	if (!dhcpv4_parse(f, &msg)) {
+		if (!handlers_inline)
+			errx(1, "dhcpv4: malformed lease dev=%s", info->device);
+		/* A bad lease mustn't take the event loop down with it */
+		log_warnx("dhcpv4: malformed lease dev=%s", info->device);
+		fclose(f);
+		upstream_update_msg_cleanup(&msg);
+		return;
+	}
+	fclose(f);
+
 	if ((msg.nslen == 0) && ((msg.lifetime == 0) || (msg.lifetime == ~0))) {
 		/* No interesting new information */
+		upstream_update_msg_cleanup(&msg);
 		return;
 	}
 
+	trace_stamp(&msg);
 	if ((data = upstream_update_msg_pack(&msg, &len)) == NULL)
 		err(1, "upstream_update_msg_pack");
 	imsg_init(&ibuf, msg_fd);
 	if (imsg_compose(&ibuf, MSG_UPSTREAM_UPDATE, 0, 0, -1, data, len) < 0)
 		err(1, "imsg_compose");
-	free(data);
 	upstream_update_msg_cleanup(&msg);
 
 	do {
@@ -95,16 +162,21 @@ dhcpv4_handle_update(int fd, int msg_fd, void *udata) {
 		}
 	} while (errno == EAGAIN);
 
-exit_fail:
-	upstream_update_msg_cleanup(&msg);
 	err(1, "msgbuf_write");
 }
 
+/* Open a lease file, which may only be readable by root */
+int
+dhcpv4_open(const char *source) {
+	return open(source, O_RDONLY);
+}
+
 struct handler_info *
-dhcpv4_setup_handler(const char *device, const char *source) {
+dhcpv4_setup_handler(const char *device, const char *source, int fd) {
 	struct handler_info *info = calloc(1, sizeof(*info));
 	info->device = strdup(device);
-	info->sock = open(source, O_RDONLY);
+	info->source = strdup(source);
+	info->sock = fd;
 	info->kq_event = EVFILT_VNODE;
 	info->kq_note  = NOTE_WRITE;
 	info->type = SRC_DHCPV4;
@@ -0,0 +1,221 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/event.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include <net/if.h>
+#include <net/route.h>
+
+#include "handlers.h"
+#include "upstream_update.h"
+#include "log.h"
+
+struct handler_info *
+route_setup_handler(void) {
+	struct handler_info *info;
+	unsigned int filter, rtable;
+
+	if ((info = calloc(1, sizeof(*info))) == NULL)
+		err(1, "calloc");
+
+	if ((info->sock = socket(AF_ROUTE, SOCK_RAW | SOCK_NONBLOCK, AF_UNSPEC)) < 0) {
+		err(1, "socket");
+	}
+
+	filter = ROUTE_FILTER(RTM_IFINFO) | ROUTE_FILTER(RTM_IFANNOUNCE) |
+	         ROUTE_FILTER(RTM_PROPOSAL);
+	if (setsockopt(info->sock, AF_ROUTE, ROUTE_MSGFILTER, &filter, sizeof(filter)) < 0) {
+		err(1, "setsockopt ROUTE_MSGFILTER");
+	}
+
+	/* Links of devices in other routing domains matter just as much */
+	rtable = RTABLE_ANY;
+	if (setsockopt(info->sock, AF_ROUTE, ROUTE_TABLEFILTER, &rtable, sizeof(rtable)) < 0)
+		err(1, "setsockopt ROUTE_TABLEFILTER");
+
+	info->kq_event = EVFILT_READ;
+	info->type = SRC_ROUTE;
+	info->device = strdup("route");
+
+	return info;
+}
+
+/* Tell the server repository that `ifname' went up or down */
+void
+route_send_link_state(int msg_fd, const char *ifname, int up) {
+	struct link_state_msg msg;
+	struct imsgbuf ibuf;
+
+	memset(&msg, 0x00, sizeof(msg));
+	(void) strlcpy(msg.device, ifname, sizeof(msg.device));
+	msg.up = up;
+
+	imsg_init(&ibuf, msg_fd);
+	if (imsg_compose(&ibuf, MSG_LINK_STATE, 0, 0, -1, &msg, sizeof(msg)) < 0)
+		err(1, "imsg_compose");
+
+	do {
+		if (msgbuf_write(&ibuf.w) > 0)
+			return;
+	} while (errno == EAGAIN);
+
+	err(1, "msgbuf_write");
+}
+
+/* Remember the state of the link with index `ifindex', returns 1 if it changed */
+int
+route_link_changed(struct handler_info *ri, unsigned int ifindex, int up) {
+	struct link_state *l;
+	size_t idx;
+
+	for (idx = 0; idx < ri->v.route.nlinks; idx++) {
+		l = &ri->v.route.links[idx];
+		if (l->ifindex != ifindex)
+			continue;
+		if (l->up == up)
+			return 0;
+		l->up = up;
+		return 1;
+	}
+
+	ri->v.route.links = reallocarray(ri->v.route.links, ri->v.route.nlinks + 1,
+	                                 sizeof(*ri->v.route.links));
+	if (ri->v.route.links == NULL)
+		err(1, "reallocarray");
+	l = &ri->v.route.links[ri->v.route.nlinks++];
+	l->ifindex = ifindex;
+	l->up = up;
+
+	/* Links are assumed to be up until we learn otherwise */
+	return !up;
+}
+
+/* Drop what we know about a link whose interface is gone */
+void
+route_link_forget(struct handler_info *ri, unsigned int ifindex) {
+	size_t idx;
+
+	for (idx = 0; idx < ri->v.route.nlinks; idx++) {
+		if (ri->v.route.links[idx].ifindex != ifindex)
+			continue;
+		ri->v.route.links[idx] = ri->v.route.links[--ri->v.route.nlinks];
+		return;
+	}
+}
+
+/* Remember a name server proposal, the event loop passes it to the matching source */
+void
+route_proposal(struct handler_info *ri, struct rt_msghdr *rtm, size_t len) {
+	struct route_proposal *p;
+	unsigned int ifindex;
+	size_t nslen;
+	char *ns;
+
+	if (!slaacd_parse_proposal(rtm, len, &ifindex, &ns, &nslen))
+		return;
+
+	ri->v.route.proposals = reallocarray(ri->v.route.proposals, ri->v.route.nproposals + 1,
+	                                     sizeof(*ri->v.route.proposals));
+	if (ri->v.route.proposals == NULL)
+		err(1, "reallocarray");
+	p = &ri->v.route.proposals[ri->v.route.nproposals++];
+	p->ifindex = ifindex;
+	p->ns = ns;
+	p->nslen = nslen;
+}
+
+/* Remember that `ifname' arrived or departed, so the event loop can update its sources */
+void
+route_announce(struct handler_info *ri, const char *ifname, int arrived) {
+	struct link_announce *a;
+
+	ri->v.route.announced = reallocarray(ri->v.route.announced, ri->v.route.nannounced + 1,
+	                                     sizeof(*ri->v.route.announced));
+	if (ri->v.route.announced == NULL)
+		err(1, "reallocarray");
+	a = &ri->v.route.announced[ri->v.route.nannounced++];
+	memset(a, 0x00, sizeof(*a));
+	(void) strlcpy(a->name, ifname, sizeof(a->name));
+	a->arrived = arrived;
+}
+
+/*
+ * Messages on the routing socket come from the kernel, so unlike the other
+ * handlers this one runs in the event loop itself.
+ */
+void
+route_handle_update(int fd, int msg_fd, void *udata) {
+	struct handler_info *ri = (struct handler_info *) udata;
+	char buf[2048], ifnamebuf[IF_NAMESIZE];
+	struct rt_msghdr *rtm;
+	struct if_msghdr *ifm;
+	struct if_announcemsghdr *ifan;
+	ssize_t len;
+	int up;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		/* All routing messages start with length, version and type */
+		rtm = (struct rt_msghdr *) buf;
+		if (len < 4 || rtm->rtm_version != RTM_VERSION)
+			continue;
+
+		switch (rtm->rtm_type) {
+			case RTM_IFINFO:
+				if (len < (ssize_t) sizeof(*ifm))
+					break;
+				ifm = (struct if_msghdr *) buf;
+				up = (ifm->ifm_flags & IFF_UP) &&
+				     LINK_STATE_IS_UP(ifm->ifm_data.ifi_link_state);
+				if (!route_link_changed(ri, ifm->ifm_index, up))
+					break;
+				if (if_indextoname(ifm->ifm_index, ifnamebuf) == NULL)
+					break;
+				log_debug("route: link state dev=%s up=%d", ifnamebuf, up);
+				route_send_link_state(msg_fd, ifnamebuf, up);
+				if (!up)
+					break;
+				ri->v.route.came_up = reallocarray(ri->v.route.came_up,
+				                                   ri->v.route.ncame_up + 1,
+				                                   sizeof(*ri->v.route.came_up));
+				if (ri->v.route.came_up == NULL)
+					err(1, "reallocarray");
+				ri->v.route.came_up[ri->v.route.ncame_up++] = ifm->ifm_index;
+				break;
+			case RTM_IFANNOUNCE:
+				if (len < (ssize_t) sizeof(*ifan))
+					break;
+				ifan = (struct if_announcemsghdr *) buf;
+				log_debug("route: interface dev=%s arrived=%d", ifan->ifan_name,
+				          ifan->ifan_what == IFAN_ARRIVAL);
+				if (ifan->ifan_what == IFAN_ARRIVAL) {
+					route_announce(ri, ifan->ifan_name, 1);
+					break;
+				}
+				if (ifan->ifan_what != IFAN_DEPARTURE)
+					break;
+				route_link_forget(ri, ifan->ifan_index);
+				route_send_link_state(msg_fd, ifan->ifan_name, 0);
+				route_announce(ri, ifan->ifan_name, 0);
+				break;
+			case RTM_PROPOSAL:
+				if (len < (ssize_t) sizeof(*rtm))
+					break;
+				route_proposal(ri, rtm, len);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (len < 0 && errno != EAGAIN)
+		log_warn("read from routing socket");
+}
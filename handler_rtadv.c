@@ -15,86 +15,450 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/icmp6.h>
+#include <arpa/nameser.h>
 
 #include "handlers.h"
 #include "upstream_update.h"
+#include "metrics.h"
+#include "log.h"
 
 #define ALLROUTERS "ff02::2"
 #define PKTLEN 1500
 
-struct handler_info *
-rtadv_setup_handler(const char *dev) {
+/* Router solicitation timing, see RFC 4861, section 10 */
+#define MAX_RTR_SOLICITATION_DELAY	1000 /* milliseconds */
+#define RTR_SOLICITATION_INTERVAL	4000 /* milliseconds */
+#define MAX_RTR_SOLICITATIONS		3
+
+/*
+ * Every advertisement with name servers costs a fork and possibly a flush of
+ * the resolver's cache, so each router and each interface only get so many
+ * per second. Routers are tracked by address, the least recently heard one is
+ * forgotten when there are too many.
+ */
+#define RTADV_ROUTER_RATE	1
+#define RTADV_ROUTER_BURST	5
+#define RTADV_IFACE_RATE	5
+#define RTADV_IFACE_BURST	20
+#define RTADV_MAX_ROUTERS	64
+
+/* Anything beyond this is dropped by the kernel before it wakes us up */
+#define RTADV_RCVBUF		(8 * PKTLEN)
+
+/* Open the raw socket for router advertisements in routing domain `rdomain', needs root */
+int
+rtadv_open(int rdomain) {
 	/* Inspired by OpenBSD's /usr/src/usr.sbin/rtsol.c */
-	struct handler_info *info;
-	struct iovec *iovec;
-	struct sockaddr_in6 sin6_allr;
 	struct icmp6_filter filt;
-	int msglen, flag = 1;
-	char *rcvbuf;
-
-	if ((info = calloc(1, sizeof(*info))) == NULL)
-		err(1, "calloc");
-
-	msglen = CMSG_SPACE(sizeof(struct in6_pktinfo) + CMSG_SPACE(sizeof(int)));
+	int sock, flag = 1;
 
-	if ((rcvbuf = calloc(1, msglen)) == NULL)
-		err(1, "calloc");
-
-	memset(&sin6_allr, 0, sizeof(sin6_allr));
-	sin6_allr.sin6_family = AF_INET6;
-	sin6_allr.sin6_len = sizeof(sin6_allr);
-
-	if (inet_pton(AF_INET6, ALLROUTERS, &sin6_allr.sin6_addr.s6_addr) != 1) {
-		err(1, "inet_pton");
+	if ((sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
+		log_warn("rtadv: socket");
+		return -1;
 	}
 
-	if ((info->sock = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6)) < 0) {
-		err(1, "socket");
+	/* Advertisements are only delivered to sockets of the domain they arrived in */
+	if (rdomain != 0 &&
+	    setsockopt(sock, SOL_SOCKET, SO_RTABLE, &rdomain, sizeof(rdomain)) < 0) {
+		log_warn("rtadv: setsockopt SO_RTABLE rdomain=%d", rdomain);
+		close(sock);
+		return -1;
 	}
 
-	/* XXX: set routing table? */
-
-	if (setsockopt(info->sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &flag, sizeof(flag)) < 0) {
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &flag, sizeof(flag)) < 0) {
 		err(1, "setsockopt IPV6_RECVPKTINFO");
 	}
 
 	flag = 1;
-	if (setsockopt(info->sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &flag, sizeof(flag)) < 0) {
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &flag, sizeof(flag)) < 0) {
 		err(1, "setsockopt IPV6_RECVHOPLIMIT");
 	}
 
+	flag = 255;
+	if (setsockopt(sock, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &flag, sizeof(flag)) < 0) {
+		err(1, "setsockopt IPV6_MULTICAST_HOPS");
+	}
+
+	flag = RTADV_RCVBUF;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &flag, sizeof(flag)) < 0)
+		log_warn("rtadv: setsockopt SO_RCVBUF");
+
 	ICMP6_FILTER_SETBLOCKALL(&filt);
 	ICMP6_FILTER_SETPASS(ND_ROUTER_ADVERT, &filt);
-	if (setsockopt(info->sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filt, sizeof(filt)) < 0) {
+	if (setsockopt(sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filt, sizeof(filt)) < 0) {
 		err(1, "setsockopt ICMP6_FILTER");
 	}
 
-	iovec = calloc(1, sizeof(*iovec));
-	if (iovec == NULL)
+	return sock;
+}
+
+#define RTADV_CMSGLEN CMSG_SPACE(sizeof(struct in6_pktinfo) + CMSG_SPACE(sizeof(int)))
+
+/*
+ * Set up the receiver for the socket shared by all rtadv sources. The event
+ * loop reads up to RTADV_BATCH advertisements at once into its buffers.
+ */
+struct handler_info *
+rtadv_setup_receiver(int sock, int rdomain) {
+	struct handler_info *info;
+	struct mmsghdr *msgs;
+	struct iovec *iovecs;
+	char *pkts, *ctl;
+	int idx;
+
+	if ((info = calloc(1, sizeof(*info))) == NULL)
 		err(1, "calloc");
-	iovec->iov_base = calloc(1, PKTLEN);
-	if (iovec->iov_base == NULL)
+
+	if ((msgs = calloc(RTADV_BATCH, sizeof(*msgs))) == NULL ||
+	    (iovecs = calloc(RTADV_BATCH, sizeof(*iovecs))) == NULL ||
+	    (info->v.rtadv.from = calloc(RTADV_BATCH, sizeof(*info->v.rtadv.from))) == NULL ||
+	    (pkts = calloc(RTADV_BATCH, PKTLEN)) == NULL ||
+	    (ctl = calloc(RTADV_BATCH, RTADV_CMSGLEN)) == NULL)
 		err(1, "calloc");
-	iovec->iov_len = PKTLEN;
-	info->v.rtadv.msghdr.msg_name = (caddr_t)&info->v.rtadv.from;
-	info->v.rtadv.msghdr.msg_namelen = sizeof(info->v.rtadv.from);
-	info->v.rtadv.msghdr.msg_iov = iovec;
-	info->v.rtadv.msghdr.msg_iovlen = 1;
-	info->v.rtadv.msghdr.msg_control = (caddr_t) rcvbuf;
-	info->v.rtadv.msghdr.msg_controllen = msglen;
-
-	info->v.rtadv.ifindex = if_nametoindex(dev);
-	if (info->v.rtadv.ifindex == 0) {
-		err(1, "interface %s does not exist", dev);
+
+	for (idx = 0; idx < RTADV_BATCH; idx++) {
+		iovecs[idx].iov_base = pkts + idx * PKTLEN;
+		iovecs[idx].iov_len = PKTLEN;
+		msgs[idx].msg_hdr.msg_name = (caddr_t) &info->v.rtadv.from[idx];
+		msgs[idx].msg_hdr.msg_iov = &iovecs[idx];
+		msgs[idx].msg_hdr.msg_iovlen = 1;
+		msgs[idx].msg_hdr.msg_control = (caddr_t) ctl + idx * RTADV_CMSGLEN;
 	}
 
+	info->sock = sock;
+	info->v.rtadv.rdomain = rdomain;
+	info->v.rtadv.msgs = msgs;
 	info->kq_event = EVFILT_READ;
 	info->type = SRC_RTADV;
+	info->device = strdup("rtadv");
+
+	return info;
+}
+
+void
+rtadv_free_receiver(struct handler_info *rx) {
+	close(rx->sock);
+	free(rx->v.rtadv.routers);
+	free(rx->v.rtadv.msgs[0].msg_hdr.msg_iov[0].iov_base);
+	free(rx->v.rtadv.msgs[0].msg_hdr.msg_control);
+	free(rx->v.rtadv.msgs[0].msg_hdr.msg_iov);
+	free(rx->v.rtadv.msgs);
+	free(rx->v.rtadv.from);
+	free(rx->device);
+	free(rx);
+}
+
+/*
+ * Set up an rtadv source for `dev', receiving through `rx'. Its interface is
+ * looked up unless `ifindex' is given, which is only done for playback.
+ */
+struct handler_info *
+rtadv_setup_handler(const char *dev, struct handler_info *rx, int ifindex) {
+	struct handler_info *info;
+
+	if ((info = calloc(1, sizeof(*info))) == NULL)
+		err(1, "calloc");
+
+	/* Interfaces come and go, one that's missing isn't fatal */
+	info->v.rtadv.ifindex = ifindex;
+	if (ifindex == 0 && (info->v.rtadv.ifindex = if_nametoindex(dev)) == 0) {
+		log_warn("interface %s", dev);
+		free(info);
+		return NULL;
+	}
+
+	info->sock = rx->sock;
+	info->v.rtadv.rx = rx;
+	info->type = SRC_RTADV;
 	info->device = strdup(dev);
 
 	return info;
 }
 
+void
+rtadv_solicit_schedule(int kq, struct handler_info *ri, int msec) {
+	struct kevent ev;
+
+	/* The socket is shared, so timers are told apart by interface */
+	EV_SET(&ev, ri->v.rtadv.ifindex, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, msec, ri);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+}
+
+/* Start soliciting router advertisements on the interface of `ri' */
+void
+rtadv_solicit_start(int kq, struct handler_info *ri) {
+	ri->v.rtadv.rs_sent = 0;
+	rtadv_solicit_schedule(kq, ri, 1 + arc4random_uniform(MAX_RTR_SOLICITATION_DELAY));
+}
+
+/* Stop soliciting once a router advertisement came in */
+void
+rtadv_solicit_stop(int kq, struct handler_info *ri) {
+	struct kevent ev;
+
+	if (ri->v.rtadv.rs_sent >= MAX_RTR_SOLICITATIONS)
+		return;
+	ri->v.rtadv.rs_sent = MAX_RTR_SOLICITATIONS;
+
+	EV_SET(&ev, ri->v.rtadv.ifindex, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	(void) kevent(kq, &ev, 1, NULL, 0, NULL);
+}
+
+/* Send a router solicitation to all routers and schedule the next one */
+void
+rtadv_solicit(int kq, struct handler_info *ri) {
+	u_char cmsgbuf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	struct nd_router_solicit rs;
+	struct sockaddr_in6 dst;
+	struct in6_pktinfo *pi;
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov;
+
+	if (ri->v.rtadv.rs_sent >= MAX_RTR_SOLICITATIONS)
+		return;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.nd_rs_type = ND_ROUTER_SOLICIT;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin6_family = AF_INET6;
+	dst.sin6_len = sizeof(dst);
+	dst.sin6_scope_id = ri->v.rtadv.ifindex;
+	if (inet_pton(AF_INET6, ALLROUTERS, &dst.sin6_addr.s6_addr) != 1)
+		err(1, "inet_pton");
+
+	iov.iov_base = &rs;
+	iov.iov_len = sizeof(rs);
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cmsgbuf, 0, sizeof(cmsgbuf));
+	mh.msg_name = &dst;
+	mh.msg_namelen = sizeof(dst);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cmsgbuf;
+	mh.msg_controllen = sizeof(cmsgbuf);
+
+	/* Send from the interface we're watching */
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = IPPROTO_IPV6;
+	cm->cmsg_type = IPV6_PKTINFO;
+	cm->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+	pi = (struct in6_pktinfo *) CMSG_DATA(cm);
+	memset(pi, 0, sizeof(*pi));
+	pi->ipi6_ifindex = ri->v.rtadv.ifindex;
+
+	log_debug("rtadv: solicit dev=%s n=%d", ri->device, ri->v.rtadv.rs_sent + 1);
+	if (sendmsg(ri->sock, &mh, 0) < 0)
+		log_warn("rtadv: solicit failed dev=%s", ri->device);
+
+	if (++ri->v.rtadv.rs_sent < MAX_RTR_SOLICITATIONS)
+		rtadv_solicit_schedule(kq, ri, RTR_SOLICITATION_INTERVAL);
+}
+
+/*
+ * Read as many queued packets as fit from the shared socket into the buffers
+ * of `rx'. Returns how many were read, 0 if nothing was queued.
+ */
+int
+rtadv_receive(struct handler_info *rx) {
+	struct msghdr *mh;
+	int idx, n;
+
+	/* recvmmsg shrinks these to what it actually used */
+	for (idx = 0; idx < RTADV_BATCH; idx++) {
+		mh = &rx->v.rtadv.msgs[idx].msg_hdr;
+		mh->msg_controllen = RTADV_CMSGLEN;
+		mh->msg_namelen = sizeof(*rx->v.rtadv.from);
+	}
+
+	if ((n = recvmmsg(rx->sock, rx->v.rtadv.msgs, RTADV_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+		if (errno != EAGAIN)
+			log_warn("recvmmsg");
+		return 0;
+	}
+	rx->v.rtadv.npkts = n;
+
+	return n;
+}
+
+/* The interface packet `idx' of the last batch arrived on and its hop limit */
+void
+rtadv_packet_info(struct handler_info *rx, int idx, int *ifindex, int *hlim) {
+	struct msghdr *mh = &rx->v.rtadv.msgs[idx].msg_hdr;
+	struct cmsghdr *cm;
+
+	*ifindex = *hlim = 0;
+	for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level == IPPROTO_IPV6 &&
+		    cm->cmsg_type == IPV6_PKTINFO &&
+		    cm->cmsg_len == CMSG_LEN(sizeof(struct in6_pktinfo)))
+			*ifindex = ((struct in6_pktinfo *) CMSG_DATA(cm))->ipi6_ifindex;
+
+		if (cm->cmsg_level == IPPROTO_IPV6 &&
+		    cm->cmsg_type == IPV6_HOPLIMIT &&
+		    cm->cmsg_len == CMSG_LEN(sizeof(int)))
+			*hlim = *(int *) CMSG_DATA(cm);
+	}
+}
+
+/*
+ * Return the index of the interface packet `idx' of the last batch arrived
+ * on, or 0 if it can't be a valid advertisement.
+ */
+int
+rtadv_packet_ifindex(struct handler_info *rx, int idx) {
+	int ifindex, hlim;
+
+	rtadv_packet_info(rx, idx, &ifindex, &hlim);
+	if (hlim != 255) {
+		log_debug("rtadv: dropped hlim=%d", hlim);
+		return 0;
+	}
+
+	return ifindex;
+}
+
+/*
+ * Put a recorded advertisement into the receive buffers of `rx' as if it was
+ * the only packet of a batch, see eventloop_replay().
+ */
+void
+rtadv_inject(struct handler_info *rx, const struct in6_addr *from, int ifindex, int hlim,
+             const void *pkt, size_t len) {
+	struct msghdr *mh = &rx->v.rtadv.msgs[0].msg_hdr;
+	struct in6_pktinfo *pi;
+	struct cmsghdr *cm;
+
+	if (len > PKTLEN)
+		len = PKTLEN;
+	memcpy(mh->msg_iov[0].iov_base, pkt, len);
+	rx->v.rtadv.msgs[0].msg_len = len;
+
+	memset(&rx->v.rtadv.from[0], 0x00, sizeof(rx->v.rtadv.from[0]));
+	rx->v.rtadv.from[0].sin6_len = sizeof(rx->v.rtadv.from[0]);
+	rx->v.rtadv.from[0].sin6_family = AF_INET6;
+	rx->v.rtadv.from[0].sin6_addr = *from;
+	mh->msg_namelen = sizeof(rx->v.rtadv.from[0]);
+
+	memset(mh->msg_control, 0x00, RTADV_CMSGLEN);
+	mh->msg_controllen = CMSG_SPACE(sizeof(*pi)) + CMSG_SPACE(sizeof(int));
+	cm = CMSG_FIRSTHDR(mh);
+	cm->cmsg_level = IPPROTO_IPV6;
+	cm->cmsg_type = IPV6_PKTINFO;
+	cm->cmsg_len = CMSG_LEN(sizeof(*pi));
+	pi = (struct in6_pktinfo *) CMSG_DATA(cm);
+	pi->ipi6_ifindex = ifindex;
+	cm = CMSG_NXTHDR(mh, cm);
+	cm->cmsg_level = IPPROTO_IPV6;
+	cm->cmsg_type = IPV6_HOPLIMIT;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &hlim, sizeof(hlim));
+
+	rx->v.rtadv.npkts = 1;
+}
+
+/*
+ * Whether packet `idx' of the last batch carries RDNSS or DNSSL options.
+ * Advertisements without them can't change anything, so they aren't worth a
+ * fork. This only walks the option headers, the child does the real parsing.
+ */
+int
+rtadv_packet_has_dns(struct handler_info *rx, int idx) {
+	u_char *data = rx->v.rtadv.msgs[idx].msg_hdr.msg_iov[0].iov_base;
+	size_t len = rx->v.rtadv.msgs[idx].msg_len;
+	size_t off = sizeof(struct nd_router_advert);
+	struct nd_opt_hdr *opthdr;
+
+	if (len < sizeof(struct nd_router_advert))
+		return 0;
+
+	while (off + sizeof(*opthdr) <= len) {
+		opthdr = (struct nd_opt_hdr *) (data + off);
+		if (opthdr->nd_opt_len == 0)
+			return 0;
+		if (opthdr->nd_opt_type == ND_OPT_RDNSS || opthdr->nd_opt_type == ND_OPT_DNSSL)
+			return 1;
+		off += opthdr->nd_opt_len * 8;
+	}
+
+	return 0;
+}
+
+/* Take a token from `b', returns 0 if there is none left */
+static int
+rtadv_bucket_take(struct rtadv_bucket *b, time_t now, unsigned int rate, unsigned int burst) {
+	if (now > b->last) {
+		if ((now - b->last) * rate >= burst - b->tokens)
+			b->tokens = burst;
+		else
+			b->tokens += (now - b->last) * rate;
+		b->last = now;
+	}
+
+	if (b->tokens == 0)
+		return 0;
+	b->tokens--;
+	return 1;
+}
+
+/*
+ * Decide whether packet `idx' of `rx' may be handed to the parser of the
+ * rtadv source `info'. Returns 0 if its router or interface is over its rate.
+ */
+int
+rtadv_ratelimit(struct handler_info *rx, struct handler_info *info, int idx) {
+	char ntopbuf[INET6_ADDRSTRLEN];
+	struct sockaddr_in6 *from = &rx->v.rtadv.from[idx];
+	struct rtadv_router *r = NULL;
+	time_t now = time(NULL);
+	size_t i;
+
+	for (i = 0; i < rx->v.rtadv.nrouters; i++) {
+		if (rx->v.rtadv.routers[i].ifindex == info->v.rtadv.ifindex &&
+		    IN6_ARE_ADDR_EQUAL(&rx->v.rtadv.routers[i].addr, &from->sin6_addr)) {
+			r = &rx->v.rtadv.routers[i];
+			break;
+		}
+	}
+	if (r == NULL) {
+		if (rx->v.rtadv.nrouters < RTADV_MAX_ROUTERS) {
+			if ((r = reallocarray(rx->v.rtadv.routers, rx->v.rtadv.nrouters + 1,
+			                      sizeof(*r))) == NULL)
+				err(1, "reallocarray");
+			rx->v.rtadv.routers = r;
+			r = &rx->v.rtadv.routers[rx->v.rtadv.nrouters++];
+		} else {
+			r = &rx->v.rtadv.routers[0];
+			for (i = 1; i < rx->v.rtadv.nrouters; i++) {
+				if (rx->v.rtadv.routers[i].bucket.last < r->bucket.last)
+					r = &rx->v.rtadv.routers[i];
+			}
+		}
+		r->addr = from->sin6_addr;
+		r->ifindex = info->v.rtadv.ifindex;
+		r->bucket.tokens = RTADV_ROUTER_BURST;
+		r->bucket.last = now;
+	}
+
+	if (info->v.rtadv.bucket.last == 0) {
+		info->v.rtadv.bucket.tokens = RTADV_IFACE_BURST;
+		info->v.rtadv.bucket.last = now;
+	}
+
+	if (rtadv_bucket_take(&r->bucket, now, RTADV_ROUTER_RATE, RTADV_ROUTER_BURST) &&
+	    rtadv_bucket_take(&info->v.rtadv.bucket, now, RTADV_IFACE_RATE, RTADV_IFACE_BURST))
+		return 1;
+
+	if (rx->v.rtadv.ratelimited++ % 100 == 0)
+		log_warnx("rtadv: over rate router=%s dev=%s dropped=%llu",
+		          inet_ntop(AF_INET6, &from->sin6_addr, ntopbuf, sizeof(ntopbuf)),
+		          info->device, rx->v.rtadv.ratelimited);
+	return 0;
+}
+
 #ifndef NDEBUG
 const char* ra_names[] = {
 	[ND_OPT_SOURCE_LINKADDR] = "source linkaddr",
@@ -112,86 +476,129 @@ const char* ra_names[] = {
 #define MIN(a, b) ((a < b)? a: b)
 #endif
 
+/* Decode the domain names in a DNSSL option, see RFC 6106, section 5.2 */
+int
+rtadv_parse_dnssl(struct upstream_update_msg *msg, u_char *opt, int optlen) {
+	char name[NS_MAXDNAME];
+	size_t namelen = 0;
+	int off = sizeof(struct nd_opt_dnssl);
+
+	while (off < optlen) {
+		u_char lablen = opt[off++];
+
+		if (lablen == 0) {
+			/* End of a name, or padding after the last one */
+			if (namelen == 0)
+				continue;
+			name[namelen] = '\0';
+			if (!upstream_update_msg_append_domain(msg, name))
+				return 0;
+			namelen = 0;
+			continue;
+		}
+
+		if (lablen > 63 || off + lablen > optlen ||
+		    namelen + lablen + 2 > sizeof(name)) {
+			log_warnx("rtadv: malformed DNSSL option");
+			return 1;
+		}
+		if (namelen > 0)
+			name[namelen++] = '.';
+		memcpy(name + namelen, opt + off, lablen);
+		namelen += lablen;
+		off += lablen;
+	}
+	return 1;
+}
+
+/*
+ * Parse the RDNSS and DNSSL options of the advertisement `data' into `msg'.
+ * The lifetime is that of the last RDNSS option.
+ */
 void
-rtadv_handle_individual_ra(struct handler_info *ri, ssize_t len, int msg_fd) {
+rtadv_parse(const u_char *data, size_t len, struct upstream_update_msg *msg) {
 	/* TODO: don't ignore option life time */
-	char *data = ri->v.rtadv.msghdr.msg_iov[0].iov_base;
+	const struct nd_opt_hdr *opthdr;
+	char ntopbuf[INET6_ADDRSTRLEN];
+	struct in6_addr ns;
+	size_t pkt_off, optlen, off;
+
+	for (pkt_off = sizeof(struct nd_router_advert);
+	     pkt_off + sizeof(*opthdr) <= len; pkt_off += optlen) {
+		opthdr = (const struct nd_opt_hdr *) (data + pkt_off);
+		if (opthdr->nd_opt_len == 0)
+			break;
+		optlen = opthdr->nd_opt_len * 8;
+		if (pkt_off + optlen > len)
+			break;
+
+		if (opthdr->nd_opt_type == ND_OPT_DNSSL) {
+			log_debug("rtadv: dnssl len=%zu lifetime=%u", optlen,
+			          ntohl(((const struct nd_opt_dnssl *) opthdr)->nd_opt_dnssl_lifetime));
+			if (!rtadv_parse_dnssl(msg, (u_char *) opthdr, optlen))
+				err(1, "upstream_update_msg_append_domain");
+			continue;
+		}
+
+		if (opthdr->nd_opt_type != ND_OPT_RDNSS || optlen < sizeof(struct nd_opt_rdnss))
+			continue;
+
+		msg->lifetime = ntohl(((const struct nd_opt_rdnss *) opthdr)->nd_opt_rdnss_lifetime);
+		log_debug("rtadv: rdnss len=%zu lifetime=%u", optlen, msg->lifetime);
+
+		for (off = sizeof(struct nd_opt_rdnss); off + sizeof(ns) <= optlen; off += sizeof(ns)) {
+			memcpy(&ns, data + pkt_off + off, sizeof(ns));
+			if (!upstream_update_msg_append_ns(msg,
+			    inet_ntop(AF_INET6, &ns, ntopbuf, sizeof(ntopbuf))))
+				err(1, "upstream_update_msg_append_ns");
+		}
+	}
+}
+
+void
+rtadv_handle_individual_ra(struct handler_info *ri, ssize_t len, int msg_fd) {
+	struct handler_info *rx = ri->v.rtadv.rx;
+	struct msghdr *mh = &rx->v.rtadv.msgs[rx->v.rtadv.cur].msg_hdr;
+	char *data = mh->msg_iov[0].iov_base;
 	struct ifreq req;
 	struct imsgbuf ibuf;
 	struct upstream_update_msg msg;
-	struct nd_opt_hdr *opthdr;
 	char ntopbuf[INET6_ADDRSTRLEN];
-	off_t pkt_off = sizeof(struct nd_router_advert);
 	size_t msglen;
 
-#ifndef NDEBUG
-	struct sockaddr_in6 *from = (struct sockaddr_in6*) ri->v.rtadv.msghdr.msg_name;
+	struct sockaddr_in6 *from = (struct sockaddr_in6*) mh->msg_name;
 
-	fprintf(stderr, "%llu: rtadv: len: %ld from %s\n", time(NULL),
-	        len, inet_ntop(AF_INET6, &from->sin6_addr, ntopbuf, INET6_ADDRSTRLEN));
-#endif
+	log_debug("rtadv: advertisement len=%zd router=%s", len,
+	          inet_ntop(AF_INET6, &from->sin6_addr, ntopbuf, INET6_ADDRSTRLEN));
 
 	memset(&req, 0x00, sizeof(req));
 	memcpy(&req.ifr_name, ri->device, MIN(strlen(ri->device), IFNAMSIZ));
 	ioctl(ri->sock, SIOCGIFXFLAGS, &req);
 	if (req.ifr_flags & ~IFXF_AUTOCONF6) {
-		fprintf(stderr, "%llu: rtadv: autoconf disabled on dev \"%s\"\n",
-		        time(NULL), req.ifr_name);
+		log_debug("rtadv: autoconf disabled dev=%s", req.ifr_name);
 		return;
 	}
 
-	if (pledge("stdio inet", NULL) < 0)
+	if (!handlers_inline && pledge("stdio inet", NULL) < 0)
 		err(1, "pledge");
 
 	memset(&msg, 0x00, sizeof(msg));
 	msg.lifetime = ~0;
-	for (pkt_off = sizeof(struct nd_router_advert);
-	     pkt_off < len; pkt_off += opthdr->nd_opt_len * 8) {
-		int optlen;
-		char *opt;
-
-		opthdr = (struct nd_opt_hdr*)(data + pkt_off);
-
-		if (opthdr->nd_opt_len == 0)
-			break;
-
-		if (opthdr->nd_opt_type != ND_OPT_RDNSS)
-			continue;
-
-		optlen = opthdr->nd_opt_len * 8;
-#ifndef NDEBUG
-		fprintf(stderr, "\t\tRDNSS len=%d hdr=%lu lifetime=%d\n",
-		        optlen, sizeof(opthdr),
-		        ntohl(((struct nd_opt_rdnss*)opthdr)->nd_opt_rdnss_lifetime));
-#endif
-		msg.lifetime = ntohl(((struct nd_opt_rdnss*)opthdr)->nd_opt_rdnss_lifetime);
-		fprintf(stderr, "%llu: lt=%u\n", time(NULL), msg.lifetime);
-
-		optlen -= sizeof(opthdr);
-		opt = data + pkt_off + sizeof(opthdr);
-
-		for (; optlen > 0; optlen -= sizeof(struct in6_addr), opt += sizeof(struct in6_addr)) {
-			struct in6_addr ns;
-			const char* addr;
-			memcpy(&ns, opt, sizeof(struct in6_addr));
-
-			addr = inet_ntop(AF_INET6, &ns, ntopbuf, INET6_ADDRSTRLEN);
-			if (!upstream_update_msg_append_ns(&msg, addr))
-				err(1, "upstream_update_msg_append_ns");
-		}
-	}
+	rtadv_parse((u_char *) data, len, &msg);
 
-	if (msg.nslen == 0)
+	if (msg.nslen == 0) {
+		upstream_update_msg_cleanup(&msg);
 		return;
+	}
 
 	msg.device = strdup(ri->device);
 	msg.type = ri->type;
+	trace_stamp(&msg);
 	if ((data = upstream_update_msg_pack(&msg, &msglen)) == NULL)
 		err(1, "upstream_update_msg_pack");
 	imsg_init(&ibuf, msg_fd);
 	if (imsg_compose(&ibuf, MSG_UPSTREAM_UPDATE, 0, 0, -1, data, msglen) < 0)
 		err(1, "imsg_compose");
-	free(data);
 	upstream_update_msg_cleanup(&msg);
 
 	do {
@@ -203,90 +610,47 @@ rtadv_handle_individual_ra(struct handler_info *ri, ssize_t len, int msg_fd) {
 	err(1, "msgbuf_write");
 }
 
+/*
+ * Parse the advertisement the event loop received for the interface of `ri'.
+ * Its interface and hop limit were checked by rtadv_packet_ifindex().
+ */
 void
 rtadv_handle_update(int fd, int msgfd, void *udata) {
 	/* Inspired by OpenBSD's /usr/src/usr.sbin/rtsol.c */
 	/* https://tools.ietf.org/html/rfc6106 */
 	struct handler_info *ri = (struct handler_info *) udata;
-	char ifnamebuf[IFNAMSIZ];
+	struct handler_info *rx = ri->v.rtadv.rx;
+	struct mmsghdr *m = &rx->v.rtadv.msgs[rx->v.rtadv.cur];
+	struct sockaddr_in6 *from = (struct sockaddr_in6 *) m->msg_hdr.msg_name;
 	char ntopbuf[INET6_ADDRSTRLEN];
-	struct cmsghdr *cm;
-	struct in6_pktinfo *pi = NULL;
 	struct icmp6_hdr *icp;
-	ssize_t len;
-	int ifindex = 0;
-	int *hlimp = NULL;
+	ssize_t len = m->msg_len;
 
-	setproctitle("router advertisement handler");
-
-	if ((len = recvmsg(fd, &ri->v.rtadv.msghdr, MSG_WAITALL)) < 0) {
-		warn("%llu: recvmsg", time(NULL));
-		return;
-	}
-
-	if (ri->v.rtadv.msghdr.msg_iovlen != 1) {
-		warn("%llu: unexpected number of I/O vectors: %d\n",
-		     time(NULL), ri->v.rtadv.msghdr.msg_iovlen);
-		return;
-	}
-
-	for (cm = (struct cmsghdr *) CMSG_FIRSTHDR(&ri->v.rtadv.msghdr); cm;
-	     cm = (struct cmsghdr *) CMSG_NXTHDR(&ri->v.rtadv.msghdr, cm)) {
-		if (cm->cmsg_level == IPPROTO_IPV6 &&
-		    cm->cmsg_type == IPV6_PKTINFO &&
-		    cm->cmsg_len == CMSG_LEN(sizeof(struct in6_pktinfo))) {
-			pi = (struct in6_pktinfo *) CMSG_DATA(cm);
-			ifindex = pi->ipi6_ifindex;
-		}
-
-		if (cm->cmsg_level == IPPROTO_IPV6 &&
-		    cm->cmsg_type == IPV6_HOPLIMIT &&
-		    cm->cmsg_len == CMSG_LEN(sizeof(int))) {
-			hlimp = (int*) CMSG_DATA(cm);
-		}
-	}
-
-	if (ifindex == 0) {
-		warn("%llu: can't get interface index", time(NULL));
-		return;
-	}
-
-	if (ifindex != ri->v.rtadv.ifindex) {
-		return;
-	}
-
-	if (hlimp == NULL) {
-		warn("%llu: can't get receiving hop limit", time(NULL));
-		return;
+	if (!handlers_inline) {
+		setproctitle("router advertisement handler");
+		log_procname("router advertisement handler");
 	}
 
 	if (len < sizeof(struct nd_router_advert)) {
-		warn("%llu: short packet", time(NULL));
+		log_warnx("rtadv: short packet");
 		return;
 	}
 
-	icp = (struct icmp6_hdr*) ri->v.rtadv.msghdr.msg_iov[0].iov_base;
+	icp = (struct icmp6_hdr*) m->msg_hdr.msg_iov[0].iov_base;
 
 	if (icp->icmp6_type != ND_ROUTER_ADVERT) {
-		warn("%llu: received a packet that is not a router advertisement", time(NULL));
+		log_warnx("rtadv: not a router advertisement");
 		return;
 	}
 
 	if (icp->icmp6_code != 0) {
-		warn("%llu: invalid ICMP6 code %d", time(NULL), icp->icmp6_code);
-		return;
-	}
-
-	if (*hlimp != 255) {
-		warn("%llu: invalid RA with hop limit %d received on %s",
-		     time(NULL), *hlimp, if_indextoname(ifindex, ifnamebuf));
+		log_warnx("rtadv: invalid code=%d", icp->icmp6_code);
 		return;
 	}
 
-	if (pi && !IN6_IS_ADDR_LINKLOCAL(&ri->v.rtadv.from.sin6_addr)) {
-		warn("%llu: RA with non link-local source %s received on %s",
-		     time(NULL), inet_ntop(AF_INET6, &ri->v.rtadv.from.sin6_addr, ntopbuf, INET6_ADDRSTRLEN),
-		     if_indextoname(ifindex, ifnamebuf));
+	if (!IN6_IS_ADDR_LINKLOCAL(&from->sin6_addr)) {
+		log_warnx("rtadv: not link-local router=%s dev=%s",
+		          inet_ntop(AF_INET6, &from->sin6_addr, ntopbuf, INET6_ADDRSTRLEN), ri->device);
 		return;
 	}
 
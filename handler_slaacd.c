@@ -0,0 +1,153 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/event.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <netinet/in.h>
+
+#include "handlers.h"
+#include "upstream_update.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * slaacd(8) parses the RDNSS options of router advertisements itself and
+ * proposes the name servers it found on the routing socket. The route
+ * handler picks those proposals up, so sources of this type need neither a
+ * socket nor privileges of their own.
+ */
+
+#define ROUNDUP(a) \
+	((a) > 0 ? (1 + (((a) - 1) | (sizeof(long) - 1))) : sizeof(long))
+
+struct handler_info *
+slaacd_setup_handler(const char *dev) {
+	struct handler_info *info;
+
+	if ((info = calloc(1, sizeof(*info))) == NULL)
+		err(1, "calloc");
+
+	if ((info->v.slaacd.ifindex = if_nametoindex(dev)) == 0) {
+		log_warn("interface %s", dev);
+		free(info);
+		return NULL;
+	}
+
+	info->sock = -1;
+	info->type = SRC_SLAACD;
+	info->device = strdup(dev);
+
+	return info;
+}
+
+/* Ask slaacd to propose what it currently knows again */
+void
+slaacd_solicit(int routefd) {
+	struct rt_msghdr rtm;
+
+	memset(&rtm, 0x00, sizeof(rtm));
+	rtm.rtm_version = RTM_VERSION;
+	rtm.rtm_type = RTM_PROPOSAL;
+	rtm.rtm_msglen = sizeof(rtm);
+	rtm.rtm_hdrlen = sizeof(rtm);
+	rtm.rtm_priority = RTP_PROPOSAL_SOLICIT;
+
+	if (write(routefd, &rtm, sizeof(rtm)) < 0)
+		log_warn("slaacd: soliciting proposals");
+}
+
+/*
+ * Extract the name servers from an RTM_PROPOSAL message of slaacd. Returns 1
+ * and sets `ifindex', `ns' and `nslen' if `rtm' is one; an empty list means
+ * slaacd withdrew its name servers.
+ */
+int
+slaacd_parse_proposal(struct rt_msghdr *rtm, size_t len, unsigned int *ifindex,
+                      char **ns, size_t *nslen) {
+	char ntopbuf[INET6_ADDRSTRLEN];
+	struct upstream_update_msg msg;
+	struct sockaddr_rtdns *rtdns = NULL;
+	struct sockaddr *sa;
+	struct in6_addr addr;
+	char *p = (char *) rtm, *end = p + len;
+	size_t off, dnslen;
+	int idx;
+
+	if (rtm->rtm_type != RTM_PROPOSAL || rtm->rtm_priority != RTP_PROPOSAL_SLAAC)
+		return 0;
+	if (rtm->rtm_hdrlen > len)
+		return 0;
+
+	sa = (struct sockaddr *) (p + rtm->rtm_hdrlen);
+	for (idx = 0; idx < RTAX_MAX; idx++) {
+		if (!(rtm->rtm_addrs & (1 << idx)))
+			continue;
+		if ((char *) sa + sizeof(sa->sa_len) > end || (char *) sa + sa->sa_len > end)
+			return 0;
+		if (idx == RTAX_DNS)
+			rtdns = (struct sockaddr_rtdns *) sa;
+		sa = (struct sockaddr *) ((char *) sa + ROUNDUP(sa->sa_len));
+	}
+
+	memset(&msg, 0x00, sizeof(msg));
+	if (rtdns != NULL && rtdns->sr_family == AF_INET6 &&
+	    rtdns->sr_len > offsetof(struct sockaddr_rtdns, sr_dns)) {
+		dnslen = rtdns->sr_len - offsetof(struct sockaddr_rtdns, sr_dns);
+		for (off = 0; off + sizeof(addr) <= dnslen; off += sizeof(addr)) {
+			memcpy(&addr, rtdns->sr_dns + off, sizeof(addr));
+			if (inet_ntop(AF_INET6, &addr, ntopbuf, sizeof(ntopbuf)) == NULL)
+				continue;
+			if (!upstream_update_msg_append_ns(&msg, ntopbuf))
+				err(1, "upstream_update_msg_append_ns");
+		}
+	}
+
+	*ifindex = rtm->rtm_index;
+	*ns = msg.ns;
+	*nslen = msg.nslen;
+	return 1;
+}
+
+/* Hand the name servers slaacd proposed for the interface of `info' on */
+void
+slaacd_send_update(struct handler_info *info, int msg_fd, char *ns, size_t nslen) {
+	struct upstream_update_msg msg;
+	struct imsgbuf ibuf;
+	char *data;
+	size_t msglen;
+
+	log_debug("slaacd: proposal dev=%s nslen=%zu", info->device, nslen);
+
+	/* slaacd withdraws its proposal when the lifetime runs out */
+	memset(&msg, 0x00, sizeof(msg));
+	msg.type = info->type;
+	msg.lifetime = ~0;
+	msg.device = info->device;
+	msg.ns = ns;
+	msg.nslen = nslen;
+
+	trace_stamp(&msg);
+	if ((data = upstream_update_msg_pack(&msg, &msglen)) == NULL)
+		err(1, "upstream_update_msg_pack");
+	imsg_init(&ibuf, msg_fd);
+	if (imsg_compose(&ibuf, MSG_UPSTREAM_UPDATE, 0, 0, -1, data, msglen) < 0)
+		err(1, "imsg_compose");
+
+	do {
+		if (msgbuf_write(&ibuf.w) > 0)
+			return;
+	} while (errno == EAGAIN);
+
+	err(1, "msgbuf_write");
+}
@@ -1,9 +1,47 @@
+#include <stdio.h>
+
+#include <net/if.h>
 #include <netinet/in.h>
 
 #include "config.h"
 
+struct link_state {
+	unsigned int ifindex;
+	int up;
+};
+
+/* Number of router advertisements read from the shared socket at once */
+#define RTADV_BATCH 16
+
+/* Name servers slaacd proposed for an interface */
+struct route_proposal {
+	unsigned int ifindex;
+	char *ns;
+	size_t nslen;
+};
+
+/* Token bucket for advertisements with name servers, see rtadv_ratelimit() */
+struct rtadv_bucket {
+	unsigned int tokens;
+	time_t last;
+};
+
+struct rtadv_router {
+	struct in6_addr addr;
+	int ifindex;
+	struct rtadv_bucket bucket;
+};
+
+struct link_announce {
+	char name[IF_NAMESIZE];
+	/* 1 if the interface arrived, 0 if it departed */
+	int arrived;
+};
+
 struct handler_info {
 	char *device;
+	/* Source from the configuration, if the source type takes one */
+	char *source;
 	int kq_event;
 	int kq_note;
 	int sock;
@@ -11,14 +49,88 @@ struct handler_info {
 	union {
 		struct {
 			int ifindex;
-			struct msghdr msghdr;
-			struct sockaddr_in6 from;
+			/* Number of router solicitations sent since the link came up */
+			int rs_sent;
+			/* Receiver of the socket shared by all rtadv sources of a routing domain */
+			struct handler_info *rx;
+			/* Routing domain of the socket, receiver only */
+			int rdomain;
+			/* The last batch of packets and the one being handled, receiver only */
+			struct mmsghdr *msgs;
+			struct sockaddr_in6 *from;
+			int npkts;
+			int cur;
+			/* Advertisements dropped without a fork, receiver only */
+			unsigned long long filtered;
+			/* Routers we heard from recently and what their floods cost, receiver only */
+			struct rtadv_router *routers;
+			size_t nrouters;
+			unsigned long long ratelimited;
+			/* Advertisements this interface may still hand to a parser */
+			struct rtadv_bucket bucket;
 		} rtadv;
+		struct {
+			/* Last known state of each link we've heard about */
+			struct link_state *links;
+			size_t nlinks;
+			/* Interfaces that came up since the event loop last looked */
+			unsigned int *came_up;
+			size_t ncame_up;
+			/* Interfaces that arrived or departed since then */
+			struct link_announce *announced;
+			size_t nannounced;
+			/* Name server proposals since then */
+			struct route_proposal *proposals;
+			size_t nproposals;
+		} route;
+		struct {
+			unsigned int ifindex;
+		} slaacd;
+		struct {
+			/* Size of the packet filter's buffer */
+			u_int blen;
+			/* Hardware address of the interface, ACKs for others are ignored */
+			u_char lladdr[6];
+		} dhcpack;
 	} v;
 };
 
-struct handler_info *dhcpv4_setup_handler(const char*, const char*);
+/* Set if handlers run in the event loop instead of a child, see inline-parsers */
+extern int handlers_inline;
+
+int dhcpv4_open(const char*);
+struct handler_info *dhcpv4_setup_handler(const char*, const char*, int);
 void dhcpv4_handle_update(int, int, void*);
+struct upstream_update_msg;
+int dhcpv4_parse(FILE *, struct upstream_update_msg *);
 
-struct handler_info *rtadv_setup_handler(const char*);
+int rtadv_open(int);
+struct handler_info *rtadv_setup_receiver(int, int);
+void rtadv_free_receiver(struct handler_info *);
+struct handler_info *rtadv_setup_handler(const char*, struct handler_info *, int);
 void rtadv_handle_update(int, int, void*);
+void rtadv_parse(const u_char *, size_t, struct upstream_update_msg *);
+int rtadv_receive(struct handler_info *);
+void rtadv_packet_info(struct handler_info *, int, int *, int *);
+int rtadv_packet_ifindex(struct handler_info *, int);
+void rtadv_inject(struct handler_info *, const struct in6_addr *, int, int, const void *, size_t);
+int rtadv_packet_has_dns(struct handler_info *, int);
+int rtadv_ratelimit(struct handler_info *, struct handler_info *, int);
+void rtadv_solicit_start(int, struct handler_info *);
+void rtadv_solicit_stop(int, struct handler_info *);
+void rtadv_solicit(int, struct handler_info *);
+
+int dhcpack_open(const char *);
+struct handler_info *dhcpack_setup_handler(const char *, int);
+void dhcpack_handle_update(int, int, void*);
+int dhcpack_parse(const u_char *, size_t, const u_char *, struct upstream_update_msg *);
+int dhcpack_parse_frame(const u_char *, size_t, const u_char *, struct upstream_update_msg *);
+
+struct handler_info *slaacd_setup_handler(const char *);
+void slaacd_solicit(int);
+struct rt_msghdr;
+int slaacd_parse_proposal(struct rt_msghdr *, size_t, unsigned int *, char **, size_t *);
+void slaacd_send_update(struct handler_info *, int, char *, size_t);
+
+struct handler_info *route_setup_handler(void);
+void route_handle_update(int, int, void*);
@@ -0,0 +1,124 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_RING	128
+#define LOG_LINELEN	512
+
+struct log_record {
+	enum log_level level;
+	time_t when;
+	char line[LOG_LINELEN];
+};
+
+int log_level = LOG_LEVEL_MAX;
+
+static struct log_record ring[LOG_RING];
+static size_t ring_len;
+/* Where records go, -1 for syslog */
+static int log_fd = STDERR_FILENO;
+static const char *procname = "dnsfoo";
+
+static const char *lvlnames[] = {
+	[LOG_LVL_WARN]  = "warning",
+	[LOG_LVL_INFO]  = "info",
+	[LOG_LVL_DEBUG] = "debug",
+};
+static const int lvlprios[] = {
+	[LOG_LVL_WARN]  = LOG_WARNING,
+	[LOG_LVL_INFO]  = LOG_INFO,
+	[LOG_LVL_DEBUG] = LOG_DEBUG,
+};
+
+/* Log to `fd', or to syslog if it's -1, everything up to `level' */
+void
+log_init(int fd, int level) {
+	log_fd = fd;
+	log_level = level;
+	if (fd == -1)
+		openlog("dnsfoo", LOG_PID | LOG_NDELAY, LOG_DAEMON);
+	/* Handler children exit right after their work, don't lose what they said */
+	atexit(log_flush);
+}
+
+void
+log_procname(const char *name) {
+	procname = name;
+}
+
+void
+log_emit(struct log_site *site, enum log_level level, int errnum, const char *fmt, ...) {
+	struct log_record *r;
+	time_t now = time(NULL);
+	int saved_errno = errno;
+	size_t off;
+	va_list ap;
+
+	if (site->second != now) {
+		site->second = now;
+		site->count = 0;
+	}
+	if (site->count++ >= LOG_SITE_BURST) {
+		site->suppressed++;
+		return;
+	}
+
+	if (ring_len == LOG_RING)
+		log_flush();
+	r = &ring[ring_len++];
+	r->level = level;
+	r->when = now;
+
+	va_start(ap, fmt);
+	(void) vsnprintf(r->line, sizeof(r->line), fmt, ap);
+	va_end(ap);
+
+	off = strlen(r->line);
+	if (errnum != 0 && off < sizeof(r->line))
+		off += snprintf(r->line + off, sizeof(r->line) - off, " error=\"%s\"",
+		                strerror(errnum));
+	if (site->suppressed > 0 && off < sizeof(r->line)) {
+		(void) snprintf(r->line + off, sizeof(r->line) - off, " suppressed=%llu",
+		                site->suppressed);
+		site->suppressed = 0;
+	}
+
+	/* Warnings shouldn't wait for the next pass through the event loop */
+	if (level == LOG_LVL_WARN)
+		log_flush();
+	errno = saved_errno;
+}
+
+/* Write out everything in the ring, called before waiting for events */
+void
+log_flush(void) {
+	static char buf[LOG_RING * (LOG_LINELEN + 64)];
+	int saved_errno = errno;
+	size_t idx, off = 0;
+	int n;
+
+	for (idx = 0; idx < ring_len; idx++) {
+		if (log_fd == -1) {
+			syslog(lvlprios[ring[idx].level], "%s: %s", procname, ring[idx].line);
+			continue;
+		}
+		n = snprintf(buf + off, sizeof(buf) - off, "%llu %s %s: %s\n",
+		             (unsigned long long) ring[idx].when, procname,
+		             lvlnames[ring[idx].level], ring[idx].line);
+		if (n > 0)
+			off += ((size_t) n < sizeof(buf) - off)? (size_t) n: sizeof(buf) - off - 1;
+	}
+	ring_len = 0;
+
+	/* One write keeps the lines of different processes apart */
+	if (off > 0)
+		(void) write(log_fd, buf, off);
+	errno = saved_errno;
+}
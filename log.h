@@ -0,0 +1,57 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+/*
+ * Records are a short message followed by key=value pairs, for example
+ * log_debug("source expired dev=%s type=%d", ...). They're formatted into an
+ * in-memory ring and written out by log_flush(), which every process calls
+ * before it waits for events. Each call site may log LOG_SITE_BURST records
+ * per second, further ones are counted and the count is reported with the
+ * next record from that site.
+ *
+ * Levels above LOG_LEVEL_MAX are compiled out, levels above the runtime
+ * level are skipped before any argument is evaluated.
+ */
+enum log_level {
+	LOG_LVL_WARN,
+	LOG_LVL_INFO,
+	LOG_LVL_DEBUG
+};
+
+#ifndef LOG_LEVEL_MAX
+#ifdef NDEBUG
+#define LOG_LEVEL_MAX LOG_LVL_INFO
+#else
+#define LOG_LEVEL_MAX LOG_LVL_DEBUG
+#endif
+#endif
+
+#define LOG_SITE_BURST 20
+
+/* Rate limit state of one call site */
+struct log_site {
+	long long second;
+	unsigned int count;
+	unsigned long long suppressed;
+};
+
+extern int log_level;
+
+#define LOG_AT(lvl, errnum, ...) do {						\
+	static struct log_site log_site_;					\
+	if ((lvl) <= LOG_LEVEL_MAX && (lvl) <= log_level)			\
+		log_emit(&log_site_, (lvl), (errnum), __VA_ARGS__);		\
+} while (0)
+
+#define log_debug(...)	LOG_AT(LOG_LVL_DEBUG, 0, __VA_ARGS__)
+#define log_info(...)	LOG_AT(LOG_LVL_INFO, 0, __VA_ARGS__)
+#define log_warnx(...)	LOG_AT(LOG_LVL_WARN, 0, __VA_ARGS__)
+/* Like warn(3), appends the description of errno */
+#define log_warn(...)	LOG_AT(LOG_LVL_WARN, errno, __VA_ARGS__)
+
+void log_init(int, int);
+void log_procname(const char *);
+void log_emit(struct log_site *, enum log_level, int, const char *, ...)
+	__attribute__((__format__ (printf, 4, 5)));
+void log_flush(void);
+#endif /* _LOG_H */
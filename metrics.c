@@ -0,0 +1,155 @@
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include "metrics.h"
+#include "upstream_update.h"
+#include "log.h"
+
+struct trace trace_current;
+
+static const double bounds[METRICS_NBUCKETS] = METRICS_BUCKETS;
+
+/* Nanoseconds on a clock that all our processes share and that never jumps */
+uint64_t
+metrics_now(void) {
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err(1, "clock_gettime");
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+metrics_observe(struct histogram *h, uint64_t ns) {
+	int idx;
+
+	for (idx = 0; idx < METRICS_NBUCKETS; idx++) {
+		if (ns <= bounds[idx] * 1e9)
+			break;
+	}
+	h->counts[idx]++;
+	h->count++;
+	h->sum += ns;
+}
+
+/*
+ * Upper bound in seconds of the bucket the `q' quantile of `h' falls into,
+ * INFINITY for the last bucket and 0 if there are no observations.
+ */
+double
+metrics_quantile(struct histogram *h, double q) {
+	uint64_t cumulative = 0;
+	int idx;
+
+	if (h->count == 0)
+		return 0;
+	for (idx = 0; idx < METRICS_NBUCKETS; idx++) {
+		cumulative += h->counts[idx];
+		if (cumulative >= q * h->count)
+			return bounds[idx];
+	}
+	return INFINITY;
+}
+
+/* snprintf() to `buf + *off', returns 0 once `buf' is full */
+static int
+metrics_printf(char *buf, size_t len, size_t *off, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + *off, len - *off, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t) n >= len - *off)
+		return 0;
+	*off += n;
+	return 1;
+}
+
+/* Render histograms and counters into `buf', returns the length or 0 if it didn't fit */
+size_t
+metrics_render(char *buf, size_t len, struct histogram *h, size_t nh,
+               struct counter *c, size_t nc) {
+	uint64_t cumulative;
+	size_t off = 0, idx;
+	int b;
+
+	buf[0] = '\0';
+	for (idx = 0; idx < nh; idx++) {
+		if (!metrics_printf(buf, len, &off, "# HELP %s %s\n# TYPE %s histogram\n",
+		                    h[idx].name, h[idx].help, h[idx].name))
+			return 0;
+		cumulative = 0;
+		for (b = 0; b < METRICS_NBUCKETS; b++) {
+			cumulative += h[idx].counts[b];
+			if (!metrics_printf(buf, len, &off, "%s_bucket{le=\"%g\"} %llu\n",
+			                    h[idx].name, bounds[b], (unsigned long long) cumulative))
+				return 0;
+		}
+		if (!metrics_printf(buf, len, &off,
+		                    "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+		                    h[idx].name, (unsigned long long) h[idx].count,
+		                    h[idx].name, h[idx].sum / 1e9,
+		                    h[idx].name, (unsigned long long) h[idx].count))
+			return 0;
+	}
+	for (idx = 0; idx < nc; idx++) {
+		if (!metrics_printf(buf, len, &off, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+		                    c[idx].name, c[idx].help, c[idx].name,
+		                    c[idx].gauge? "gauge": "counter",
+		                    c[idx].name, (unsigned long long) c[idx].value))
+			return 0;
+	}
+
+	return off;
+}
+
+/* Hand our metrics to the server repository, which serves them */
+void
+metrics_send(int fd, struct histogram *h, size_t nh, struct counter *c, size_t nc) {
+	char buf[METRICS_MAXLEN];
+	struct imsgbuf ibuf;
+	size_t len;
+
+	if ((len = metrics_render(buf, sizeof(buf), h, nh, c, nc)) == 0) {
+		log_warnx("metrics don't fit into %d bytes", METRICS_MAXLEN);
+		return;
+	}
+
+	imsg_init(&ibuf, fd);
+	if (imsg_compose(&ibuf, MSG_METRICS, 0, 0, -1, buf, len) < 0)
+		err(1, "imsg_compose");
+
+	do {
+		if (msgbuf_write(&ibuf.w) > 0)
+			return;
+	} while (errno == EAGAIN);
+
+	err(1, "msgbuf_write");
+}
+
+/* Start tracing a new event, called by the event loop before it runs a handler */
+void
+trace_begin(void) {
+	/* 0 means that an update isn't traced */
+	if (++trace_current.id == 0)
+		trace_current.id = 1;
+	trace_current.t_event = metrics_now();
+}
+
+/* Mark `msg' as the result of the current event, done parsing now */
+void
+trace_stamp(struct upstream_update_msg *msg) {
+	msg->trace = trace_current.id;
+	msg->t_event = trace_current.t_event;
+	msg->t_parsed = metrics_now();
+}
@@ -0,0 +1,52 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+#include <stdint.h>
+
+/*
+ * Latency histograms and counters, rendered in the Prometheus text format.
+ * Every process keeps its own and sends them to the server repository, which
+ * serves all of them on the metrics socket.
+ */
+
+/* Upper bounds of the histogram buckets in seconds, the last bucket is +Inf */
+#define METRICS_BUCKETS { 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10 }
+#define METRICS_NBUCKETS 9
+
+/* Largest block of metrics a single process sends */
+#define METRICS_MAXLEN 8192
+
+struct histogram {
+	const char *name;
+	const char *help;
+	uint64_t counts[METRICS_NBUCKETS + 1];
+	uint64_t count;
+	/* Nanoseconds */
+	uint64_t sum;
+};
+
+struct counter {
+	const char *name;
+	const char *help;
+	uint64_t value;
+	/* Set for values that go down as well as up */
+	int gauge;
+};
+
+/* The event the event loop is handling, handlers copy it into their updates */
+struct trace {
+	uint32_t id;
+	uint64_t t_event;
+};
+
+extern struct trace trace_current;
+
+struct upstream_update_msg;
+
+uint64_t metrics_now(void);
+void metrics_observe(struct histogram *, uint64_t);
+double metrics_quantile(struct histogram *, double);
+size_t metrics_render(char *, size_t, struct histogram *, size_t, struct counter *, size_t);
+void metrics_send(int, struct histogram *, size_t, struct counter *, size_t);
+void trace_begin(void);
+void trace_stamp(struct upstream_update_msg *);
+#endif /* _METRICS_H */
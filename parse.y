@@ -1,12 +1,17 @@
 %{
 #include <err.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include <sys/socket.h>
 #include <net/if.h>
+#include <netinet/in.h>
 #include <sys/queue.h>
 
 #include "config.h"
+#include "control.h"
+#include "log.h"
 
 static struct file {
 	FILE *stream;
@@ -18,6 +23,8 @@ extern FILE *yyin;
 int yyparse(void);
 int yylex(void);
 int yyerror(const char *);
+void yyrestart(FILE *);
+int srcspec_l_has(struct srcspec_l *, enum srctype);
 
 YYSTYPE yylval = { { NULL }, 1 };
 
@@ -30,16 +37,31 @@ struct config *config;
 
 %token	USER
 %token	DEVICE
+%token	WARMUP
+%token	GRACE ALLOW_EMPTY
+%token	STATE
+%token	LISTEN ALLOW
+%token	CONTROL METRICS
+%token	PRIORITY PREFER INET INET6 MAXSERVERS
+%token	LOG SYSLOG LOGLEVEL WARNING INFO DEBUG
+%token	RECORD BACKEND
+%token	INLINE_PARSERS RDOMAIN
 
 %token	ERROR
 
-%token	DHCPV4 RTADV
+%token	DHCPV4 RTADV SLAACD DHCPACK
 
 %token	STRING
 
 %type	<v.string> STRING
+%type	<v.number> number
+%type	<v.number> optprio
+%type	<v.number> optrdomain
+%type	<v.number> rdomainid
 %type	<v.spec> dhcpv4
 %type	<v.spec> rtadv
+%type	<v.spec> slaacd
+%type	<v.spec> dhcpack
 %type	<v.spec> srcspec
 %type	<v.spec_l> srcspec_l
 %%
@@ -49,6 +71,16 @@ grammar	:
 		| grammar '\n'
 		| grammar server '\n'
 		| grammar user '\n'
+		| grammar warmup '\n'
+		| grammar switchover '\n'
+		| grammar state '\n'
+		| grammar push '\n'
+		| grammar control '\n'
+		| grammar log '\n'
+		| grammar bench '\n'
+		| grammar runtime '\n'
+		| grammar rdomain '\n'
+		| grammar policy '\n'
 		| grammar device '\n'
 		| grammar error '\n' { file.errors++; }
 		;
@@ -61,14 +93,128 @@ server		: SERVER UNBOUND {
 		}
 		;
 user		: USER STRING {
-			if ((config->pw = getpwnam($2)) == NULL)
-					errx(1, "Can't find user %s", $2);
+			/* Looked up once we're done, allow also uses getpwnam() */
+			free(config->user);
+			config->user = $2;
 		}
 		;
-device		: DEVICE STRING optnl '{' optnl srcspec_l optnl '}'
+warmup		: WARMUP number {
+			config->warmup = $2;
+		}
+		;
+switchover	: GRACE number {
+			config->grace = $2;
+		}
+		| ALLOW_EMPTY {
+			config->allow_empty = 1;
+		}
+		;
+state		: STATE STRING {
+			free(config->statefile);
+			config->statefile = $2;
+		}
+		;
+push		: LISTEN STRING {
+			free(config->pushsocket);
+			config->pushsocket = $2;
+		}
+		| ALLOW STRING {
+			struct passwd *pw;
+			uid_t *uids;
+
+			if ((pw = getpwnam($2)) == NULL) {
+				char *tmp;
+				asprintf(&tmp, "Can't find user %s", $2);
+				yyerror(tmp);
+				free(tmp);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+			uids = reallocarray(config->pushusers, config->npushusers + 1, sizeof(*uids));
+			if (uids == NULL)
+				err(1, "reallocarray");
+			uids[config->npushusers++] = pw->pw_uid;
+			config->pushusers = uids;
+		}
+		;
+policy		: PREFER INET {
+			config->prefer = AF_INET;
+		}
+		| PREFER INET6 {
+			config->prefer = AF_INET6;
+		}
+		| MAXSERVERS number {
+			config->maxservers = $2;
+		}
+		;
+control		: CONTROL STRING {
+			free(config->controlsocket);
+			config->controlsocket = $2;
+		}
+		| METRICS STRING {
+			free(config->metricssocket);
+			config->metricssocket = $2;
+		}
+		;
+log		: LOG SYSLOG {
+			free(config->logfile);
+			config->logfile = NULL;
+			config->logsyslog = 1;
+		}
+		| LOG STRING {
+			free(config->logfile);
+			config->logfile = $2;
+			config->logsyslog = 0;
+		}
+		| LOGLEVEL WARNING {
+			config->loglevel = LOG_LVL_WARN;
+		}
+		| LOGLEVEL INFO {
+			config->loglevel = LOG_LVL_INFO;
+		}
+		| LOGLEVEL DEBUG {
+			config->loglevel = LOG_LVL_DEBUG;
+		}
+		;
+bench		: RECORD STRING {
+			free(config->recordfile);
+			config->recordfile = $2;
+		}
+		| BACKEND STRING {
+			free(config->backend);
+			config->backend = $2;
+		}
+		;
+runtime		: INLINE_PARSERS {
+			config->inline_parsers = 1;
+		}
+		;
+rdomain		: RDOMAIN rdomainid UNBOUND STRING {
+			struct rdomain *rds;
+			size_t idx;
+
+			for (idx = 0; idx < config->nrdomains; idx++) {
+				if (config->rdomains[idx].rdomain == $2)
+					break;
+			}
+			if (idx == config->nrdomains) {
+				rds = reallocarray(config->rdomains, config->nrdomains + 1, sizeof(*rds));
+				if (rds == NULL)
+					err(1, "reallocarray");
+				config->rdomains = rds;
+				config->nrdomains++;
+				rds[idx].rdomain = $2;
+			} else
+				free(config->rdomains[idx].unbound);
+			config->rdomains[idx].unbound = $4;
+		}
+		;
+device		: DEVICE STRING optprio optrdomain optnl '{' optnl srcspec_l optnl '}'
 		{
 			struct device *src;
-			if (strlen($2) > IFNAMSIZ) {
+			/* Patterns may match many interfaces, only names have a length limit */
+			if (strpbrk($2, "*?[") == NULL && strlen($2) > IFNAMSIZ) {
 				char *tmp;
 				asprintf(&tmp, "Device name '%s' too long (maximum: %d, is: %ld)",
 				         $2, IFNAMSIZ, strlen($2));
@@ -76,13 +222,23 @@ device		: DEVICE STRING optnl '{' optnl srcspec_l optnl '}'
 				free(tmp);
 				YYERROR;
 			}
+			if (strlen($2) > NAME_MAX) {
+				yyerror("Device pattern too long");
+				YYERROR;
+			}
+			if (srcspec_l_has($8, SRC_DHCPACK) && !srcspec_l_has($8, SRC_DHCPV4)) {
+				yyerror("dhcpack needs a dhcpv4 source on the same device");
+				YYERROR;
+			}
 			src = calloc(1, sizeof(*src));
 			if (src == NULL) {
 				yyerror("Can't alloc space for device");
 				YYERROR;
 			}
-			src->specs = $6;
+			src->specs = $8;
 			src->device = $2;
+			src->priority = ($3 == -1)? 0: $3;
+			src->rdomain = $4;
 			TAILQ_INSERT_TAIL(&config->devices, src, entry);
 		}
 		;
@@ -96,14 +252,52 @@ srcspec_l	: srcspec {
 		}
 		;
 
-srcspec		: dhcpv4 '\n' { $$ = $1; }
-		| rtadv '\n' { $$ = $1; }
+srcspec		: dhcpv4 optprio '\n' { $$ = $1; $$->priority = $2; }
+		| rtadv optprio '\n' { $$ = $1; $$->priority = $2; }
+		| slaacd optprio '\n' { $$ = $1; $$->priority = $2; }
+		| dhcpack optprio '\n' { $$ = $1; $$->priority = $2; }
 		;
 
 dhcpv4		: DHCPV4 STRING { $$ = new_srcspec(SRC_DHCPV4, $2); } ;
 
 rtadv		: RTADV { $$ = new_srcspec(SRC_RTADV, NULL); } ;
 
+slaacd		: SLAACD { $$ = new_srcspec(SRC_SLAACD, NULL); } ;
+
+dhcpack		: DHCPACK { $$ = new_srcspec(SRC_DHCPACK, NULL); } ;
+
+number		: STRING {
+			const char *errstr;
+			$$ = strtonum($1, 0, INT32_MAX, &errstr);
+			if (errstr != NULL) {
+				char *tmp;
+				asprintf(&tmp, "Number '%s' is %s", $1, errstr);
+				yyerror(tmp);
+				free(tmp);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+optprio		: PRIORITY number { $$ = $2; }
+		| /* empty */ { $$ = -1; }
+		;
+
+optrdomain	: RDOMAIN rdomainid { $$ = $2; }
+		| /* empty */ { $$ = 0; }
+		;
+
+rdomainid	: number {
+			if ($1 > RDOMAIN_MAX) {
+				yyerror("Routing domain out of range");
+				YYERROR;
+			}
+			$$ = $1;
+		}
+		;
+
 optnl		: optnl '\n'
 		| /* empty */
 		;
@@ -117,6 +311,7 @@ new_srcspec(enum srctype type, char *src) {
 	}
 	s->type = type;
 	s->source = src;
+	s->priority = -1;
 	return s;
 }
 
@@ -130,6 +325,17 @@ new_srcspec_l() {
 	return s;
 }
 
+int
+srcspec_l_has(struct srcspec_l *l, enum srctype type) {
+	struct srcspec *s;
+
+	TAILQ_FOREACH(s, &l->l, entry) {
+		if (s->type == type)
+			return 1;
+	}
+	return 0;
+}
+
 int
 yyerror(const char *msg) {
 	file.errors++;
@@ -156,17 +362,66 @@ parse_config(char *filename) {
 	TAILQ_INIT(&config->devices);
 
 	config->srvtype = SRV_UNBOUND;
+	config->grace = 10;
+	config->loglevel = LOG_LVL_INFO;
+	if ((config->controlsocket = strdup(CONTROL_SOCKET)) == NULL)
+		err(1, "strdup");
 
+	/* We may be parsing again after a SIGHUP */
+	file.errors = 0;
+	yylval.lineno = 1;
 	yyin = file.stream;
+	yyrestart(yyin);
 	yyparse();
 	fclose(file.stream);
 	free(file.name);
 
-	if ((config->pw == NULL) && ((config->pw = getpwnam("_dhcp")) == NULL)) {
-		errx(1, "Can't find user _dhcp");
+	/* Not fatal here, a reload keeps the old configuration instead */
+	if ((config->pw = getpwnam(config->user? config->user: "_dhcp")) == NULL) {
+		warnx("Can't find user %s", config->user? config->user: "_dhcp");
+		file.errors++;
 	}
 
 	if (file.errors == 0)
 		return config;
+	free_config(config);
 	return NULL;
 }
+
+void
+free_config(struct config *conf) {
+	struct device *dev;
+	size_t idx;
+
+	while ((dev = TAILQ_FIRST(&conf->devices)) != NULL) {
+		TAILQ_REMOVE(&conf->devices, dev, entry);
+		free_device(dev);
+	}
+	free(conf->statefile);
+	free(conf->user);
+	free(conf->pushsocket);
+	free(conf->pushusers);
+	free(conf->controlsocket);
+	free(conf->metricssocket);
+	free(conf->logfile);
+	free(conf->recordfile);
+	free(conf->backend);
+	for (idx = 0; idx < conf->nrdomains; idx++)
+		free(conf->rdomains[idx].unbound);
+	free(conf->rdomains);
+	free(conf);
+}
+
+void
+free_device(struct device *dev) {
+	struct srcspec *spec;
+
+	while ((spec = TAILQ_FIRST(&dev->specs->l)) != NULL) {
+		TAILQ_REMOVE(&dev->specs->l, spec, entry);
+		free(spec->source);
+		free(spec);
+	}
+	free(dev->specs);
+	free(dev->device);
+	free(dev);
+}
@@ -0,0 +1,203 @@
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "upstream_update.h"
+#include "log.h"
+
+/* How long we wait for name servers to answer a probe, in milliseconds */
+#define PROBE_TIMEOUT 1000
+
+struct probe {
+	const char *ns;
+	int fd;
+	u_int16_t id;
+	int ok;
+};
+
+struct upstream_probe {
+	int kq;
+	uintptr_t timer;
+	/* Our copy of the servers, `probes' points into it */
+	char *ns;
+	size_t nslen;
+	struct probe *probes;
+	size_t nprobes;
+	/* Probes still waiting for an answer */
+	size_t pending;
+};
+
+/*
+ * Send a query for the root name servers to each server in the
+ * '\0'-separated list `ns' from routing domain `rdomain'. The answers are
+ * waited for on `kq': each socket is added with `udata', and so is a timer
+ * with the ident `timer' that fires if they don't all answer in time. Hand
+ * readable sockets to upstream_probe_read() and call upstream_probe_finish()
+ * once it says everyone answered or the timer fired. Returns NULL if no probe
+ * could be sent, there's nothing to wait for then.
+ */
+struct upstream_probe *
+upstream_probe_start(const char *ns, size_t nslen, int rdomain, int kq, uintptr_t timer,
+                     void *udata) {
+	struct upstream_probe *up;
+	struct addrinfo hints, *res;
+	struct probe *pr;
+	struct kevent ev;
+	u_char buf[PACKETSZ];
+	HEADER *hp = (HEADER *) buf;
+	char *p;
+	int qlen;
+
+	if ((up = calloc(1, sizeof(*up))) == NULL)
+		err(1, "calloc");
+	up->kq = kq;
+	up->timer = timer;
+	if (nslen > 0) {
+		if ((up->ns = malloc(nslen)) == NULL)
+			err(1, "malloc");
+		memcpy(up->ns, ns, nslen);
+	}
+	up->nslen = nslen;
+
+	memset(&hints, 0x00, sizeof(hints));
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICHOST;
+
+	for (p = up->ns; p < up->ns + up->nslen; p += strlen(p) + 1) {
+		if ((up->probes = reallocarray(up->probes, up->nprobes + 1, sizeof(*up->probes))) == NULL)
+			err(1, "reallocarray");
+
+		pr = &up->probes[up->nprobes++];
+		pr->ns = p;
+		pr->fd = -1;
+		pr->ok = 0;
+
+		if (getaddrinfo(p, "domain", &hints, &res) != 0) {
+			log_warnx("probe: not an address ns=%s", p);
+			continue;
+		}
+		pr->fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK, 0);
+		if (pr->fd < 0 ||
+		    (rdomain != 0 && setsockopt(pr->fd, SOL_SOCKET, SO_RTABLE,
+		                                &rdomain, sizeof(rdomain)) < 0) ||
+		    connect(pr->fd, res->ai_addr, res->ai_addrlen) < 0) {
+			log_warn("can't probe %s", p);
+			freeaddrinfo(res);
+			if (pr->fd >= 0)
+				close(pr->fd);
+			pr->fd = -1;
+			continue;
+		}
+		freeaddrinfo(res);
+
+		qlen = res_mkquery(QUERY, ".", C_IN, T_NS, NULL, 0, NULL, buf, sizeof(buf));
+		if (qlen < 0)
+			errx(1, "res_mkquery");
+		pr->id = hp->id;
+		if (send(pr->fd, buf, qlen, 0) < 0) {
+			log_warn("can't probe %s", p);
+			close(pr->fd);
+			pr->fd = -1;
+			continue;
+		}
+
+		EV_SET(&ev, pr->fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+		up->pending++;
+	}
+
+	if (up->pending == 0) {
+		upstream_probe_finish(up, NULL);
+		return NULL;
+	}
+
+	EV_SET(&ev, timer, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, PROBE_TIMEOUT, udata);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+
+	return up;
+}
+
+/* Read the answer on socket `fd' of `up'. Returns 1 once all probes are answered */
+int
+upstream_probe_read(struct upstream_probe *up, int fd) {
+	u_char buf[PACKETSZ];
+	HEADER *hp = (HEADER *) buf;
+	struct probe *pr = NULL;
+	size_t idx;
+	ssize_t n;
+
+	for (idx = 0; idx < up->nprobes; idx++) {
+		if (up->probes[idx].fd == fd)
+			pr = &up->probes[idx];
+	}
+	if (pr == NULL)
+		return up->pending == 0;
+
+	if ((n = recv(pr->fd, buf, sizeof(buf), 0)) < 0) {
+		if (errno == EAGAIN)
+			return 0;
+	} else if (n < (ssize_t) sizeof(HEADER) || hp->id != pr->id || !hp->qr)
+		return 0; /* Not the answer to our query, keep waiting */
+	else
+		pr->ok = (hp->rcode != SERVFAIL);
+
+	/* Closing the socket also removes it from the kqueue */
+	close(pr->fd);
+	pr->fd = -1;
+	up->pending--;
+
+	return up->pending == 0;
+}
+
+/*
+ * Stop waiting for the probes of `up' and free it. Returns the list of servers
+ * that answered without a server failure, in the same format and order as
+ * the list they were started with. `*len' is set to the length of that list.
+ * A NULL `len' just cancels the probes.
+ */
+char *
+upstream_probe_finish(struct upstream_probe *up, size_t *len) {
+	struct kevent ev;
+	char *verified = NULL;
+	size_t idx, n = 0;
+
+	/* The timer is gone already if it fired */
+	EV_SET(&ev, up->timer, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	(void) kevent(up->kq, &ev, 1, NULL, 0, NULL);
+
+	for (idx = 0; idx < up->nprobes; idx++) {
+		if (up->probes[idx].fd >= 0)
+			close(up->probes[idx].fd);
+		if (len == NULL)
+			continue;
+		if (!up->probes[idx].ok) {
+			log_debug("probe failed ns=%s", up->probes[idx].ns);
+			continue;
+		}
+		if ((verified = realloc(verified, n + strlen(up->probes[idx].ns) + 1)) == NULL)
+			err(1, "realloc");
+		memcpy(verified + n, up->probes[idx].ns, strlen(up->probes[idx].ns) + 1);
+		n += strlen(up->probes[idx].ns) + 1;
+	}
+	if (len != NULL)
+		*len = n;
+
+	free(up->probes);
+	free(up->ns);
+	free(up);
+	return verified;
+}
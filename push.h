@@ -0,0 +1,27 @@
+#ifndef _PUSH_H
+#define _PUSH_H
+#include <stdint.h>
+
+/*
+ * Wire format of the push socket. Each update is one SOCK_SEQPACKET message:
+ *
+ * | struct push_hdr | device | source id | address ... |
+ *
+ * device and source id are not terminated. Each address is an address
+ * family byte (AF_INET or AF_INET6) followed by the address in network byte
+ * order. An update without addresses withdraws what the source sent before.
+ */
+#define PUSH_VERSION	1
+
+struct push_hdr {
+	uint8_t version;
+	uint8_t devlen;
+	uint8_t idlen;
+	uint8_t naddrs;
+	/* Seconds in network byte order, 0xffffffff means infinity */
+	uint32_t lifetime;
+};
+
+/* Largest possible update: 255 bytes of names each and 255 IPv6 addresses */
+#define PUSH_MAXLEN	(sizeof(struct push_hdr) + 2 * 255 + 255 * 17)
+#endif /* _PUSH_H */
@@ -0,0 +1,219 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "upstream_update.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "log.h"
+
+/* Lease files are small, anything larger isn't worth recording */
+#define REC_MAXLEN	(1024 * 1024)
+
+/* Where the event loop records its input, -1 if it doesn't */
+static int rec_fd = -1;
+static uint64_t rec_start;
+
+/* Start recording to `path', needs root if it lives in a protected directory */
+void
+recorder_open(const char *path) {
+	struct rec_header hdr;
+
+	if ((rec_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+		err(1, "open %s", path);
+
+	memset(&hdr, 0x00, sizeof(hdr));
+	memcpy(hdr.magic, REC_MAGIC, sizeof(hdr.magic));
+	hdr.version = REC_VERSION;
+	if (write(rec_fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		err(1, "write %s", path);
+
+	rec_start = metrics_now();
+}
+
+int
+recorder_active(void) {
+	return rec_fd != -1;
+}
+
+/* Append an entry, a recording that can't be written is given up on */
+static void
+recorder_write(struct rec_entry *e, const void *data, size_t len) {
+	struct iovec iov[2];
+
+	e->t = metrics_now() - rec_start;
+	e->len = len;
+	iov[0].iov_base = e;
+	iov[0].iov_len = sizeof(*e);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	if (writev(rec_fd, iov, 2) != (ssize_t) (sizeof(*e) + len)) {
+		log_warn("recorder: write, stopped recording");
+		close(rec_fd);
+		rec_fd = -1;
+	}
+}
+
+/* Record the current contents of the lease file `fd' for `device' */
+void
+recorder_lease(const char *device, int fd) {
+	struct rec_entry e;
+	struct stat st;
+	char *data;
+	ssize_t n;
+
+	if (rec_fd == -1)
+		return;
+
+	if (fstat(fd, &st) < 0) {
+		log_warn("recorder: fstat dev=%s", device);
+		return;
+	}
+	if (st.st_size > REC_MAXLEN) {
+		log_warnx("recorder: lease file too large dev=%s size=%lld", device,
+		          (long long) st.st_size);
+		return;
+	}
+	if ((data = malloc(st.st_size + 1)) == NULL)
+		err(1, "malloc");
+	/* The handler seeks on its own, so don't move the offset */
+	if ((n = pread(fd, data, st.st_size, 0)) < 0) {
+		log_warn("recorder: read dev=%s", device);
+		free(data);
+		return;
+	}
+
+	memset(&e, 0x00, sizeof(e));
+	e.kind = REC_LEASE;
+	(void) strlcpy(e.device, device, sizeof(e.device));
+	recorder_write(&e, data, n);
+	free(data);
+}
+
+/* Record a router advertisement, `device' is NULL if no source wanted it */
+void
+recorder_rtadv(const char *device, const struct in6_addr *from, int ifindex, int hlim,
+               const void *pkt, size_t len) {
+	struct rec_entry e;
+
+	if (rec_fd == -1)
+		return;
+
+	memset(&e, 0x00, sizeof(e));
+	e.kind = REC_RTADV;
+	if (device != NULL)
+		(void) strlcpy(e.device, device, sizeof(e.device));
+	e.from = *from;
+	e.ifindex = ifindex;
+	e.hlim = hlim;
+	recorder_write(&e, pkt, len);
+}
+
+static FILE *
+replay_fopen(const char *path) {
+	struct rec_header hdr;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "fopen %s", path);
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, REC_MAGIC, sizeof(hdr.magic)) != 0)
+		errx(1, "%s isn't a recording", path);
+	if (hdr.version != REC_VERSION)
+		errx(1, "%s has version %u, we understand %d", path, hdr.version, REC_VERSION);
+
+	return f;
+}
+
+/* Read the next entry of `f' into `e' and `data', returns 0 at the end */
+static int
+replay_read(FILE *f, struct rec_entry *e, char **data) {
+	size_t n;
+
+	if ((n = fread(e, 1, sizeof(*e), f)) == 0 && feof(f))
+		return 0;
+	if (n != sizeof(*e) || e->len > REC_MAXLEN ||
+	    (e->kind != REC_LEASE && e->kind != REC_RTADV))
+		errx(1, "recording is corrupt");
+	e->device[sizeof(e->device) - 1] = '\0';
+
+	if ((*data = malloc(e->len + 1)) == NULL)
+		err(1, "malloc");
+	if (fread(*data, 1, e->len, f) != e->len)
+		errx(1, "recording is truncated");
+	(*data)[e->len] = '\0';
+
+	return 1;
+}
+
+/* Open the recording `path' for playback at `speed' */
+struct replay *
+replay_open(const char *path, unsigned int speed) {
+	struct replay *rp;
+
+	if ((rp = calloc(1, sizeof(*rp))) == NULL)
+		err(1, "calloc");
+	rp->f = replay_fopen(path);
+	rp->speed = speed;
+
+	return rp;
+}
+
+/* Make the next entry available in `rp->next', returns 0 at the end */
+int
+replay_peek(struct replay *rp) {
+	if (!rp->pending)
+		rp->pending = replay_read(rp->f, &rp->next, &rp->data);
+	return rp->pending;
+}
+
+void
+replay_consume(struct replay *rp) {
+	free(rp->data);
+	rp->data = NULL;
+	rp->pending = 0;
+}
+
+/* The sources the recording `path' has input for, instead of the configured ones */
+struct source_msg *
+replay_sources(const char *path, size_t *n) {
+	struct source_msg *srcs = NULL, s;
+	struct rec_entry e;
+	FILE *f = replay_fopen(path);
+	char *data;
+	size_t idx;
+
+	*n = 0;
+	while (replay_read(f, &e, &data)) {
+		free(data);
+		if (e.device[0] == '\0')
+			continue;
+
+		memset(&s, 0x00, sizeof(s));
+		s.type = (e.kind == REC_LEASE)? SRC_DHCPV4: SRC_RTADV;
+		(void) strlcpy(s.device, e.device, sizeof(s.device));
+		for (idx = 0; idx < *n; idx++) {
+			if (srcs[idx].type == s.type && !strcmp(srcs[idx].device, s.device))
+				break;
+		}
+		if (idx < *n)
+			continue;
+
+		if ((srcs = reallocarray(srcs, *n + 1, sizeof(*srcs))) == NULL)
+			err(1, "reallocarray");
+		srcs[(*n)++] = s;
+	}
+	fclose(f);
+
+	return srcs;
+}
@@ -0,0 +1,70 @@
+#ifndef _RECORDER_H
+#define _RECORDER_H
+#include <stdint.h>
+#include <stdio.h>
+
+#include <net/if.h>
+#include <netinet/in.h>
+
+/*
+ * A recording is the input the event loop saw: the contents of lease files
+ * whenever they changed and router advertisements as they were received.
+ * dnsfoo -r plays one back, see readme.md. The file starts with a
+ * rec_header, followed by rec_entry structures, each followed by `len' bytes
+ * of data. Fields are in host byte order, recordings aren't meant to be
+ * moved between architectures.
+ */
+#define REC_MAGIC	"dnsfoorc"
+#define REC_VERSION	1
+
+struct rec_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+enum rec_kind {
+	/* Contents of a lease file */
+	REC_LEASE,
+	/* A router advertisement as received, with its ICMPv6 header */
+	REC_RTADV
+};
+
+struct rec_entry {
+	/* Nanoseconds since the recording started */
+	uint64_t t;
+	uint32_t kind;
+	uint32_t len;
+	/* Source the input was for, empty if there was none */
+	char device[IF_NAMESIZE];
+	/* Router advertisements only */
+	struct in6_addr from;
+	int32_t ifindex;
+	int32_t hlim;
+};
+
+/* A recording being played back */
+struct replay {
+	FILE *f;
+	/* How many times faster than recorded to play back, 0 for as fast as possible */
+	unsigned int speed;
+	/* When playback started, 0 until it did */
+	uint64_t start;
+	/* The next entry and its data, valid if `pending' is set */
+	struct rec_entry next;
+	char *data;
+	int pending;
+};
+
+struct source_msg;
+
+void recorder_open(const char *);
+int recorder_active(void);
+void recorder_lease(const char *, int);
+void recorder_rtadv(const char *, const struct in6_addr *, int, int, const void *, size_t);
+
+struct replay *replay_open(const char *, unsigned int);
+int replay_peek(struct replay *);
+void replay_consume(struct replay *);
+struct source_msg *replay_sources(const char *, size_t *);
+#endif /* _RECORDER_H */
@@ -0,0 +1,196 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+
+#include "dnsfoo.h"
+#include "config.h"
+#include "handlers.h"
+#include "upstream_update.h"
+#include "log.h"
+
+/*
+ * Replays the frames of a tcpdump(8) capture through the DHCPACK parser and
+ * prints what each of them turned into: the name servers, lifetime, server
+ * identifier and search domains of an acknowledgement for our hardware
+ * address, or that it was ignored. dhcpack.pcap holds a few acknowledgements
+ * and the frames that must not be taken for one, `make replay' checks what
+ * comes out against dhcpack.out. Captures of other DHCP servers can be
+ * replayed the same way:
+ *
+ *	# tcpdump -i em0 -w ack.pcap udp port 68
+ *	$ dnsfoo-replay -a `ifconfig em0 | awk '/lladdr/ { print $2 }'` ack.pcap
+ */
+
+#define PCAP_MAGIC	0xa1b2c3d4
+#define PCAP_SWAPPED	0xd4c3b2a1
+#define PCAP_EN10MB	1
+
+/* The file header and the record header of the pcap format */
+struct replay_filehdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct replay_rechdr {
+	uint32_t sec;
+	uint32_t usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/* Defined by dnsfoo.c, which isn't part of the replay */
+int handlers_inline;
+
+int
+privdrop(struct config *config) {
+	/* The replay runs as whoever started it */
+	return 1;
+}
+
+static uint32_t
+replay_u32(uint32_t v, int swapped) {
+	if (!swapped)
+		return v;
+	return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+}
+
+/* Print a '\0'-separated list of `len' bytes separated by commas, "-" if it's empty */
+static void
+replay_print_list(const char *name, const char *list, size_t len) {
+	const char *p;
+
+	printf(" %s=", name);
+	if (len == 0)
+		printf("-");
+	for (p = list; p < list + len; p += strlen(p) + 1)
+		printf("%s%s", p == list? "": ",", p);
+}
+
+static void
+replay_frame(size_t idx, const u_char *frame, size_t len, const u_char *lladdr) {
+	struct upstream_update_msg msg;
+	char ntopbuf[INET_ADDRSTRLEN];
+
+	memset(&msg, 0x00, sizeof(msg));
+	/* Same as the handler, no lease time means it doesn't expire */
+	msg.lifetime = ~0;
+
+	if (!dhcpack_parse_frame(frame, len, lladdr, &msg)) {
+		printf("%zu: ignored\n", idx);
+		upstream_update_msg_cleanup(&msg);
+		return;
+	}
+
+	printf("%zu: ack", idx);
+	replay_print_list("ns", msg.ns, msg.nslen);
+	if (msg.lifetime == (uint32_t) ~0)
+		printf(" lifetime=infinite");
+	else
+		printf(" lifetime=%u", msg.lifetime);
+	if (msg.server == 0)
+		printf(" server=-");
+	else
+		printf(" server=%s", inet_ntop(AF_INET, &msg.server, ntopbuf, sizeof(ntopbuf)));
+	replay_print_list("domains", msg.domains, msg.domainslen);
+	printf("\n");
+
+	upstream_update_msg_cleanup(&msg);
+}
+
+static void
+replay_file(const char *path, const u_char *lladdr) {
+	struct replay_filehdr fh;
+	struct replay_rechdr rh;
+	u_char *frame;
+	size_t idx;
+	int swapped;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	if (fread(&fh, sizeof(fh), 1, f) != 1)
+		errx(1, "%s: no pcap header", path);
+	if (fh.magic == PCAP_MAGIC)
+		swapped = 0;
+	else if (fh.magic == PCAP_SWAPPED)
+		swapped = 1;
+	else
+		errx(1, "%s: not a pcap file", path);
+	if (replay_u32(fh.linktype, swapped) != PCAP_EN10MB)
+		errx(1, "%s: not an Ethernet capture", path);
+
+	for (idx = 1; fread(&rh, sizeof(rh), 1, f) == 1; idx++) {
+		rh.caplen = replay_u32(rh.caplen, swapped);
+		rh.len = replay_u32(rh.len, swapped);
+		if (rh.caplen > UINT16_MAX)
+			errx(1, "%s: frame %zu is too large", path, idx);
+
+		if ((frame = malloc(rh.caplen)) == NULL)
+			err(1, "malloc");
+		if (rh.caplen > 0 && fread(frame, rh.caplen, 1, f) != 1)
+			errx(1, "%s: frame %zu is cut short", path, idx);
+
+		/* The handler skips frames bpf(4) didn't capture completely as well */
+		if (rh.caplen != rh.len)
+			printf("%zu: partial\n", idx);
+		else
+			replay_frame(idx, frame, rh.caplen, lladdr);
+		free(frame);
+	}
+	if (ferror(f))
+		err(1, "%s", path);
+
+	fclose(f);
+}
+
+__dead void
+usage(void) {
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s -a lladdr file ...\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct ether_addr *ea = NULL;
+	u_char lladdr[ETHER_ADDR_LEN];
+	int ch;
+
+	while ((ch = getopt(argc, argv, "a:")) != -1) {
+		switch (ch) {
+			case 'a':
+				if ((ea = ether_aton(optarg)) == NULL)
+					errx(1, "not a hardware address: %s", optarg);
+				memcpy(lladdr, ea, sizeof(lladdr));
+				break;
+			default:
+				usage();
+		}
+	}
+	if (ea == NULL || argc == optind)
+		usage();
+
+	log_init(STDERR_FILENO, LOG_LVL_WARN);
+
+	for (; optind < argc; optind++)
+		replay_file(argv[optind], lladdr);
+	log_flush();
+
+	return 0;
+}
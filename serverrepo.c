@@ -12,62 +12,26 @@
 #include <sys/uio.h>
 #include <imsg.h>
 
+#include <arpa/inet.h>
+
 #include "dnsfoo.h"
 #include "config.h"
 #include "upstream_update.h"
-
-struct srv_source {
-	TAILQ_ENTRY(srv_source) entry;
-	enum srctype type;
-	size_t nslen;
-	time_t expiry;
-	char *ns;
-};
-
-struct srv_device {
-	TAILQ_ENTRY(srv_device) entry;
-	TAILQ_HEAD(, srv_source) sources;
-	char *name;
-};
-
-struct srv_devlist {
-	TAILQ_HEAD(, srv_device) devices;
-	time_t expiry;
-};
+#include "serverrepo.h"
+#include "log.h"
 
 void
-serverrepo_update_upstream(int msgfd, struct srv_devlist *devices) {
-	struct srv_device *dev;
-	struct upstream_update_msg msg;
+serverrepo_dispatch(int msgfd, enum upstream_msg_type type, struct upstream_update_msg *msg) {
 	struct imsgbuf ibuf;
 	char *msgdata;
 	size_t msglen;
 
-	memset(&msg, 0x00, sizeof(msg));
-	msg.type = SRC_UNKNOWN;
-	msg.device = strdup("unknown");
-
-	TAILQ_FOREACH(dev, &devices->devices, entry) {
-		struct srv_source *src;
-		TAILQ_FOREACH(src, &dev->sources, entry) {
-			if ((msg.ns = realloc(msg.ns, msg.nslen + src->nslen)) == NULL)
-				err(1, "realloc");
-			memcpy(msg.ns + msg.nslen, src->ns, src->nslen);
-			msg.nslen += src->nslen;
-		}
-	}
-
-	if ((msgdata = upstream_update_msg_pack(&msg, &msglen)) == NULL)
+	if ((msgdata = upstream_update_msg_pack(msg, &msglen)) == NULL)
 		err(1, "failed to pack upstream update message");
 
 	imsg_init(&ibuf, msgfd);
-	if (imsg_compose(&ibuf, MSG_UPSTREAM_UPDATE, 0, 0, -1, msgdata, msglen) < 0)
+	if (imsg_compose(&ibuf, type, 0, 0, -1, msgdata, msglen) < 0)
 		err(1, "imsg_compose");
-	free(msgdata);
-
-	fprintf(stderr, "%llu: dispatching upstream update msg, dev=%s, nslen=%ld, type=%d\n",
-	        time(NULL), msg.device, msg.nslen, msg.type);
-	upstream_update_msg_cleanup(&msg);
 
 	do {
 		if (msgbuf_write(&ibuf.w) > 0)
@@ -77,129 +41,597 @@ serverrepo_update_upstream(int msgfd, struct srv_devlist *devices) {
 	err(1, "msgbuf_write");
 }
 
+/* Add every routing domain we know of to `set', including those whose devices went away */
 void
-serverrepo_handle_msg(struct upstream_update_msg *msg, int msgfd, struct srv_devlist *devices) {
+serverrepo_rdomains(struct srv_devlist *devices, rdomain_set set) {
+	struct srv_device *dev;
+	struct device *cdev;
+	size_t idx;
+
+	RDOMAIN_SET(set, 0);
+	TAILQ_FOREACH(cdev, &devices->config->devices, entry)
+		RDOMAIN_SET(set, cdev->rdomain);
+	for (idx = 0; idx < devices->config->nrdomains; idx++)
+		RDOMAIN_SET(set, devices->config->rdomains[idx].rdomain);
+	TAILQ_FOREACH(dev, &devices->devices, entry)
+		RDOMAIN_SET(set, dev->rdomain);
+}
+
+/* Mark the servers of `rdomain' as changed */
+void
+serverrepo_touch(struct srv_devlist *devices, int rdomain) {
+	RDOMAIN_SET(devices->dirty, rdomain);
+}
+
+void
+serverrepo_touch_all(struct srv_devlist *devices) {
+	serverrepo_rdomains(devices, devices->dirty);
+}
+
+/* Pass the forward zones and servers of `rdomain' on to the upstream updater */
+static void
+serverrepo_update_rdomain(int msgfd, struct srv_devlist *devices, int rdomain) {
 	struct srv_device *dev;
 	struct srv_source *src;
+	struct upstream_update_msg msg;
 
+	/* Search domains are forwarded to the servers of the source they came from */
 	TAILQ_FOREACH(dev, &devices->devices, entry) {
-		if (!strcmp(dev->name, msg->device))
-			break;
+		if (!dev->up || dev->rdomain != rdomain)
+			continue;
+		TAILQ_FOREACH(src, &dev->sources, entry) {
+			if (src->domainslen == 0 || src->nslen == 0)
+				continue;
+			memset(&msg, 0x00, sizeof(msg));
+			msg.type = src->type;
+			msg.rdomain = rdomain;
+			msg.device = (char *) dev->name;
+			msg.ns = src->ns;
+			msg.nslen = src->nslen;
+			msg.domains = src->domains;
+			msg.domainslen = src->domainslen;
+			serverrepo_dispatch(msgfd, MSG_UPSTREAM_ZONE, &msg);
+		}
 	}
-	if (dev == NULL) {
-		if ((dev = calloc(1, sizeof(struct srv_device))) == NULL)
+
+	memset(&msg, 0x00, sizeof(msg));
+	msg.type = SRC_UNKNOWN;
+	msg.rdomain = rdomain;
+	msg.device = (char *) "unknown";
+	msg.ns = policy_select(devices, devices->config, rdomain, &msg.nslen);
+	msg.trace = devices->trace;
+	msg.t_event = devices->t_event;
+	msg.t_repo = metrics_now();
+	if (devices->t_received != 0)
+		metrics_observe(&repo_hists[HIST_REPO], msg.t_repo - devices->t_received);
+	repo_counters[CNT_UPSTREAM].value++;
+
+	log_info("upstream update trace=%u rdomain=%d nslen=%zu", msg.trace, rdomain, msg.nslen);
+	serverrepo_dispatch(msgfd, MSG_UPSTREAM_UPDATE, &msg);
+}
+
+/*
+ * Pass the servers of the routing domains that changed on to the upstream
+ * updater. The DNS servers of the others are left alone.
+ */
+void
+serverrepo_update_upstream(int msgfd, struct srv_devlist *devices) {
+	int rdomain;
+
+	/* The initial state is sent in one go once all sources have been read */
+	if (devices->syncing)
+		return;
+
+	for (rdomain = 0; rdomain <= RDOMAIN_MAX; rdomain++) {
+		if (!RDOMAIN_ISSET(devices->dirty, rdomain))
+			continue;
+		RDOMAIN_CLR(devices->dirty, rdomain);
+		serverrepo_update_rdomain(msgfd, devices, rdomain);
+	}
+
+	/* Updates for other reasons, like expiry, have nothing to trace */
+	devices->trace = 0;
+	devices->t_event = devices->t_received = 0;
+}
+
+/*
+ * Sources that are dropped are kept for reuse along with their buffers, so
+ * steady updates and expiries don't allocate sources. Up to SOURCE_POOL_MAX are
+ * kept, that's enough for a burst of expiries on a large router.
+ */
+#define SOURCE_POOL_MAX 64
+
+static TAILQ_HEAD(, srv_source) source_pool = TAILQ_HEAD_INITIALIZER(source_pool);
+static size_t source_pool_len = 0;
+
+struct srv_source *
+serverrepo_alloc_source(void) {
+	struct srv_source *src;
+
+	if ((src = TAILQ_FIRST(&source_pool)) != NULL) {
+		TAILQ_REMOVE(&source_pool, src, entry);
+		repo_counters[CNT_POOLED].value = --source_pool_len;
+	} else {
+		if ((src = calloc(1, sizeof(struct srv_source))) == NULL)
 			err(1, "calloc");
-		dev->name = strdup(msg->device);
-		TAILQ_INIT(&dev->sources);
-		TAILQ_INSERT_TAIL(&devices->devices, dev, entry);
+		repo_counters[CNT_ALLOCS].value++;
 	}
+	repo_counters[CNT_SOURCES].value++;
 
-	TAILQ_FOREACH(src, &dev->sources, entry) {
-		if (src->type == msg->type)
-			break;
+	return src;
+}
+
+/* Copy `len' bytes of `data' to `buf', which only ever grows */
+static void
+serverrepo_store(char **buf, size_t *cap, const char *data, size_t len) {
+	if (len > *cap) {
+		if ((*buf = realloc(*buf, len)) == NULL)
+			err(1, "realloc");
+		repo_counters[CNT_ALLOCS].value++;
+		repo_counters[CNT_BYTES].value += len - *cap;
+		*cap = len;
 	}
-	if (src != NULL) {
-		TAILQ_REMOVE(&dev->sources, src, entry);
-		free(src->ns);
+	if (len > 0)
+		memcpy(*buf, data, len);
+}
+
+/* Replace the servers and domains of `src' */
+void
+serverrepo_set_source(struct srv_source *src, const char *ns, size_t nslen,
+                      const char *domains, size_t domainslen) {
+	serverrepo_store(&src->ns, &src->nscap, ns, nslen);
+	src->nslen = nslen;
+	serverrepo_store(&src->domains, &src->domainscap, domains, domainslen);
+	src->domainslen = domainslen;
+}
+
+void
+serverrepo_free_source(struct srv_source *src) {
+	char *ns = src->ns, *domains = src->domains;
+	size_t nscap = src->nscap, domainscap = src->domainscap;
+
+	repo_counters[CNT_SOURCES].value--;
+	free(src->id);
+
+	if (source_pool_len == SOURCE_POOL_MAX) {
+		repo_counters[CNT_BYTES].value -= nscap + domainscap;
+		free(ns);
+		free(domains);
 		free(src);
+		return;
+	}
+
+	memset(src, 0x00, sizeof(*src));
+	src->ns = ns;
+	src->nscap = nscap;
+	src->domains = domains;
+	src->domainscap = domainscap;
+	TAILQ_INSERT_HEAD(&source_pool, src, entry);
+	repo_counters[CNT_POOLED].value = ++source_pool_len;
+}
+
+/* The id of `name' in the name table of `devices', returns 0 if it has none yet */
+static int
+serverrepo_name_lookup(struct srv_devlist *devices, const char *name, size_t *id) {
+	size_t idx;
+
+	for (idx = 0; idx < devices->nnames; idx++) {
+		if (!strcmp(devices->names[idx].name, name)) {
+			*id = idx;
+			return 1;
+		}
 	}
-	if ((src = calloc(1, sizeof(struct srv_source))) == NULL)
+	return 0;
+}
+
+/* The id of `name', which is added to the name table if it isn't there yet */
+static size_t
+serverrepo_name_intern(struct srv_devlist *devices, const char *name) {
+	size_t id;
+
+	if (serverrepo_name_lookup(devices, name, &id))
+		return id;
+
+	if (devices->nnames == devices->namescap) {
+		devices->namescap = devices->namescap? devices->namescap * 2: 16;
+		if ((devices->names = reallocarray(devices->names, devices->namescap,
+		                                   sizeof(*devices->names))) == NULL)
+			err(1, "reallocarray");
+	}
+	if ((devices->names[devices->nnames].name = strdup(name)) == NULL)
+		err(1, "strdup");
+	devices->names[devices->nnames].dev = NULL;
+	repo_counters[CNT_NAMES].value = devices->nnames + 1;
+
+	return devices->nnames++;
+}
+
+/* The device called `name', NULL if we have none */
+struct srv_device *
+serverrepo_find_device(struct srv_devlist *devices, const char *name) {
+	size_t id;
+
+	if (!serverrepo_name_lookup(devices, name, &id))
+		return NULL;
+	return devices->names[id].dev;
+}
+
+struct srv_device *
+serverrepo_get_device(struct srv_devlist *devices, const char *name) {
+	struct srv_device *dev;
+	struct device *cdev;
+	size_t id;
+
+	id = serverrepo_name_intern(devices, name);
+	if (devices->names[id].dev != NULL)
+		return devices->names[id].dev;
+
+	if ((dev = calloc(1, sizeof(struct srv_device))) == NULL)
 		err(1, "calloc");
-	src->type = msg->type;
-	src->nslen = msg->nslen;
+	dev->id = id;
+	dev->name = devices->names[id].name;
+	dev->up = 1;
+	if ((cdev = policy_device(devices->config, name)) != NULL)
+		dev->rdomain = cdev->rdomain;
+	TAILQ_INIT(&dev->sources);
+	TAILQ_INSERT_TAIL(&devices->devices, dev, entry);
+	devices->names[id].dev = dev;
+	return dev;
+}
+
+/* Forget `dev' and its sources, its name stays in the name table for when it comes back */
+void
+serverrepo_free_device(struct srv_devlist *devices, struct srv_device *dev) {
+	struct srv_source *src;
+
+	while ((src = TAILQ_FIRST(&dev->sources)) != NULL) {
+		TAILQ_REMOVE(&dev->sources, src, entry);
+		serverrepo_free_source(src);
+	}
+	TAILQ_REMOVE(&devices->devices, dev, entry);
+	devices->names[dev->id].dev = NULL;
+	free(dev);
+}
+
+/* Forget all devices and their names */
+void
+serverrepo_free_devices(struct srv_devlist *devices) {
+	struct srv_device *dev;
+	size_t idx;
+
+	while ((dev = TAILQ_FIRST(&devices->devices)) != NULL)
+		serverrepo_free_device(devices, dev);
+	for (idx = 0; idx < devices->nnames; idx++)
+		free(devices->names[idx].name);
+	free(devices->names);
+	devices->names = NULL;
+	devices->nnames = devices->namescap = 0;
+	repo_counters[CNT_NAMES].value = 0;
+}
+
+void
+serverrepo_handle_link_state(struct link_state_msg *msg, int msgfd, struct srv_devlist *devices,
+                             struct config *config) {
+	struct srv_device *dev;
+	struct device *cdev;
+
+	/* Only devices we have servers for or that are configured matter */
+	dev = serverrepo_find_device(devices, msg->device);
+	cdev = policy_device(config, msg->device);
+	if (dev == NULL && cdev == NULL)
+		return;
+
+	dev = serverrepo_get_device(devices, msg->device);
+	if (dev->up == msg->up)
+		return;
+	dev->up = msg->up;
+
+	log_info("link state dev=%s up=%d", dev->name, dev->up);
+
+	if (!TAILQ_EMPTY(&dev->sources)) {
+		serverrepo_touch(devices, dev->rdomain);
+		serverrepo_update_upstream(msgfd, devices);
+	}
+}
+
+/* Remember a device statement of a reloaded configuration until all of them are there */
+void
+serverrepo_handle_config_device(struct device_msg *dm, struct srv_devlist *devices) {
+	struct device *cdev;
+	struct srcspec *spec;
+	int type;
+
+	if ((cdev = calloc(1, sizeof(*cdev))) == NULL ||
+	    (cdev->specs = calloc(1, sizeof(*cdev->specs))) == NULL)
+		err(1, "calloc");
+	if ((cdev->device = strdup(dm->device)) == NULL)
+		err(1, "strdup");
+	TAILQ_INIT(&cdev->specs->l);
+	cdev->priority = dm->priority;
+	cdev->rdomain = dm->rdomain;
+
+	/* Sources are only looked at for their priorities */
+	for (type = 0; type < SRC_UNKNOWN; type++) {
+		if (dm->priorities[type] == -1)
+			continue;
+		if ((spec = calloc(1, sizeof(*spec))) == NULL)
+			err(1, "calloc");
+		spec->type = type;
+		spec->priority = dm->priorities[type];
+		TAILQ_INSERT_TAIL(&cdev->specs->l, spec, entry);
+	}
+
+	TAILQ_INSERT_TAIL(&devices->reloaded, cdev, entry);
+}
+
+/*
+ * Replace the device statements of our copy of the configuration with those of
+ * a reload. Devices that moved to another routing domain take their servers
+ * along, and priorities may have changed, so everything is passed on again.
+ */
+void
+serverrepo_handle_config_done(int msgfd, struct srv_devlist *devices) {
+	struct srv_device *dev;
+	struct device *cdev;
+	int rdomain;
+
+	while ((cdev = TAILQ_FIRST(&devices->config->devices)) != NULL) {
+		TAILQ_REMOVE(&devices->config->devices, cdev, entry);
+		free_device(cdev);
+	}
+	TAILQ_CONCAT(&devices->config->devices, &devices->reloaded, entry);
+
+	TAILQ_FOREACH(dev, &devices->devices, entry) {
+		cdev = policy_device(devices->config, dev->name);
+		rdomain = (cdev != NULL)? cdev->rdomain: 0;
+		if (rdomain == dev->rdomain)
+			continue;
+		log_info("device moved dev=%s rdomain=%d to=%d", dev->name, dev->rdomain, rdomain);
+		/* The old routing domain may not be known anymore, but has to lose the servers */
+		serverrepo_touch(devices, dev->rdomain);
+		dev->rdomain = rdomain;
+	}
+
+	serverrepo_touch_all(devices);
+	serverrepo_update_upstream(msgfd, devices);
+}
+
+/* Forget everything learned from a source that was removed from the configuration */
+void
+serverrepo_handle_source_del(struct source_msg *msg, int msgfd, struct srv_devlist *devices) {
+	struct srv_device *dev;
+	struct srv_source *src, *tmp;
+	int changed = 0;
+
+	if ((dev = serverrepo_find_device(devices, msg->device)) == NULL)
+		return;
+
+	TAILQ_FOREACH_SAFE(src, &dev->sources, entry, tmp) {
+		if (src->type != msg->type)
+			continue;
+		TAILQ_REMOVE(&dev->sources, src, entry);
+		serverrepo_free_source(src);
+		changed = 1;
+	}
+	if (changed)
+		serverrepo_touch(devices, dev->rdomain);
+
+	/* Interfaces matched by a pattern may never come back */
+	if (TAILQ_EMPTY(&dev->sources))
+		serverrepo_free_device(devices, dev);
+
+	if (!changed)
+		return;
+
+	serverrepo_recompute_expiry(devices);
+	serverrepo_update_upstream(msgfd, devices);
+}
+
+/*
+ * Whether the DHCPACK in `msg' is from the server the lease file of its device
+ * names. Any host on the segment can send an ACK for our hardware address,
+ * dhclient itself only listens to the server it has its lease from.
+ */
+static int
+serverrepo_ack_trusted(struct upstream_update_msg *msg, struct srv_devlist *devices) {
+	struct srv_device *dev;
+	struct srv_source *src;
+
+	if (msg->server == 0)
+		return 0;
+	if ((dev = serverrepo_find_device(devices, msg->device)) == NULL)
+		return 0;
+	TAILQ_FOREACH(src, &dev->sources, entry) {
+		if (src->type == SRC_DHCPV4 && src->server == msg->server)
+			return 1;
+	}
+	return 0;
+}
+
+/* Store what a source told us. `id' tells sources of the same type apart, if there can be several */
+void
+serverrepo_handle_msg(struct upstream_update_msg *msg, const char *id, int msgfd,
+                      struct srv_devlist *devices) {
+	struct srv_device *dev;
+	struct srv_source *src;
+
+	devices->t_received = metrics_now();
+	devices->trace = msg->trace;
+	/* Pushed updates start here */
+	devices->t_event = msg->t_event? msg->t_event: devices->t_received;
+	if (msg->t_parsed != 0)
+		metrics_observe(&repo_hists[HIST_TO_REPO], devices->t_received - msg->t_parsed);
+	repo_counters[CNT_UPDATES].value++;
+
+	if (msg->type == SRC_DHCPACK && !serverrepo_ack_trusted(msg, devices)) {
+		struct in_addr server = { msg->server };
+		char buf[INET_ADDRSTRLEN];
+
+		log_warnx("dhcpack: ignoring ack not from the lease's server dev=%s server=%s",
+		          msg->device, inet_ntop(AF_INET, &server, buf, sizeof(buf)));
+		return;
+	}
+
+	dev = serverrepo_get_device(devices, msg->device);
+	serverrepo_touch(devices, dev->rdomain);
+
+	TAILQ_FOREACH(src, &dev->sources, entry) {
+		if (src->type != msg->type)
+			continue;
+		if (id == NULL || (src->id != NULL && !strcmp(src->id, id)))
+			break;
+	}
+	/* The source withdrew everything it told us before */
+	if (msg->nslen == 0 && msg->domainslen == 0) {
+		if (src != NULL) {
+			TAILQ_REMOVE(&dev->sources, src, entry);
+			serverrepo_free_source(src);
+		}
+		serverrepo_recompute_expiry(devices);
+		serverrepo_update_upstream(msgfd, devices);
+		return;
+	}
+	/* Sources that report again are updated in place */
+	if (src == NULL) {
+		src = serverrepo_alloc_source();
+		src->type = msg->type;
+		if (id != NULL && (src->id = strdup(id)) == NULL)
+			err(1, "strdup");
+		TAILQ_INSERT_TAIL(&dev->sources, src, entry);
+	}
 	if (msg->lifetime == ~0)
 		src->expiry = (time_t) -1;
 	else
-		src->expiry = time(NULL) + msg->lifetime;
-	if ((src->ns = calloc(1, msg->nslen)) == NULL)
-		err(1, "calloc");
-	memcpy(src->ns, msg->ns, msg->nslen);
-	TAILQ_INSERT_TAIL(&dev->sources, src, entry);
-
-	fprintf(stderr, "%llu: new expiry: %lld (%d)\n",
-	        time(NULL), src->expiry, src->expiry == (time_t) -1);
+		src->expiry = devices->clock(NULL) + msg->lifetime;
+	src->server = msg->server;
+	serverrepo_set_source(src, msg->ns, msg->nslen, msg->domains, msg->domainslen);
 
+	/* An earlier expiry this source no longer has just makes for a spurious timeout */
 	if ((src->expiry != (time_t) -1) &&
 	    ((devices->expiry == (time_t) -1) ||
 	     (devices->expiry > src->expiry))) {
 		devices->expiry = src->expiry;
-		fprintf(stderr, "%llu: new expiry: %lld seconds\n", time(NULL), devices->expiry);
+		log_debug("next expiry at=%lld", (long long) devices->expiry);
 	}
 
-	fprintf(stderr, "%llu: dev=%p src=%p\n", time(NULL), (void*) dev, (void*) src);
+	log_debug("source updated dev=%s type=%d nslen=%zu expiry=%lld", dev->name, src->type,
+	          src->nslen, (long long) src->expiry);
 
 	serverrepo_update_upstream(msgfd, devices);
 }
 
 void
-serverrepo_handle_timeout(int msg_fd, struct srv_devlist *devs) {
-	struct srv_device *dev = NULL;
-	struct srv_source *src = NULL;
-	time_t now = time(NULL);
+serverrepo_recompute_expiry(struct srv_devlist *devs) {
+	struct srv_device *dev;
+	struct srv_source *src;
 
-	fprintf(stderr, "%llu: Handling timeout\n", time(NULL));
+	devs->expiry = (time_t) -1;
+	TAILQ_FOREACH(dev, &devs->devices, entry) {
+		TAILQ_FOREACH(src, &dev->sources, entry) {
+			if (src->expiry == (time_t) -1)
+				continue;
 
-	for (;;) {
-		TAILQ_FOREACH(dev, &devs->devices, entry) {
-			TAILQ_FOREACH(src, &dev->sources, entry) {
-				if (src->expiry <= now)
-					break;
-			}
-			if (src != NULL)
-				break;
+			if ((src->expiry < devs->expiry) || (devs->expiry == (time_t) -1))
+				devs->expiry = src->expiry;
 		}
-		if (src == NULL)
-			break;
-		fprintf(stderr, "%llu: expired entry: %p, expiry=%lld\n",
-		        time(NULL), (void*) src, src->expiry);
-		TAILQ_REMOVE(&dev->sources, src, entry);
-		free(src->ns);
-		free(src);
 	}
+}
+
+/*
+ * Drop every source that expired by now and find the next expiry, in one pass
+ * over all sources. Sources that never expire are left alone.
+ */
+void
+serverrepo_handle_timeout(int msg_fd, struct srv_devlist *devs) {
+	struct srv_device *dev;
+	struct srv_source *src, *tmp;
+	time_t now = devs->clock(NULL);
+	size_t nexpired = 0;
 
-	/* Update next expiry */
 	devs->expiry = (time_t) -1;
 	TAILQ_FOREACH(dev, &devs->devices, entry) {
-		fprintf(stderr, "%llu: checking device '%s' %d\n",
-		        time(NULL), dev->name, TAILQ_EMPTY(&dev->sources));
-		TAILQ_FOREACH(src, &dev->sources, entry) {
-			fprintf(stderr, "%llu: src->expiry=%lld, dev->expiry=%lld, %d\n",
-			        time(NULL), src->expiry, devs->expiry, src->expiry < devs->expiry);
+		TAILQ_FOREACH_SAFE(src, &dev->sources, entry, tmp) {
 			if (src->expiry == (time_t) -1)
 				continue;
-
+			if (src->expiry <= now) {
+				log_info("source expired dev=%s type=%d", dev->name, src->type);
+				serverrepo_touch(devs, dev->rdomain);
+				TAILQ_REMOVE(&dev->sources, src, entry);
+				serverrepo_free_source(src);
+				nexpired++;
+				continue;
+			}
 			if ((src->expiry < devs->expiry) || (devs->expiry == (time_t) -1))
 				devs->expiry = src->expiry;
 		}
 	}
 
-	fprintf(stderr, "%llu: done with timeout handling, new expiry=%lld\n",
-	        time(NULL), devs->expiry);
+	log_debug("timeout handled expired=%zu next=%lld", nexpired, (long long) devs->expiry);
+
+	/* Spurious wakeups don't change what upstream has */
+	if (nexpired > 0)
+		serverrepo_update_upstream(msg_fd, devs);
+}
+
+/* Read what the upstream updater sent us */
+void
+serverrepo_handle_upstream(struct imsgbuf *ubuf) {
+	struct imsg imsg;
+	ssize_t n;
+
+	if ((n = imsg_read(ubuf)) == -1 || n == 0)
+		err(1, "imsg_read");
 
-	serverrepo_update_upstream(msg_fd, devs);
+	while ((n = imsg_get(ubuf, &imsg)) > 0) {
+		if (imsg.hdr.type != MSG_METRICS)
+			errx(1, "unknown IMSG received: %d", imsg.hdr.type);
+		metrics_store(1, imsg.data, imsg.hdr.len - IMSG_HEADER_SIZE);
+		imsg_free(&imsg);
+	}
+	if (n == -1)
+		err(1, "imsg_get");
 }
 
 int
-serverrepo_loop(int msg_fd_handlers, int msg_fd_upstream, struct config *config) {
+serverrepo_loop(int msg_fd_handlers, int msg_fd_upstream, int push_fd, int ctl_fd,
+                int metrics_fd, struct config *config) {
 	struct srv_devlist devices;
+	struct ctl_client *cc;
 	struct kevent ev;
+	char promises[64] = "stdio rpath";
 	struct upstream_update_msg msg;
-	struct imsgbuf ibuf;
+	struct imsgbuf ibuf, ubuf;
 	struct imsg imsg;
 	int kq, ret;
 	char *imsgdata;
 	ssize_t n, datalen;
+	time_t next;
 
 	setproctitle("server repository");
+	log_procname("server repository");
 
 	if (!privdrop(config))
 		err(1, "privdrop");
 
-	if (pledge("stdio rpath", NULL) < 0)
+	if (config->statefile != NULL)
+		(void) strlcat(promises, " wpath cpath", sizeof(promises));
+	if (push_fd != -1 || ctl_fd != -1 || metrics_fd != -1)
+		(void) strlcat(promises, " unix", sizeof(promises));
+	if (pledge(promises, NULL) < 0)
 		err(1, "pledge");
 
+	memset(&devices, 0x00, sizeof(devices));
 	TAILQ_INIT(&devices.devices);
+	TAILQ_INIT(&devices.reloaded);
 	devices.expiry = (time_t) -1;
+	devices.save_at = (time_t) -1;
+	devices.clock = time;
+	devices.syncing = 1;
+	devices.config = config;
+
+	/* Pick up where we left off, the snapshot is dispatched after the initial sync */
+	if (config->statefile != NULL)
+		(void) serverrepo_load(&devices, config->statefile);
 	imsg_init(&ibuf, msg_fd_handlers);
 
 	if ((kq = kqueue()) < 0)
@@ -207,47 +639,179 @@ serverrepo_loop(int msg_fd_handlers, int msg_fd_upstream, struct config *config)
 
 	EV_SET(&ev, msg_fd_handlers, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
 
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+
+	if (push_fd != -1) {
+		EV_SET(&ev, push_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+	}
+	if (ctl_fd != -1) {
+		EV_SET(&ev, ctl_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+	}
+	if (metrics_fd != -1) {
+		EV_SET(&ev, metrics_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+	}
+
+	/* The upstream updater only ever sends us its metrics */
+	imsg_init(&ubuf, msg_fd_upstream);
+	EV_SET(&ev, msg_fd_upstream, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
 	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
 		err(1, "kevent");
 
 	for (;;) {
-		if (devices.expiry != (time_t) -1) {
-			struct timespec t = {devices.expiry - time(NULL)};
+		log_flush();
+		/* Even if events keep coming, changes are written out in time */
+		serverrepo_save_due(&devices);
+
+		next = devices.expiry;
+		if (devices.save_at != (time_t) -1 && (next == (time_t) -1 || devices.save_at < next))
+			next = devices.save_at;
+		if (next != (time_t) -1) {
+			/* Something may have expired while we were busy, don't pass a negative timeout */
+			struct timespec t = {next - devices.clock(NULL)};
+			if (t.tv_sec < 0)
+				t.tv_sec = 0;
 			ret = kevent(kq, NULL, 0, &ev, 1, &t);
 		} else
 			ret = kevent(kq, NULL, 0, &ev, 1, NULL);
 
 		switch (ret) {
 			case 0:
-				/* Timeout */
-				serverrepo_handle_timeout(msg_fd_upstream, &devices);
+				/* Timeout, either for an expiry or for the snapshot */
+				if (devices.expiry != (time_t) -1 && devices.expiry <= devices.clock(NULL)) {
+					serverrepo_handle_timeout(msg_fd_upstream, &devices);
+					serverrepo_changed(&devices);
+				}
 				break;
 			case -1:
 				err(1, "kevent");
 				break;
 			case 1:
+				if (ev.ident == push_fd) {
+					push_accept(kq, push_fd, config);
+					break;
+				}
+				if (ev.ident == metrics_fd) {
+					metrics_serve(metrics_fd);
+					break;
+				}
+				if (ev.ident == msg_fd_upstream) {
+					serverrepo_handle_upstream(&ubuf);
+					break;
+				}
+				if (ev.ident == ctl_fd) {
+					control_accept(kq, ctl_fd);
+					break;
+				}
+				if ((cc = control_lookup(ev.ident)) != NULL) {
+					control_dispatch(kq, cc, ev.filter, msg_fd_handlers,
+					                 msg_fd_upstream, &devices);
+					break;
+				}
+				/* Only push clients carry udata */
+				if (ev.udata != NULL) {
+					if (push_read(ev.udata, msg_fd_upstream, &devices))
+						serverrepo_changed(&devices);
+					break;
+				}
+
 				if ((n = imsg_read(&ibuf)) == -1 || n == 0)
 					err(1, "imsg_read");
 
 				while ((n = imsg_get(&ibuf, &imsg) > 0)) {
 					datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
-					fprintf(stderr, "%llu: got %ld bytes of payload\n", time(NULL), datalen);
+					if (imsg.hdr.type == MSG_SYNC_DONE) {
+						imsg_free(&imsg);
+						devices.syncing = 0;
+						serverrepo_touch_all(&devices);
+						serverrepo_update_upstream(msg_fd_upstream, &devices);
+						continue;
+					}
+
+					if (imsg.hdr.type == MSG_METRICS) {
+						metrics_store(0, imsg.data, datalen);
+						imsg_free(&imsg);
+						continue;
+					}
+
+					/* Comes after the updates of the last entry, so it's passed on after them */
+					if (imsg.hdr.type == MSG_REPLAY_DONE) {
+						struct imsgbuf obuf;
+
+						imsg_free(&imsg);
+						imsg_init(&obuf, msg_fd_upstream);
+						if (imsg_compose(&obuf, MSG_REPLAY_DONE, 0, 0, -1, NULL, 0) < 0)
+							err(1, "imsg_compose");
+						if (imsg_flush(&obuf) < 0)
+							err(1, "imsg_flush");
+						continue;
+					}
+
+					if (imsg.hdr.type == MSG_LINK_STATE) {
+						struct link_state_msg ls;
+
+						if (datalen != sizeof(ls))
+							errx(1, "invalid link state message");
+						memcpy(&ls, imsg.data, sizeof(ls));
+						ls.device[sizeof(ls.device) - 1] = '\0';
+						imsg_free(&imsg);
+						serverrepo_handle_link_state(&ls, msg_fd_upstream, &devices, config);
+						continue;
+					}
+
+					if (imsg.hdr.type == MSG_CONFIG_DEVICE) {
+						struct device_msg dm;
+
+						if (datalen != sizeof(dm))
+							errx(1, "invalid device message");
+						memcpy(&dm, imsg.data, sizeof(dm));
+						dm.device[sizeof(dm.device) - 1] = '\0';
+						imsg_free(&imsg);
+						if (dm.rdomain < 0 || dm.rdomain > RDOMAIN_MAX)
+							errx(1, "invalid device message");
+						serverrepo_handle_config_device(&dm, &devices);
+						continue;
+					}
+
+					if (imsg.hdr.type == MSG_CONFIG_DONE) {
+						imsg_free(&imsg);
+						serverrepo_handle_config_done(msg_fd_upstream, &devices);
+						continue;
+					}
+
+					if (imsg.hdr.type == MSG_SOURCE_DEL) {
+						struct source_msg sm;
+
+						if (datalen != sizeof(sm))
+							errx(1, "invalid source message");
+						memcpy(&sm, imsg.data, sizeof(sm));
+						sm.device[sizeof(sm.device) - 1] = '\0';
+						imsg_free(&imsg);
+						serverrepo_handle_source_del(&sm, msg_fd_upstream, &devices);
+						serverrepo_changed(&devices);
+						continue;
+					}
 
 					if (imsg.hdr.type != MSG_UPSTREAM_UPDATE)
 						errx(1, "unknown IMSG received: %d", imsg.hdr.type);
 
-					if ((imsgdata = calloc(1, datalen)) == NULL)
-						err(1, "calloc");
-					memcpy(imsgdata, imsg.data, datalen);
+					/* The message points into the imsg, which is freed once it's handled */
+					if (datalen < 1)
+						errx(1, "invalid update msg");
+					imsgdata = imsg.data;
 					imsgdata[datalen - 1] = '\0';
-					imsg_free(&imsg);
-
 					if (!upstream_update_msg_unpack(&msg, imsgdata, datalen))
 						err(1, "failed to unpack update msg");
-					free(imsgdata);
 
-					serverrepo_handle_msg(&msg, msg_fd_upstream, &devices);
-					upstream_update_msg_cleanup(&msg);
+					serverrepo_handle_msg(&msg, NULL, msg_fd_upstream, &devices);
+					imsg_free(&imsg);
+					serverrepo_changed(&devices);
 				}
 				if (n == -1)
 					err(1, "imsg_get");
@@ -1 +1,132 @@
-int serverrepo_loop(int, int, struct config*);
+#ifndef _SERVERREPO_H
+#define _SERVERREPO_H
+#include <sys/queue.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "config.h"
+#include "metrics.h"
+
+/* A set of routing domains, one bit each */
+typedef uint8_t rdomain_set[(RDOMAIN_MAX + 8) / 8];
+#define RDOMAIN_SET(s, r)	((s)[(r) / 8] |= 1 << ((r) % 8))
+#define RDOMAIN_CLR(s, r)	((s)[(r) / 8] &= ~(1 << ((r) % 8)))
+#define RDOMAIN_ISSET(s, r)	((s)[(r) / 8] & (1 << ((r) % 8)))
+
+struct srv_source {
+	TAILQ_ENTRY(srv_source) entry;
+	enum srctype type;
+	/* Tells sources of the same type apart, NULL if there's only one per device */
+	char *id;
+	size_t nslen;
+	time_t expiry;
+	char *ns;
+	size_t domainslen;
+	char *domains;
+	/* DHCP server of a dhcpv4 lease, network byte order, 0 if unknown */
+	uint32_t server;
+	/* Sizes of the buffers behind `ns' and `domains', which are reused */
+	size_t nscap;
+	size_t domainscap;
+};
+
+struct srv_device {
+	TAILQ_ENTRY(srv_device) entry;
+	TAILQ_HEAD(, srv_source) sources;
+	/* Index of the device's name in the name table, and that name */
+	size_t id;
+	const char *name;
+	/* Servers of devices whose link is down are kept, but not used */
+	int up;
+	/* Routing domain from the configuration, 0 for devices it doesn't know */
+	int rdomain;
+};
+
+/*
+ * Device names are stored once, in the name table of the repository, and a
+ * device's id is the index of its name there. A name stays when its device
+ * goes away, like an interface matched by a pattern, and is used again when it
+ * comes back. Looking up a device by name is a single pass over the table.
+ */
+struct srv_name {
+	char *name;
+	/* The device by that name, NULL while there is none */
+	struct srv_device *dev;
+};
+
+struct srv_devlist {
+	TAILQ_HEAD(, srv_device) devices;
+	/* Name table of the devices */
+	struct srv_name *names;
+	size_t nnames;
+	size_t namescap;
+	/* Earliest expiry of all sources, -1 if none of them expire */
+	time_t expiry;
+	/* Where the repository gets the time from, time(3) unless it's simulated */
+	time_t (*clock)(time_t *);
+	/* When the snapshot is written next, -1 if it's up to date */
+	time_t save_at;
+	/* Set until the event loop has read all sources once */
+	int syncing;
+	/* Priorities and limits for picking the servers to use */
+	struct config *config;
+	/* Device statements of a reload, until all of them are there */
+	TAILQ_HEAD(, device) reloaded;
+	/* Routing domains whose servers have to be passed on again */
+	rdomain_set dirty;
+	/* Event behind the update being handled, passed on to the upstream updater */
+	uint32_t trace;
+	uint64_t t_event;
+	uint64_t t_received;
+};
+
+struct upstream_update_msg;
+struct push_client;
+struct ctl_client;
+
+int serverrepo_loop(int, int, int, int, int, struct config*);
+void serverrepo_update_upstream(int, struct srv_devlist *);
+void serverrepo_touch(struct srv_devlist *, int);
+void serverrepo_touch_all(struct srv_devlist *);
+void serverrepo_rdomains(struct srv_devlist *, rdomain_set);
+struct srv_device *serverrepo_get_device(struct srv_devlist *, const char *);
+struct srv_device *serverrepo_find_device(struct srv_devlist *, const char *);
+void serverrepo_free_device(struct srv_devlist *, struct srv_device *);
+void serverrepo_free_devices(struct srv_devlist *);
+void serverrepo_handle_msg(struct upstream_update_msg *, const char *, int, struct srv_devlist *);
+void serverrepo_recompute_expiry(struct srv_devlist *);
+void serverrepo_handle_timeout(int, struct srv_devlist *);
+struct device_msg;
+void serverrepo_handle_config_device(struct device_msg *, struct srv_devlist *);
+void serverrepo_handle_config_done(int, struct srv_devlist *);
+struct srv_source *serverrepo_alloc_source(void);
+void serverrepo_set_source(struct srv_source *, const char *, size_t, const char *, size_t);
+void serverrepo_free_source(struct srv_source *);
+
+struct device *policy_device(struct config *, const char *);
+char *policy_select(struct srv_devlist *, struct config *, int, size_t *);
+
+int push_open(const char *);
+void push_accept(int, int, struct config *);
+int push_read(struct push_client *, int, struct srv_devlist *);
+void push_ratelimit_clear(void);
+
+int control_open(const char *);
+void control_accept(int, int);
+struct ctl_client *control_lookup(int);
+void control_dispatch(int, struct ctl_client *, int, int, int, struct srv_devlist *);
+
+enum { HIST_TO_REPO, HIST_REPO };
+enum { CNT_UPDATES, CNT_UPSTREAM, CNT_ALLOCS, CNT_SOURCES, CNT_POOLED, CNT_BYTES, CNT_NAMES };
+extern struct histogram repo_hists[];
+extern struct counter repo_counters[];
+
+int metrics_open(const char *);
+void metrics_store(int, const char *, size_t);
+void metrics_serve(int);
+
+int serverrepo_save(struct srv_devlist *, const char *);
+int serverrepo_load(struct srv_devlist *, const char *);
+void serverrepo_changed(struct srv_devlist *);
+void serverrepo_save_due(struct srv_devlist *);
+#endif /* _SERVERREPO_H */
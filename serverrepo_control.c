@@ -0,0 +1,290 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <imsg.h>
+
+#include "config.h"
+#include "control.h"
+#include "upstream_update.h"
+#include "serverrepo.h"
+#include "log.h"
+
+/*
+ * The control socket lets root look at what the repository currently knows
+ * and poke the other processes, see control.h and dnsfooctl(8). Replies are
+ * queued and written whenever the client is ready for them, so a slow client
+ * never holds up updates.
+ */
+#define CONTROL_MAX_CLIENTS	4
+
+struct ctl_client {
+	int fd;
+	struct imsgbuf ibuf;
+};
+
+static struct ctl_client ctl_clients[CONTROL_MAX_CLIENTS];
+
+/* Create the control socket, needs root */
+int
+control_open(const char *path) {
+	struct sockaddr_un sun;
+	size_t idx;
+	int fd;
+
+	memset(&sun, 0x00, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+		errx(1, "control socket path %s too long", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		err(1, "socket");
+
+	(void) unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "bind %s", path);
+	if (chmod(path, 0600) < 0)
+		err(1, "chmod %s", path);
+	if (listen(fd, 5) < 0)
+		err(1, "listen");
+
+	for (idx = 0; idx < CONTROL_MAX_CLIENTS; idx++)
+		ctl_clients[idx].fd = -1;
+
+	return fd;
+}
+
+/* Accept connections on the control socket, only root may use it */
+void
+control_accept(int kq, int lfd) {
+	struct kevent ev;
+	uid_t uid;
+	gid_t gid;
+	size_t idx;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		if (getpeereid(fd, &uid, &gid) < 0 || uid != 0) {
+			log_warnx("control: refusing connection uid=%d", (int) uid);
+			close(fd);
+			continue;
+		}
+
+		for (idx = 0; idx < CONTROL_MAX_CLIENTS; idx++) {
+			if (ctl_clients[idx].fd == -1)
+				break;
+		}
+		if (idx == CONTROL_MAX_CLIENTS) {
+			log_warnx("control: too many clients");
+			close(fd);
+			continue;
+		}
+
+		ctl_clients[idx].fd = fd;
+		imsg_init(&ctl_clients[idx].ibuf, fd);
+		EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		log_warn("control: accept");
+}
+
+/* The control client on `fd', if there is one */
+struct ctl_client *
+control_lookup(int fd) {
+	size_t idx;
+
+	for (idx = 0; idx < CONTROL_MAX_CLIENTS; idx++) {
+		if (ctl_clients[idx].fd == fd)
+			return &ctl_clients[idx];
+	}
+	return NULL;
+}
+
+static void
+control_close(struct ctl_client *c) {
+	imsg_clear(&c->ibuf);
+	/* Closing the descriptor also removes it from the kqueue */
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* Write what the client is ready for, the rest waits for the next write event */
+static void
+control_flush(int kq, struct ctl_client *c) {
+	struct kevent ev;
+
+	if (c->ibuf.w.queued == 0)
+		return;
+	if (msgbuf_write(&c->ibuf.w) <= 0 && errno != EAGAIN) {
+		control_close(c);
+		return;
+	}
+	if (c->ibuf.w.queued == 0)
+		return;
+
+	EV_SET(&ev, c->fd, EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+}
+
+/* Hand a request on to another process of ours */
+static void
+control_forward(int fd, enum upstream_msg_type type, void *data, size_t len) {
+	struct imsgbuf ibuf;
+
+	imsg_init(&ibuf, fd);
+	if (imsg_compose(&ibuf, type, 0, 0, -1, data, len) < 0)
+		err(1, "imsg_compose");
+
+	do {
+		if (msgbuf_write(&ibuf.w) > 0)
+			return;
+	} while (errno == EAGAIN);
+
+	err(1, "msgbuf_write");
+}
+
+static void
+control_fail(struct ctl_client *c, const char *reason) {
+	if (imsg_compose(&c->ibuf, CTL_FAIL, 0, 0, -1, reason, strlen(reason) + 1) < 0)
+		err(1, "imsg_compose");
+}
+
+/* Queue a CTL_SOURCE for every source we know and the servers in use */
+static void
+control_show(struct ctl_client *c, struct srv_devlist *devices) {
+	struct ctl_source cs;
+	struct srv_device *dev;
+	struct srv_source *src;
+	struct ibuf *wbuf;
+	time_t now = devices->clock(NULL);
+	rdomain_set rdomains;
+	size_t nslen;
+	int rdomain;
+	char *ns;
+
+	TAILQ_FOREACH(dev, &devices->devices, entry) {
+		TAILQ_FOREACH(src, &dev->sources, entry) {
+			memset(&cs, 0x00, sizeof(cs));
+			(void) strlcpy(cs.device, dev->name, sizeof(cs.device));
+			cs.up = dev->up;
+			cs.rdomain = dev->rdomain;
+			cs.type = src->type;
+			if (src->id != NULL)
+				(void) strlcpy(cs.id, src->id, sizeof(cs.id));
+			if (src->expiry == (time_t) -1)
+				cs.expires = -1;
+			else
+				cs.expires = (src->expiry > now)? src->expiry - now: 0;
+			cs.nslen = src->nslen;
+			cs.domainslen = src->domainslen;
+
+			if ((wbuf = imsg_create(&c->ibuf, CTL_SOURCE, 0, 0,
+			                        sizeof(cs) + src->nslen + src->domainslen)) == NULL ||
+			    imsg_add(wbuf, &cs, sizeof(cs)) < 0 ||
+			    imsg_add(wbuf, src->ns, src->nslen) < 0 ||
+			    imsg_add(wbuf, src->domains, src->domainslen) < 0)
+				err(1, "imsg_add");
+			imsg_close(&c->ibuf, wbuf);
+		}
+	}
+
+	memset(rdomains, 0x00, sizeof(rdomains));
+	serverrepo_rdomains(devices, rdomains);
+	for (rdomain = 0; rdomain <= RDOMAIN_MAX; rdomain++) {
+		if (!RDOMAIN_ISSET(rdomains, rdomain))
+			continue;
+		ns = policy_select(devices, devices->config, rdomain, &nslen);
+		if ((wbuf = imsg_create(&c->ibuf, CTL_SERVERS, 0, 0, sizeof(rdomain) + nslen)) == NULL ||
+		    imsg_add(wbuf, &rdomain, sizeof(rdomain)) < 0 ||
+		    imsg_add(wbuf, ns, nslen) < 0)
+			err(1, "imsg_add");
+		imsg_close(&c->ibuf, wbuf);
+	}
+
+	if (imsg_compose(&c->ibuf, CTL_END, 0, 0, -1, NULL, 0) < 0)
+		err(1, "imsg_compose");
+}
+
+/* Handle the requests of control client `c', or write out its replies */
+void
+control_dispatch(int kq, struct ctl_client *c, int filter, int msg_fd_handlers,
+                 int msg_fd_upstream, struct srv_devlist *devices) {
+	struct source_msg sm;
+	struct imsg imsg;
+	ssize_t n, datalen;
+
+	if (filter == EVFILT_WRITE) {
+		control_flush(kq, c);
+		return;
+	}
+
+	if (((n = imsg_read(&c->ibuf)) == -1 && errno != EAGAIN) || n == 0) {
+		control_close(c);
+		return;
+	}
+
+	while ((n = imsg_get(&c->ibuf, &imsg)) > 0) {
+		datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+
+		switch (imsg.hdr.type) {
+			case CTL_SHOW:
+				control_show(c, devices);
+				break;
+			case CTL_RESCAN:
+				if (datalen != sizeof(sm)) {
+					control_fail(c, "invalid request");
+					break;
+				}
+				memcpy(&sm, imsg.data, sizeof(sm));
+				sm.device[sizeof(sm.device) - 1] = '\0';
+				sm.source[sizeof(sm.source) - 1] = '\0';
+				log_info("control: rescan dev=%s type=%d", sm.device, sm.type);
+				control_forward(msg_fd_handlers, MSG_SOURCE_RESCAN, &sm, sizeof(sm));
+				if (imsg_compose(&c->ibuf, CTL_OK, 0, 0, -1, NULL, 0) < 0)
+					err(1, "imsg_compose");
+				break;
+			case CTL_REAPPLY:
+				if (devices->syncing) {
+					control_fail(c, "sources are still being read");
+					break;
+				}
+				log_info("control: reapply");
+				control_forward(msg_fd_upstream, MSG_UPSTREAM_REAPPLY, NULL, 0);
+				serverrepo_touch_all(devices);
+				serverrepo_update_upstream(msg_fd_upstream, devices);
+				if (imsg_compose(&c->ibuf, CTL_OK, 0, 0, -1, NULL, 0) < 0)
+					err(1, "imsg_compose");
+				break;
+			case CTL_CLEAR:
+				log_info("control: clear");
+				push_ratelimit_clear();
+				control_forward(msg_fd_handlers, MSG_RATELIMIT_CLEAR, NULL, 0);
+				if (imsg_compose(&c->ibuf, CTL_OK, 0, 0, -1, NULL, 0) < 0)
+					err(1, "imsg_compose");
+				break;
+			default:
+				control_fail(c, "unknown request");
+				break;
+		}
+		imsg_free(&imsg);
+	}
+	if (n == -1) {
+		control_close(c);
+		return;
+	}
+
+	control_flush(kq, c);
+}
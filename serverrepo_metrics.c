@@ -0,0 +1,107 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "config.h"
+#include "metrics.h"
+#include "serverrepo.h"
+#include "log.h"
+
+/*
+ * The metrics socket hands out the metrics of all processes in the
+ * Prometheus text format to whoever connects, then closes the connection.
+ * The event loop and the upstream updater send theirs whenever they change,
+ * so answering never involves another process.
+ */
+
+struct histogram repo_hists[] = {
+	[HIST_TO_REPO] = { "dnsfoo_handler_to_repo_seconds",
+	                   "Time from a handler being done until the repository has its update" },
+	[HIST_REPO] = { "dnsfoo_repo_seconds",
+	                "Time the repository takes to pass an update on" },
+};
+struct counter repo_counters[] = {
+	[CNT_UPDATES] = { "dnsfoo_repo_updates_total", "Updates received from sources" },
+	[CNT_UPSTREAM] = { "dnsfoo_repo_upstream_updates_total",
+	                   "Updates passed on to the upstream updater" },
+	[CNT_ALLOCS] = { "dnsfoo_repo_allocations_total",
+	                 "Allocations for sources and their buffers, flat once updates are steady" },
+	[CNT_SOURCES] = { "dnsfoo_repo_sources", "Sources the repository knows", 0, 1 },
+	[CNT_POOLED] = { "dnsfoo_repo_pooled_sources", "Dropped sources kept for reuse", 0, 1 },
+	[CNT_BYTES] = { "dnsfoo_repo_buffer_bytes",
+	                "Bytes held for the servers and domains of known and pooled sources", 0, 1 },
+	[CNT_NAMES] = { "dnsfoo_repo_device_names", "Device names in the name table", 0, 1 },
+};
+
+/* The latest metrics of the event loop and the upstream updater */
+static char *evloop_metrics, *upstream_metrics;
+
+/* Create the metrics socket, needs root if it lives in a protected directory */
+int
+metrics_open(const char *path) {
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0x00, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+		errx(1, "metrics socket path %s too long", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		err(1, "socket");
+
+	(void) unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "bind %s", path);
+	/* There's nothing secret in here */
+	if (chmod(path, 0666) < 0)
+		err(1, "chmod %s", path);
+	if (listen(fd, 5) < 0)
+		err(1, "listen");
+
+	return fd;
+}
+
+/* Remember the metrics another process sent, `upstream' tells which one */
+void
+metrics_store(int upstream, const char *data, size_t len) {
+	char **dst = upstream? &upstream_metrics: &evloop_metrics;
+
+	free(*dst);
+	if ((*dst = strndup(data, len)) == NULL)
+		err(1, "strndup");
+}
+
+/* Answer everyone waiting on the metrics socket */
+void
+metrics_serve(int lfd) {
+	char buf[3 * METRICS_MAXLEN];
+	size_t len;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		len = metrics_render(buf, sizeof(buf), repo_hists,
+		                     sizeof(repo_hists) / sizeof(repo_hists[0]), repo_counters,
+		                     sizeof(repo_counters) / sizeof(repo_counters[0]));
+		if (evloop_metrics != NULL)
+			len = strlcat(buf, evloop_metrics, sizeof(buf));
+		if (upstream_metrics != NULL)
+			len = strlcat(buf, upstream_metrics, sizeof(buf));
+
+		/* A client that can't take it all at once gets what fits */
+		if (write(fd, buf, len < sizeof(buf)? len: sizeof(buf) - 1) < 0)
+			log_warn("metrics: write");
+		close(fd);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		log_warn("metrics: accept");
+}
@@ -0,0 +1,159 @@
+#include <err.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+
+#include "config.h"
+#include "serverrepo.h"
+#include "log.h"
+
+/*
+ * Decides which of the servers we know are passed to the upstream server and
+ * in what order. Servers are sorted by priority, then by address family if
+ * one is preferred. Ties are broken by device name, source type and id and
+ * finally by the order the source listed them in, so the outcome doesn't
+ * depend on the order in which sources happened to report. Addresses that
+ * several sources reported are only used once, in their best position.
+ */
+
+struct candidate {
+	const char *addr;
+	long long priority;
+	/* 0 if this is of the preferred family */
+	int famrank;
+	const char *device;
+	enum srctype type;
+	const char *id;
+	size_t pos;
+};
+
+/* The device statement for `name', NULL if there is none */
+struct device *
+policy_device(struct config *config, const char *name) {
+	struct device *cdev;
+
+	/* Exact names take precedence over patterns */
+	TAILQ_FOREACH(cdev, &config->devices, entry) {
+		if (!strcmp(cdev->device, name))
+			return cdev;
+	}
+	TAILQ_FOREACH(cdev, &config->devices, entry) {
+		if (fnmatch(cdev->device, name, 0) == 0)
+			return cdev;
+	}
+	return NULL;
+}
+
+/* Priority of the servers that a source of `type' on `name' reports */
+static long long
+policy_priority(struct config *config, const char *name, enum srctype type) {
+	struct device *cdev;
+	struct srcspec *spec;
+
+	if ((cdev = policy_device(config, name)) == NULL)
+		return 0;
+
+	TAILQ_FOREACH(spec, &cdev->specs->l, entry) {
+		if (spec->type == type && spec->priority != -1)
+			return spec->priority;
+	}
+	return cdev->priority;
+}
+
+static int
+policy_cmp(const void *a, const void *b) {
+	const struct candidate *ca = a, *cb = b;
+	int r;
+
+	if (ca->priority != cb->priority)
+		return (ca->priority > cb->priority)? -1: 1;
+	if (ca->famrank != cb->famrank)
+		return ca->famrank - cb->famrank;
+	if ((r = strcmp(ca->device, cb->device)) != 0)
+		return r;
+	if (ca->type != cb->type)
+		return (int) ca->type - (int) cb->type;
+	if ((r = strcmp(ca->id? ca->id: "", cb->id? cb->id: "")) != 0)
+		return r;
+	return (ca->pos < cb->pos)? -1: (ca->pos > cb->pos);
+}
+
+/*
+ * Build the '\0' separated list of servers to use in `rdomain' from the
+ * sources of its devices that are up. Returns NULL and sets `nslen' to 0 if
+ * there are none. The list is reused by the next call, don't free it. It and
+ * the candidates only grow, so selecting again allocates nothing.
+ */
+char *
+policy_select(struct srv_devlist *devices, struct config *config, int rdomain, size_t *nslen) {
+	static struct candidate *cands = NULL;
+	static size_t candscap = 0, nscap = 0;
+	static char *ns = NULL;
+	struct candidate *c;
+	struct srv_device *dev;
+	struct srv_source *src;
+	size_t ncands = 0, idx, off, pos, n, used = 0;
+	long long prio;
+
+	TAILQ_FOREACH(dev, &devices->devices, entry) {
+		if (!dev->up || dev->rdomain != rdomain)
+			continue;
+		TAILQ_FOREACH(src, &dev->sources, entry) {
+			prio = policy_priority(config, dev->name, src->type);
+			for (off = 0, pos = 0; off < src->nslen; off += strlen(src->ns + off) + 1, pos++) {
+				if (ncands == candscap) {
+					candscap = candscap? 2 * candscap: 16;
+					if ((cands = reallocarray(cands, candscap, sizeof(*cands))) == NULL)
+						err(1, "reallocarray");
+				}
+				c = &cands[ncands++];
+				c->addr = src->ns + off;
+				c->priority = prio;
+				c->famrank = 0;
+				if (config->prefer != AF_UNSPEC)
+					c->famrank = ((strchr(c->addr, ':') != NULL) !=
+					              (config->prefer == AF_INET6));
+				c->device = dev->name;
+				c->type = src->type;
+				c->id = src->id;
+				c->pos = pos;
+			}
+		}
+	}
+
+	qsort(cands, ncands, sizeof(*cands), policy_cmp);
+
+	*nslen = 0;
+	for (idx = 0; idx < ncands; idx++) {
+		if (config->maxservers != 0 && used == config->maxservers)
+			break;
+		for (off = 0; off < *nslen; off += strlen(ns + off) + 1) {
+			if (!strcmp(ns + off, cands[idx].addr))
+				break;
+		}
+		if (off < *nslen)
+			continue;
+
+		n = strlen(cands[idx].addr) + 1;
+		if (*nslen + n > nscap) {
+			nscap = 2 * (*nslen + n);
+			if ((ns = realloc(ns, nscap)) == NULL)
+				err(1, "realloc");
+		}
+		memcpy(ns + *nslen, cands[idx].addr, n);
+		*nslen += n;
+		used++;
+
+		log_debug("policy rank=%zu ns=%s dev=%s type=%d priority=%lld", used, cands[idx].addr,
+		          cands[idx].device, cands[idx].type, cands[idx].priority);
+	}
+
+	return *nslen > 0? ns: NULL;
+}
@@ -0,0 +1,261 @@
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "config.h"
+#include "push.h"
+#include "upstream_update.h"
+#include "serverrepo.h"
+#include "log.h"
+
+/*
+ * The push socket lets hook scripts and VPN clients hand name servers
+ * straight to the server repository, see push.h for the format. Only root
+ * and the users from `allow' statements may use it, and each user gets
+ * PUSH_RATE updates per second with bursts of up to PUSH_BURST.
+ */
+#define PUSH_MAX_CLIENTS	16
+#define PUSH_RATE		5
+#define PUSH_BURST		20
+
+struct push_client {
+	int fd;
+	uid_t uid;
+};
+
+/* Token bucket for one user */
+struct push_bucket {
+	uid_t uid;
+	unsigned int tokens;
+	time_t last;
+	unsigned long long dropped;
+};
+
+static struct push_client clients[PUSH_MAX_CLIENTS];
+static struct push_bucket *buckets;
+static size_t nbuckets;
+
+/* Create the push socket, needs root if it lives in a protected directory */
+int
+push_open(const char *path) {
+	struct sockaddr_un sun;
+	size_t idx;
+	int fd;
+
+	memset(&sun, 0x00, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >= sizeof(sun.sun_path))
+		errx(1, "push socket path %s too long", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) < 0)
+		err(1, "socket");
+
+	(void) unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "bind %s", path);
+	/* Everyone may connect, peer credentials decide who gets heard */
+	if (chmod(path, 0666) < 0)
+		err(1, "chmod %s", path);
+	if (listen(fd, 5) < 0)
+		err(1, "listen");
+
+	for (idx = 0; idx < PUSH_MAX_CLIENTS; idx++)
+		clients[idx].fd = -1;
+
+	return fd;
+}
+
+static int
+push_allowed(uid_t uid, struct config *config) {
+	size_t idx;
+
+	if (uid == 0)
+		return 1;
+	for (idx = 0; idx < config->npushusers; idx++) {
+		if (config->pushusers[idx] == uid)
+			return 1;
+	}
+	return 0;
+}
+
+/* Take a token from the bucket of `uid', returns 0 if there is none left */
+static int
+push_ratelimit(uid_t uid) {
+	struct push_bucket *b = NULL;
+	time_t now = time(NULL);
+	size_t idx;
+
+	for (idx = 0; idx < nbuckets; idx++) {
+		if (buckets[idx].uid == uid) {
+			b = &buckets[idx];
+			break;
+		}
+	}
+	if (b == NULL) {
+		if ((buckets = reallocarray(buckets, nbuckets + 1, sizeof(*buckets))) == NULL)
+			err(1, "reallocarray");
+		b = &buckets[nbuckets++];
+		b->uid = uid;
+		b->tokens = PUSH_BURST;
+		b->last = now;
+		b->dropped = 0;
+	}
+
+	if (now > b->last) {
+		if ((now - b->last) * PUSH_RATE >= PUSH_BURST - b->tokens)
+			b->tokens = PUSH_BURST;
+		else
+			b->tokens += (now - b->last) * PUSH_RATE;
+		b->last = now;
+	}
+
+	if (b->tokens == 0) {
+		if (b->dropped++ % 100 == 0)
+			log_warnx("push: over rate uid=%u dropped=%llu", uid, b->dropped);
+		return 0;
+	}
+	b->tokens--;
+	return 1;
+}
+
+/* Give every user a full bucket again */
+void
+push_ratelimit_clear(void) {
+	free(buckets);
+	buckets = NULL;
+	nbuckets = 0;
+}
+
+/* Accept a connection on the push socket if the peer is allowed to use it */
+void
+push_accept(int kq, int lfd, struct config *config) {
+	struct kevent ev;
+	uid_t uid;
+	gid_t gid;
+	size_t idx;
+	int fd;
+
+	while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+		if (getpeereid(fd, &uid, &gid) < 0 || !push_allowed(uid, config)) {
+			log_warnx("push: refusing connection uid=%d", (int) uid);
+			close(fd);
+			continue;
+		}
+
+		for (idx = 0; idx < PUSH_MAX_CLIENTS; idx++) {
+			if (clients[idx].fd == -1)
+				break;
+		}
+		if (idx == PUSH_MAX_CLIENTS) {
+			log_warnx("push: too many clients");
+			close(fd);
+			continue;
+		}
+
+		clients[idx].fd = fd;
+		clients[idx].uid = uid;
+		EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, &clients[idx]);
+		if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0)
+			err(1, "kevent");
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		log_warn("push: accept");
+}
+
+/*
+ * Turn one update from the push socket into `msg' and its source id into
+ * `id'. Returns 0 if the update is malformed.
+ */
+int
+push_parse(const u_char *buf, size_t len, struct upstream_update_msg *msg, char **id) {
+	char ntopbuf[INET6_ADDRSTRLEN];
+	struct push_hdr hdr;
+	size_t off, alen;
+	int idx, af;
+
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.version != PUSH_VERSION || hdr.devlen == 0 || hdr.idlen == 0)
+		return 0;
+	off = sizeof(hdr);
+	if (off + hdr.devlen + hdr.idlen > len)
+		return 0;
+
+	memset(msg, 0x00, sizeof(*msg));
+	msg->type = SRC_PUSH;
+	msg->lifetime = ntohl(hdr.lifetime);
+	if ((msg->device = strndup((const char *) buf + off, hdr.devlen)) == NULL ||
+	    (*id = strndup((const char *) buf + off + hdr.devlen, hdr.idlen)) == NULL)
+		err(1, "strndup");
+	off += hdr.devlen + hdr.idlen;
+
+	for (idx = 0; idx < hdr.naddrs; idx++) {
+		if (off >= len)
+			goto fail;
+		af = buf[off++];
+		alen = (af == AF_INET)? 4: (af == AF_INET6)? 16: 0;
+		if (alen == 0 || off + alen > len)
+			goto fail;
+		if (inet_ntop(af, buf + off, ntopbuf, sizeof(ntopbuf)) == NULL)
+			goto fail;
+		if (!upstream_update_msg_append_ns(msg, ntopbuf))
+			err(1, "upstream_update_msg_append_ns");
+		off += alen;
+	}
+
+	if (off != len)
+		goto fail;
+	return 1;
+
+fail:
+	upstream_update_msg_cleanup(msg);
+	free(*id);
+	*id = NULL;
+	return 0;
+}
+
+/* Read the updates of a push client. Returns 1 if anything changed */
+int
+push_read(struct push_client *c, int msgfd, struct srv_devlist *devices) {
+	u_char buf[PUSH_MAXLEN];
+	struct upstream_update_msg msg;
+	ssize_t len;
+	char *id;
+	int changed = 0;
+
+	while ((len = recv(c->fd, buf, sizeof(buf), 0)) > 0) {
+		if (!push_ratelimit(c->uid))
+			continue;
+		if (!push_parse(buf, len, &msg, &id)) {
+			log_warnx("push: malformed update uid=%u", c->uid);
+			continue;
+		}
+		log_debug("push: update dev=%s id=%s uid=%u nslen=%zu", msg.device, id, c->uid, msg.nslen);
+		serverrepo_handle_msg(&msg, id, msgfd, devices);
+		upstream_update_msg_cleanup(&msg);
+		free(id);
+		changed = 1;
+	}
+
+	if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+		/* Closing the descriptor also removes it from the kqueue */
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	return changed;
+}
@@ -0,0 +1,245 @@
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "serverrepo.h"
+#include "log.h"
+
+/*
+ * Snapshot file layout, all integers in host byte order:
+ *
+ * | magic | version | ndevices | device ... |
+ *
+ * device: | namelen | name | nsources | source ... |
+ * source: | type | idlen | id | expiry | server | nslen | nameservers | domainslen | domains |
+ *
+ * Expiries are absolute, -1 means infinity. Version 1 snapshots have no
+ * id, idlen 0 means the source has none. Versions before 3 have no server.
+ */
+#define SNAPSHOT_MAGIC		"DNSFOOSR"
+#define SNAPSHOT_VERSION	3
+/* Upper bound for any single length field, to catch corrupted files early */
+#define SNAPSHOT_MAXLEN		(64 * 1024)
+/* Changes are written out together, this many seconds after the first one */
+#define SNAPSHOT_DELAY		5
+
+static int
+snapshot_write(FILE *f, const void *p, size_t len) {
+	return fwrite(p, 1, len, f) == len;
+}
+
+static int
+snapshot_write_u32(FILE *f, uint32_t v) {
+	return snapshot_write(f, &v, sizeof(v));
+}
+
+static int
+snapshot_write_u64(FILE *f, uint64_t v) {
+	return snapshot_write(f, &v, sizeof(v));
+}
+
+static int
+snapshot_read_u32(FILE *f, uint32_t *v) {
+	return fread(v, 1, sizeof(*v), f) == sizeof(*v);
+}
+
+static int
+snapshot_read_u64(FILE *f, uint64_t *v) {
+	return fread(v, 1, sizeof(*v), f) == sizeof(*v);
+}
+
+/* Read a length-prefixed blob into a newly allocated buffer */
+static int
+snapshot_read_blob(FILE *f, char **p, size_t *len, int terminate) {
+	uint64_t l;
+
+	*p = NULL;
+	if (!snapshot_read_u64(f, &l) || l > SNAPSHOT_MAXLEN)
+		return 0;
+	*len = l;
+	if (l == 0 && !terminate)
+		return 1;
+	if ((*p = calloc(1, l + (terminate? 1: 0))) == NULL)
+		err(1, "calloc");
+	if (fread(*p, 1, l, f) != l)
+		return 0;
+	/* '\0'-separated lists have to end with a '\0' */
+	if (!terminate && (*p)[l - 1] != '\0')
+		return 0;
+	return 1;
+}
+
+/*
+ * Write the repository to `path', crash-safe: the snapshot goes to a
+ * temporary file first, which replaces the old snapshot once it's on disk.
+ */
+int
+serverrepo_save(struct srv_devlist *devices, const char *path) {
+	char tmp[PATH_MAX];
+	struct srv_device *dev;
+	struct srv_source *src;
+	uint32_t ndevices = 0, nsources;
+	FILE *f;
+	int ok;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		log_warnx("snapshot path too long");
+		return 0;
+	}
+
+	if ((f = fopen(tmp, "w")) == NULL) {
+		log_warn("fopen %s", tmp);
+		return 0;
+	}
+
+	TAILQ_FOREACH(dev, &devices->devices, entry)
+		ndevices++;
+
+	ok = snapshot_write(f, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC)) &&
+	     snapshot_write_u32(f, SNAPSHOT_VERSION) &&
+	     snapshot_write_u32(f, ndevices);
+
+	TAILQ_FOREACH(dev, &devices->devices, entry) {
+		nsources = 0;
+		TAILQ_FOREACH(src, &dev->sources, entry)
+			nsources++;
+
+		ok = ok && snapshot_write_u64(f, strlen(dev->name)) &&
+		     snapshot_write(f, dev->name, strlen(dev->name)) &&
+		     snapshot_write_u32(f, nsources);
+
+		TAILQ_FOREACH(src, &dev->sources, entry) {
+			ok = ok && snapshot_write_u32(f, src->type) &&
+			     snapshot_write_u64(f, src->id? strlen(src->id): 0) &&
+			     snapshot_write(f, src->id? src->id: "", src->id? strlen(src->id): 0) &&
+			     snapshot_write_u64(f, (int64_t) src->expiry) &&
+			     snapshot_write_u32(f, src->server) &&
+			     snapshot_write_u64(f, src->nslen) &&
+			     snapshot_write(f, src->ns, src->nslen) &&
+			     snapshot_write_u64(f, src->domainslen) &&
+			     snapshot_write(f, src->domains, src->domainslen);
+		}
+	}
+
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (fclose(f) != 0)
+		ok = 0;
+
+	if (!ok || rename(tmp, path) < 0) {
+		log_warn("writing snapshot %s", path);
+		unlink(tmp);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Note that the repository changed, the snapshot is written a bit later */
+void
+serverrepo_changed(struct srv_devlist *devices) {
+	if (devices->config->statefile == NULL || devices->save_at != (time_t) -1)
+		return;
+	devices->save_at = devices->clock(NULL) + SNAPSHOT_DELAY;
+}
+
+/* Write the snapshot if there are changes that waited long enough */
+void
+serverrepo_save_due(struct srv_devlist *devices) {
+	if (devices->save_at == (time_t) -1 || devices->save_at > devices->clock(NULL))
+		return;
+	devices->save_at = (time_t) -1;
+	(void) serverrepo_save(devices, devices->config->statefile);
+}
+
+/*
+ * Restore the repository from the snapshot at `path', dropping everything
+ * that expired while we weren't running. A missing snapshot is not an error.
+ */
+int
+serverrepo_load(struct srv_devlist *devices, const char *path) {
+	char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+	struct srv_device *dev;
+	struct srv_source *src;
+	uint32_t version, ndevices, nsources, type;
+	uint64_t expiry;
+	time_t now = devices->clock(NULL);
+	size_t namelen, idlen, nslen, domainslen, nloaded = 0, nexpired = 0;
+	char *name, *ns, *domains;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		if (errno == ENOENT)
+			return 1;
+		log_warn("fopen %s", path);
+		return 0;
+	}
+
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0 ||
+	    !snapshot_read_u32(f, &version) || version < 1 || version > SNAPSHOT_VERSION ||
+	    !snapshot_read_u32(f, &ndevices)) {
+		log_warnx("%s is not a snapshot we understand", path);
+		goto fail;
+	}
+
+	while (ndevices-- > 0) {
+		if (!snapshot_read_blob(f, &name, &namelen, 1) ||
+		    !snapshot_read_u32(f, &nsources)) {
+			free(name);
+			goto corrupt;
+		}
+		dev = serverrepo_get_device(devices, name);
+		free(name);
+
+		while (nsources-- > 0) {
+			src = serverrepo_alloc_source();
+			ns = domains = NULL;
+			if (!snapshot_read_u32(f, &type) || type >= SRC_UNKNOWN ||
+			    (version >= 2 && !snapshot_read_blob(f, &src->id, &idlen, 1)) ||
+			    !snapshot_read_u64(f, &expiry) ||
+			    (version >= 3 && !snapshot_read_u32(f, &src->server)) ||
+			    !snapshot_read_blob(f, &ns, &nslen, 0) ||
+			    !snapshot_read_blob(f, &domains, &domainslen, 0)) {
+				free(ns);
+				free(domains);
+				serverrepo_free_source(src);
+				goto corrupt;
+			}
+			serverrepo_set_source(src, ns, nslen, domains, domainslen);
+			free(ns);
+			free(domains);
+			src->type = type;
+			if (src->id != NULL && idlen == 0) {
+				free(src->id);
+				src->id = NULL;
+			}
+			src->expiry = (time_t) (int64_t) expiry;
+
+			if (src->expiry != (time_t) -1 && src->expiry <= now) {
+				serverrepo_free_source(src);
+				nexpired++;
+				continue;
+			}
+			TAILQ_INSERT_TAIL(&dev->sources, src, entry);
+			nloaded++;
+		}
+	}
+
+	fclose(f);
+	serverrepo_recompute_expiry(devices);
+	log_info("snapshot restored path=%s sources=%zu expired=%zu", path, nloaded, nexpired);
+	return 1;
+
+corrupt:
+	log_warnx("snapshot %s is corrupt, using what we got so far", path);
+	serverrepo_recompute_expiry(devices);
+fail:
+	fclose(f);
+	return 0;
+}
@@ -0,0 +1,491 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <imsg.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "dnsfoo.h"
+#include "config.h"
+#include "upstream_update.h"
+#include "serverrepo.h"
+#include "metrics.h"
+#include "log.h"
+
+/*
+ * Drives the server repository on a virtual clock. A few fixed scenarios run
+ * first, then a seeded random script of updates, withdrawals and clock steps.
+ * After every step the repository is checked against a model of what it
+ * should hold: which sources are left, when they expire, when the next
+ * timeout is due, and how many updates went upstream. The same seed always
+ * makes for the same script, a failing seed can be run again on its own.
+ *
+ * Clock steps go to the next expiry the repository asked for, the way its
+ * kevent(2) timeout would, or somewhere before it.
+ */
+
+/* Source types the script uses, slaacd sources never expire */
+static const enum srctype sim_types[] = { SRC_DHCPV4, SRC_RTADV, SRC_SLAACD };
+#define SIM_NTYPES	(sizeof(sim_types) / sizeof(sim_types[0]))
+/* The model's expiry of a source that isn't there */
+#define SIM_NONE	((time_t) 0)
+
+struct sim {
+	struct srv_devlist devices;
+	struct config config;
+	struct imsgbuf ibuf;
+	int fds[2];
+	/* Expiry of each device's source of each type, SIM_NONE if it has none */
+	time_t *model;
+	size_t ndevices;
+	uint64_t rng;
+	/* What happened so far */
+	unsigned long long steps, updates, withdrawals, timeouts, expired, upstream;
+	uint64_t ns_msg, ns_timeout;
+};
+
+/* Defined by dnsfoo.c, which isn't part of the simulation */
+int handlers_inline;
+
+int
+privdrop(struct config *config) {
+	/* The simulation runs as whoever started it */
+	return 1;
+}
+
+static time_t sim_now = 1000000000;
+
+static time_t
+sim_clock(time_t *t) {
+	if (t != NULL)
+		*t = sim_now;
+	return sim_now;
+}
+
+/* xorshift64*, so scripts don't depend on the random(3) of the system */
+static uint64_t
+sim_random(struct sim *s) {
+	s->rng ^= s->rng >> 12;
+	s->rng ^= s->rng << 25;
+	s->rng ^= s->rng >> 27;
+	return s->rng * 2685821657736338717ULL;
+}
+
+static uint32_t
+sim_uniform(struct sim *s, uint32_t n) {
+	return sim_random(s) % n;
+}
+
+static void
+sim_init(struct sim *s, size_t ndevices, uint64_t seed) {
+	memset(s, 0x00, sizeof(*s));
+	TAILQ_INIT(&s->config.devices);
+	TAILQ_INIT(&s->devices.devices);
+	TAILQ_INIT(&s->devices.reloaded);
+	s->devices.expiry = (time_t) -1;
+	s->devices.save_at = (time_t) -1;
+	s->devices.clock = sim_clock;
+	s->devices.config = &s->config;
+	s->ndevices = ndevices;
+	s->rng = seed? seed: 1;
+	if ((s->model = calloc(ndevices * SIM_NTYPES, sizeof(*s->model))) == NULL)
+		err(1, "calloc");
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, s->fds) < 0)
+		err(1, "socketpair");
+	if (fcntl(s->fds[1], F_SETFL, O_NONBLOCK) < 0)
+		err(1, "fcntl");
+	imsg_init(&s->ibuf, s->fds[1]);
+}
+
+static void
+sim_free(struct sim *s) {
+	serverrepo_free_devices(&s->devices);
+	imsg_clear(&s->ibuf);
+	close(s->fds[0]);
+	close(s->fds[1]);
+	free(s->model);
+}
+
+/* Read what went upstream, returns the number of server updates */
+static unsigned int
+sim_upstream(struct sim *s) {
+	struct imsg imsg;
+	unsigned int nupdates = 0;
+	ssize_t n;
+
+	while ((n = imsg_read(&s->ibuf)) > 0) {
+		while ((n = imsg_get(&s->ibuf, &imsg)) > 0) {
+			if (imsg.hdr.type == MSG_UPSTREAM_UPDATE)
+				nupdates++;
+			imsg_free(&imsg);
+		}
+		if (n == -1)
+			err(1, "imsg_get");
+	}
+	if (n == 0 || errno != EAGAIN)
+		err(1, "imsg_read");
+
+	s->upstream += nupdates;
+	return nupdates;
+}
+
+static void
+sim_fail(struct sim *s, const char *fmt, ...) __attribute__((__format__ (printf, 2, 3)));
+
+static void
+sim_fail(struct sim *s, const char *fmt, ...) {
+	va_list ap;
+
+	fprintf(stderr, "step %llu at %lld: ", s->steps, (long long) sim_now);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static size_t
+sim_type_index(struct sim *s, enum srctype type) {
+	size_t t;
+
+	for (t = 0; t < SIM_NTYPES; t++) {
+		if (sim_types[t] == type)
+			return t;
+	}
+	sim_fail(s, "unexpected source type %d", type);
+	return 0;
+}
+
+/* The earliest expiry in the model, -1 if nothing expires */
+static time_t
+sim_model_expiry(struct sim *s) {
+	time_t expiry = (time_t) -1, e;
+	size_t idx;
+
+	for (idx = 0; idx < s->ndevices * SIM_NTYPES; idx++) {
+		e = s->model[idx];
+		if (e == SIM_NONE || e == (time_t) -1)
+			continue;
+		if (expiry == (time_t) -1 || e < expiry)
+			expiry = e;
+	}
+	return expiry;
+}
+
+/* Compare every source of the repository with the model */
+static void
+sim_check(struct sim *s) {
+	struct srv_device *dev;
+	struct srv_source *src;
+	size_t nsources = 0, idx;
+	const char *errstr;
+	long long d;
+
+	TAILQ_FOREACH(dev, &s->devices.devices, entry) {
+		d = strtonum(dev->name + strlen("em"), 0, s->ndevices - 1, &errstr);
+		if (errstr != NULL)
+			sim_fail(s, "unexpected device %s", dev->name);
+		TAILQ_FOREACH(src, &dev->sources, entry) {
+			idx = d * SIM_NTYPES + sim_type_index(s, src->type);
+			if (s->model[idx] == SIM_NONE)
+				sim_fail(s, "%s has a source of type %d it shouldn't", dev->name, src->type);
+			if (src->expiry != s->model[idx])
+				sim_fail(s, "%s type %d expires at %lld, not %lld", dev->name, src->type,
+				         (long long) src->expiry, (long long) s->model[idx]);
+			nsources++;
+		}
+	}
+	for (idx = 0; idx < s->ndevices * SIM_NTYPES; idx++) {
+		if (s->model[idx] != SIM_NONE)
+			nsources--;
+	}
+	if (nsources != 0)
+		sim_fail(s, "repository is missing sources");
+}
+
+/* The repository may wake up early, but never after something expired */
+static void
+sim_check_expiry(struct sim *s, int exact) {
+	time_t want = sim_model_expiry(s), have = s->devices.expiry;
+
+	if (exact && have != want)
+		sim_fail(s, "next expiry is %lld, not %lld", (long long) have, (long long) want);
+	if (want != (time_t) -1 && (have == (time_t) -1 || have > want))
+		sim_fail(s, "next expiry %lld is after %lld", (long long) have, (long long) want);
+}
+
+/* Device `d' reports servers from a source of type `type' that live `lifetime' seconds */
+static void
+sim_update(struct sim *s, size_t d, enum srctype type, uint32_t lifetime) {
+	struct upstream_update_msg msg;
+	char ns[INET6_ADDRSTRLEN];
+	uint64_t t_start;
+
+	memset(&msg, 0x00, sizeof(msg));
+	msg.type = type;
+	msg.lifetime = lifetime;
+	if (asprintf(&msg.device, "em%zu", d) < 0)
+		err(1, "asprintf");
+	snprintf(ns, sizeof(ns), "2001:db8::%x", sim_uniform(s, 0x10000));
+	if (!upstream_update_msg_append_ns(&msg, ns))
+		err(1, "upstream_update_msg_append_ns");
+
+	t_start = metrics_now();
+	serverrepo_handle_msg(&msg, NULL, s->fds[0], &s->devices);
+	s->ns_msg += metrics_now() - t_start;
+	upstream_update_msg_cleanup(&msg);
+
+	s->model[d * SIM_NTYPES + sim_type_index(s, type)] =
+	    lifetime == ~0U? (time_t) -1: sim_now + lifetime;
+	s->updates++;
+	if (sim_upstream(s) != 1)
+		sim_fail(s, "update of em%zu wasn't passed on once", d);
+	sim_check_expiry(s, 0);
+}
+
+/* Device `d' withdraws the servers of its source of type `type' */
+static void
+sim_withdraw(struct sim *s, size_t d, enum srctype type) {
+	struct upstream_update_msg msg;
+	uint64_t t_start;
+
+	memset(&msg, 0x00, sizeof(msg));
+	msg.type = type;
+	if (asprintf(&msg.device, "em%zu", d) < 0)
+		err(1, "asprintf");
+
+	t_start = metrics_now();
+	serverrepo_handle_msg(&msg, NULL, s->fds[0], &s->devices);
+	s->ns_msg += metrics_now() - t_start;
+	upstream_update_msg_cleanup(&msg);
+
+	s->model[d * SIM_NTYPES + sim_type_index(s, type)] = SIM_NONE;
+	s->withdrawals++;
+	(void) sim_upstream(s);
+	sim_check_expiry(s, 1);
+}
+
+/* Move the clock `secs' ahead and handle the timeout if the repository asked for one by then */
+static void
+sim_advance(struct sim *s, time_t secs) {
+	unsigned long long expired = 0;
+	uint64_t t_start;
+	unsigned int nupdates;
+	size_t idx;
+
+	sim_now += secs;
+	if (s->devices.expiry == (time_t) -1 || s->devices.expiry > sim_now)
+		return;
+
+	for (idx = 0; idx < s->ndevices * SIM_NTYPES; idx++) {
+		if (s->model[idx] != SIM_NONE && s->model[idx] != (time_t) -1 &&
+		    s->model[idx] <= sim_now) {
+			s->model[idx] = SIM_NONE;
+			expired++;
+		}
+	}
+
+	t_start = metrics_now();
+	serverrepo_handle_timeout(s->fds[0], &s->devices);
+	s->ns_timeout += metrics_now() - t_start;
+	s->timeouts++;
+	s->expired += expired;
+
+	nupdates = sim_upstream(s);
+	if (expired > 0 && nupdates != 1)
+		sim_fail(s, "%llu sources expired, %u updates were passed on", expired, nupdates);
+	if (expired == 0 && nupdates != 0)
+		sim_fail(s, "nothing expired, but %u updates were passed on", nupdates);
+	sim_check_expiry(s, 1);
+}
+
+/* Step to the next expiry the repository asked for */
+static void
+sim_advance_to_expiry(struct sim *s) {
+	if (s->devices.expiry == (time_t) -1)
+		sim_fail(s, "no expiry to advance to");
+	sim_advance(s, s->devices.expiry > sim_now? s->devices.expiry - sim_now: 0);
+}
+
+static void
+sim_expect_sources(struct sim *s, size_t want) {
+	struct srv_device *dev;
+	struct srv_source *src;
+	size_t have = 0;
+
+	TAILQ_FOREACH(dev, &s->devices.devices, entry) {
+		TAILQ_FOREACH(src, &dev->sources, entry)
+			have++;
+	}
+	if (have != want)
+		sim_fail(s, "%zu sources, expected %zu", have, want);
+}
+
+/* Lifetimes of an hour and more, without waiting for them */
+static void
+sim_scenario_lifetimes(void) {
+	struct sim s;
+	time_t start = sim_now;
+
+	sim_init(&s, 2, 1);
+	sim_update(&s, 0, SRC_RTADV, 3600);
+	sim_update(&s, 0, SRC_DHCPV4, 86400);
+	sim_update(&s, 1, SRC_SLAACD, ~0U);
+	sim_check_expiry(&s, 1);
+
+	sim_advance(&s, 3599);
+	sim_expect_sources(&s, 3);
+	sim_advance(&s, 1);
+	sim_expect_sources(&s, 2);
+	sim_check(&s);
+
+	/* A refresh moves the expiry out, the old one makes for a spurious wakeup at most */
+	sim_update(&s, 0, SRC_DHCPV4, 86400);
+	sim_advance_to_expiry(&s);
+	sim_expect_sources(&s, 2);
+	sim_advance_to_expiry(&s);
+	sim_expect_sources(&s, 1);
+
+	/* Sources that never expire stay */
+	sim_advance(&s, 10 * 365 * 86400);
+	sim_expect_sources(&s, 1);
+	if (s.devices.expiry != (time_t) -1)
+		sim_fail(&s, "wakeup for a source that never expires");
+	sim_check(&s);
+
+	sim_free(&s);
+	printf("scenario lifetimes: ok, %lld virtual seconds\n", (long long) (sim_now - start));
+}
+
+/* Staggered leases of many devices expire one after another, in order */
+static void
+sim_scenario_staggered(size_t ndevices) {
+	struct sim s;
+	size_t d;
+
+	sim_init(&s, ndevices, 1);
+	for (d = 0; d < ndevices; d++)
+		sim_update(&s, d, SRC_DHCPV4, 60 + d);
+	for (d = 0; d < ndevices; d++) {
+		sim_advance_to_expiry(&s);
+		sim_expect_sources(&s, ndevices - d - 1);
+	}
+	if (s.timeouts != ndevices)
+		sim_fail(&s, "%llu timeouts for %zu leases", s.timeouts, ndevices);
+	sim_free(&s);
+	printf("scenario staggered: ok, %zu leases\n", ndevices);
+}
+
+/* A random script of `nsteps' steps from `seed' */
+static void
+sim_random_script(size_t ndevices, unsigned long long nsteps, uint64_t seed) {
+	struct sim s;
+	uint64_t t_start = metrics_now(), t_total;
+	enum srctype type;
+	uint32_t lifetime;
+	size_t d;
+
+	sim_init(&s, ndevices, seed);
+	for (s.steps = 0; s.steps < nsteps; s.steps++) {
+		d = sim_uniform(&s, ndevices);
+		type = sim_types[sim_uniform(&s, SIM_NTYPES)];
+
+		switch (sim_uniform(&s, 10)) {
+			case 0:
+				sim_withdraw(&s, d, type);
+				break;
+			case 1:
+			case 2:
+				if (s.devices.expiry != (time_t) -1 && sim_uniform(&s, 4) != 0)
+					sim_advance_to_expiry(&s);
+				else
+					sim_advance(&s, sim_uniform(&s, 600));
+				break;
+			default:
+				if (type == SRC_SLAACD)
+					lifetime = ~0U;
+				else if (type == SRC_RTADV)
+					lifetime = 1 + sim_uniform(&s, 3600);
+				else
+					lifetime = 60 + sim_uniform(&s, 86400);
+				sim_update(&s, d, type, lifetime);
+				break;
+		}
+
+		if (s.steps % 1024 == 0)
+			sim_check(&s);
+	}
+	sim_check(&s);
+	t_total = metrics_now() - t_start;
+
+	printf("random seed=%llu devices=%zu steps=%llu: ok\n", (unsigned long long) seed,
+	       ndevices, nsteps);
+	printf("  updates=%llu withdrawals=%llu timeouts=%llu expired=%llu upstream=%llu\n",
+	       s.updates, s.withdrawals, s.timeouts, s.expired, s.upstream);
+	printf("  handle_msg %.1f ns/op, handle_timeout %.1f ns/op, %.2f s in all\n",
+	       s.updates + s.withdrawals? (double) s.ns_msg / (s.updates + s.withdrawals): 0,
+	       s.timeouts? (double) s.ns_timeout / s.timeouts: 0, t_total / 1e9);
+	sim_free(&s);
+}
+
+__dead void
+usage(void) {
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-d devices] [-n steps] [-s seed]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[]) {
+	unsigned long long nsteps = 1000000, seed = 1;
+	size_t ndevices = 16;
+	const char *errstr;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "d:n:s:")) != -1) {
+		switch (ch) {
+			case 'd':
+				ndevices = strtonum(optarg, 1, 100000, &errstr);
+				if (errstr != NULL)
+					errx(1, "number of devices is %s: %s", errstr, optarg);
+				break;
+			case 'n':
+				nsteps = strtonum(optarg, 0, LLONG_MAX, &errstr);
+				if (errstr != NULL)
+					errx(1, "number of steps is %s: %s", errstr, optarg);
+				break;
+			case 's':
+				seed = strtonum(optarg, 0, LLONG_MAX, &errstr);
+				if (errstr != NULL)
+					errx(1, "seed is %s: %s", errstr, optarg);
+				break;
+			default:
+				usage();
+		}
+	}
+	if (argc != optind)
+		usage();
+
+	/* Expiries are logged at info, they'd drown everything else */
+	log_init(STDERR_FILENO, LOG_LVL_WARN);
+
+	sim_scenario_lifetimes();
+	sim_scenario_staggered(ndevices);
+	sim_random_script(ndevices, nsteps, seed);
+	log_flush();
+
+	return 0;
+}
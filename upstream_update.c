@@ -1,3 +1,4 @@
+#include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -14,12 +15,38 @@
 #include <sys/wait.h>
 #include <imsg.h>
 #include <kvm.h>
+#include <arpa/nameser.h>
 
 #include "dnsfoo.h"
 #include "config.h"
 #include "upstream_update.h"
+#include "metrics.h"
+#include "log.h"
 
 #define MAX_NAME_SERVERS 5
+/* While switching, the new servers are forwarded to next to the old ones */
+#define MAX_STAGED_SERVERS (2 * MAX_NAME_SERVERS)
+
+/* What the upstream updater reports on the metrics socket */
+enum { HIST_TO_UPSTREAM, HIST_APPLY, HIST_CONVERGENCE, HIST_BACKEND };
+struct histogram upstream_hists[] = {
+	[HIST_TO_UPSTREAM] = { "dnsfoo_repo_to_upstream_seconds",
+	                       "Time from the repository passing an update on until it's handled" },
+	[HIST_APPLY] = { "dnsfoo_apply_seconds",
+	                 "Time it takes to hand new servers to the DNS server" },
+	[HIST_CONVERGENCE] = { "dnsfoo_convergence_seconds",
+	                       "Time from an event until the DNS server uses its servers" },
+	[HIST_BACKEND] = { "dnsfoo_backend_seconds",
+	                   "Time a single run of unbound-control takes" },
+};
+enum { CNT_APPLIED, CNT_BACKEND };
+struct counter upstream_counters[] = {
+	[CNT_APPLIED] = { "dnsfoo_upstream_applied_total", "Updates handed to the DNS server" },
+	[CNT_BACKEND] = { "dnsfoo_backend_runs_total", "Runs of unbound-control" },
+};
+
+/* Program run in place of unbound-control, see the backend statement */
+static const char *backend = "unbound-control";
 
 void
 upstream_update_dispatch_rebound(struct upstream_update_msg *msg) {
@@ -39,7 +66,7 @@ upstream_update_dispatch_rebound(struct upstream_update_msg *msg) {
 	}
 
 	/* Rebound has only one upstream, so we only use the first one from the message */
-	fprintf(stderr, "%llu: writing \"%s\" to rebound conf as new name server\n", time(NULL), msg->ns);
+	log_debug("rebound: ns=%s", msg->ns);
 	dprintf(fd, "%s\n", msg->ns);
 	close(fd);
 
@@ -60,79 +87,519 @@ upstream_update_dispatch_rebound(struct upstream_update_msg *msg) {
 	kvm_close(kvm);
 
 	if (rebound_pid == 0) {
-		fprintf(stderr, "%llu: couldn't determine rebound parent PID\n", time(NULL));
+		log_warnx("rebound: can't determine parent pid");
 		return;
 	}
 
-	if (kill(rebound_pid, SIGHUP) == -1) {
-		fprintf(stderr, "%llu: signalling rebound (%d): %s\n", time(NULL), rebound_pid, strerror(errno));
+	if (kill(rebound_pid, SIGHUP) == -1)
+		log_warn("rebound: signal pid=%d", rebound_pid);
+}
+
+/* Name server lists, in the '\0'-separated format of upstream_update_msg */
+struct ns_list {
+	char *ns;
+	size_t nslen;
+};
+
+/* Forward zone for a search domain */
+struct upstream_zone {
+	TAILQ_ENTRY(upstream_zone) entry;
+	char *name;
+	struct ns_list ns;
+};
+
+TAILQ_HEAD(upstream_zones, upstream_zone);
+
+/* State of the staged switch of the forwarders of one routing domain's unbound */
+struct upstream_rdomain {
+	TAILQ_ENTRY(upstream_rdomain) entry;
+	int rdomain;
+	/* unbound configuration passed to unbound-control -c, NULL for the default */
+	const char *unbound;
+	/* Forward zones for search domains unbound is currently using */
+	struct upstream_zones zones;
+	/* Forward zones received for the next update */
+	struct upstream_zones pending_zones;
+	/* Forwarders unbound is currently using */
+	struct ns_list active;
+	/* Forwarders of the last completed switch, kept until new ones are verified */
+	struct ns_list committed;
+	/* Servers of the last update acted upon, the same list again changes nothing */
+	struct ns_list requested;
+	/* Whether `requested' is set, a reapply clears it */
+	int applied;
+	/* Verified forwarders we switch to exclusively once the grace period ends */
+	struct ns_list pending;
+	/* Whether the grace period timer is running */
+	int staged;
+	/* Probes of the servers in `requested' we're waiting for, NULL if none */
+	struct upstream_probe *probe;
+};
+
+/* Ident of the probe timeout timer of `rdomain', the grace period timer uses the rdomain itself */
+#define PROBE_TIMER(rdomain) (RDOMAIN_MAX + 1 + (rdomain))
+
+struct upstream_state {
+	int kq;
+	/* Every routing domain we had an update for */
+	TAILQ_HEAD(, upstream_rdomain) rdomains;
+	/* The first event and the last update handled, for the playback report */
+	uint64_t t_first, t_last;
+	/* Set once a recording has been played back, we report and exit when idle */
+	int replay_done;
+};
+
+int
+ns_list_contains(struct ns_list *l, const char *ns) {
+	char *p;
+
+	for (p = l->ns; p != NULL && p < l->ns + l->nslen; p += strlen(p) + 1) {
+		if (!strcmp(p, ns))
+			return 1;
 	}
+	return 0;
 }
 
 void
-upstream_update_dispatch_unbound(struct upstream_update_msg *msg) {
-	char *params[MAX_NAME_SERVERS + 4]; /* unbound-control, forward_{add, remove}, '.', final NULL */
-	char *p, **srv;
-	int numns = 0;
-	pid_t child;
+ns_list_append(struct ns_list *l, const char *ns) {
+	if ((l->ns = realloc(l->ns, l->nslen + strlen(ns) + 1)) == NULL)
+		err(1, "realloc");
+	memcpy(l->ns + l->nslen, ns, strlen(ns) + 1);
+	l->nslen += strlen(ns) + 1;
+}
 
-	memset(params, 0, sizeof (params));
-	params[0] = "unbound-control";
-	params[1] = "forward_remove";
-	params[2] = ".";
+int
+ns_list_equal(struct ns_list *l, const char *ns, size_t nslen) {
+	return l->nslen == nslen && (nslen == 0 || !memcmp(l->ns, ns, nslen));
+}
 
-	if (msg->nslen > 0) {
-		size_t nslen = msg->nslen;
-		params[1] = "forward_add";
-		srv = &params[3];
-		p = msg->ns;
-		while ((numns < MAX_NAME_SERVERS) && (nslen > 0)) {
-			if ((asprintf(&srv[numns++], "%s", p)) == -1)
-				err(1, "asprintf");
-			nslen -= strlen(p) + 1;
-			p += strlen(p) + 1;
-		}
+/* Length of the first `max' servers of the list `ns' */
+size_t
+ns_list_prefix(const char *ns, size_t nslen, size_t max) {
+	size_t off, n;
 
-		if (nslen > 0) {
-			warnx("Ignoring further name servers");
-		}
+	for (off = 0, n = 0; off < nslen && n < max; off += strlen(ns + off) + 1, n++)
+		;
+	return off;
+}
+
+void
+ns_list_set(struct ns_list *l, const char *ns, size_t nslen) {
+	free(l->ns);
+	l->ns = NULL;
+	l->nslen = 0;
+	if (nslen == 0)
+		return;
+	if ((l->ns = malloc(nslen)) == NULL)
+		err(1, "malloc");
+	memcpy(l->ns, ns, nslen);
+	l->nslen = nslen;
+}
+
+/* The state of `rdomain', set up on first use */
+struct upstream_rdomain *
+upstream_rdomain_get(struct upstream_state *state, struct config *config, int rdomain) {
+	struct upstream_rdomain *rd;
+	size_t idx;
+
+	TAILQ_FOREACH(rd, &state->rdomains, entry) {
+		if (rd->rdomain == rdomain)
+			return rd;
+	}
+
+	if ((rd = calloc(1, sizeof(*rd))) == NULL)
+		err(1, "calloc");
+	rd->rdomain = rdomain;
+	TAILQ_INIT(&rd->zones);
+	TAILQ_INIT(&rd->pending_zones);
+	for (idx = 0; idx < config->nrdomains; idx++) {
+		if (config->rdomains[idx].rdomain == rdomain)
+			rd->unbound = config->rdomains[idx].unbound;
+	}
+	TAILQ_INSERT_TAIL(&state->rdomains, rd, entry);
+
+	return rd;
+}
+
+/* Whether any routing domain is probing servers or in the grace period of a switch */
+int
+upstream_staged(struct upstream_state *state) {
+	struct upstream_rdomain *rd;
+
+	TAILQ_FOREACH(rd, &state->rdomains, entry) {
+		if (rd->staged || rd->probe != NULL)
+			return 1;
 	}
+	return 0;
+}
+
+/*
+ * Run unbound-control for the unbound of `rd' with the NULL-terminated
+ * parameters in `params', the first of which is replaced by the backend.
+ */
+void
+upstream_unbound_control(struct upstream_rdomain *rd, char **params) {
+	char *argv[MAX_STAGED_SERVERS + 6];
+	uint64_t t_start = metrics_now();
+	size_t n = 0;
+	pid_t child;
+
+	argv[n++] = (char *) backend;
+	if (rd->unbound != NULL) {
+		argv[n++] = "-c";
+		argv[n++] = (char *) rd->unbound;
+	}
+	while (*++params != NULL)
+		argv[n++] = *params;
+	argv[n] = NULL;
 
+	log_flush();
 	switch ((child = fork())) {
 		case -1:
 			err(1, "fork");
 			break;
 		case 0:
 			fclose(stdout); /* Prevent noise from unbound-control */
-			execvp("unbound-control", params);
-			err(1, "execvp");
+			/* unbound's control interface is only reachable from its own routing domain */
+			if (rd->rdomain != 0 && setrtable(rd->rdomain) < 0)
+				err(1, "setrtable %d", rd->rdomain);
+			execvp(backend, argv);
+			err(1, "execvp %s", backend);
 			break;
 		default:
 			if (waitpid(child, NULL, 0) < 0)
 				err(1, "waitpid");
 	}
+	metrics_observe(&upstream_hists[HIST_BACKEND], metrics_now() - t_start);
+	upstream_counters[CNT_BACKEND].value++;
+}
+
+/* Replace the forwarders of `rd's unbound for `zone' with the first `max' servers in `ns' */
+void
+upstream_unbound_forward(struct upstream_rdomain *rd, const char *zone, char *ns, size_t nslen,
+                         size_t max) {
+	char *params[MAX_STAGED_SERVERS + 4]; /* unbound-control, forward_{add, remove}, zone, final NULL */
+	char *p;
+	size_t numns = 0;
+
+	memset(params, 0, sizeof (params));
+	params[0] = "unbound-control";
+	params[1] = "forward_remove";
+	params[2] = (char *) zone;
+
+	if (nslen > 0) {
+		/* forward_add replaces an existing zone in one step */
+		params[1] = "forward_add";
+		p = ns;
+		while ((numns < max) && (nslen > 0)) {
+			params[3 + numns++] = p;
+			nslen -= strlen(p) + 1;
+			p += strlen(p) + 1;
+		}
+
+		if (nslen > 0) {
+			log_warnx("unbound: ignoring further name servers");
+		}
+	}
+
+	upstream_unbound_control(rd, params);
+}
+
+void
+upstream_unbound_flush(struct upstream_rdomain *rd, const char *zone) {
+	char *params[] = { "unbound-control", "flush_zone", (char *) zone, NULL };
+
+	upstream_unbound_control(rd, params);
+}
+
+/* Domain names end up on unbound-controls command line, so be strict */
+int
+upstream_valid_domain(const char *name) {
+	const char *p;
+
+	if (*name == '\0' || *name == '-' || *name == '.' || strlen(name) >= NS_MAXDNAME)
+		return 0;
+	for (p = name; *p != '\0'; p++) {
+		if (!isalnum((unsigned char) *p) && *p != '-' && *p != '.' && *p != '_')
+			return 0;
+	}
+	return 1;
+}
+
+struct upstream_zone *
+upstream_zone_find(struct upstream_zones *zones, const char *name) {
+	struct upstream_zone *z;
+
+	TAILQ_FOREACH(z, zones, entry) {
+		if (!strcasecmp(z->name, name))
+			return z;
+	}
+	return NULL;
+}
+
+void
+upstream_zones_clear(struct upstream_zones *zones) {
+	struct upstream_zone *z;
+
+	while ((z = TAILQ_FIRST(zones)) != NULL) {
+		TAILQ_REMOVE(zones, z, entry);
+		free(z->name);
+		free(z->ns.ns);
+		free(z);
+	}
+}
+
+/* Remember the forward zones in `msg' until the next upstream update of `rd' */
+void
+upstream_zone_stage(struct upstream_rdomain *rd, struct upstream_update_msg *msg) {
+	struct upstream_zone *z;
+	char *d, *p;
+
+	for (d = msg->domains; d < msg->domains + msg->domainslen; d += strlen(d) + 1) {
+		if (!upstream_valid_domain(d)) {
+			log_warnx("invalid search domain dev=%s", msg->device);
+			continue;
+		}
+		if ((z = upstream_zone_find(&rd->pending_zones, d)) == NULL) {
+			if ((z = calloc(1, sizeof(*z))) == NULL)
+				err(1, "calloc");
+			if ((z->name = strdup(d)) == NULL)
+				err(1, "strdup");
+			TAILQ_INSERT_TAIL(&rd->pending_zones, z, entry);
+		}
+		for (p = msg->ns; p < msg->ns + msg->nslen; p += strlen(p) + 1) {
+			if (!ns_list_contains(&z->ns, p))
+				ns_list_append(&z->ns, p);
+		}
+	}
+}
+
+/* Install the staged forward zones of `rd' and remove those that went away */
+void
+upstream_unbound_zones(struct upstream_rdomain *rd) {
+	struct upstream_zone *z, *old;
+
+	TAILQ_FOREACH(z, &rd->pending_zones, entry) {
+		old = upstream_zone_find(&rd->zones, z->name);
+		if (old != NULL && old->ns.nslen == z->ns.nslen &&
+		    !memcmp(old->ns.ns, z->ns.ns, z->ns.nslen))
+			continue;
+		log_info("forward zone added zone=%s rdomain=%d", z->name, rd->rdomain);
+		upstream_unbound_forward(rd, z->name, z->ns.ns, z->ns.nslen, MAX_NAME_SERVERS);
+		upstream_unbound_flush(rd, z->name);
+	}
+
+	TAILQ_FOREACH(old, &rd->zones, entry) {
+		if (upstream_zone_find(&rd->pending_zones, old->name) != NULL)
+			continue;
+		log_info("forward zone removed zone=%s rdomain=%d", old->name, rd->rdomain);
+		upstream_unbound_forward(rd, old->name, NULL, 0, 0);
+		upstream_unbound_flush(rd, old->name);
+	}
+
+	upstream_zones_clear(&rd->zones);
+	TAILQ_CONCAT(&rd->zones, &rd->pending_zones, entry);
+}
+
+/* Make `ns' the only forwarders, drop cached answers and warm up the cache again */
+void
+upstream_unbound_commit(struct upstream_rdomain *rd, struct config *config, char *ns, size_t nslen) {
+	struct warmup_name *names = NULL;
+	size_t nnames = 0;
+
+	/* Remember what clients asked for before the cache is flushed */
+	if (config->warmup > 0)
+		names = warmup_collect(backend, rd->unbound, rd->rdomain, config->warmup, &nnames);
+
+	upstream_unbound_forward(rd, ".", ns, nslen, MAX_NAME_SERVERS);
+	/* unbound only got the first few, so only those are kept through the next switch */
+	nslen = ns_list_prefix(ns, nslen, MAX_NAME_SERVERS);
+	ns_list_set(&rd->active, ns, nslen);
+	ns_list_set(&rd->committed, ns, nslen);
 
 	/* Flush out answers from old name servers */
-	if (system("unbound-control flush_zone .") < 0) {
-		err(1, "system");
+	upstream_unbound_flush(rd, ".");
+
+	/* Refill the cache through the new forwarders */
+	warmup_prefetch(names, nnames, rd->rdomain);
+	warmup_free(names, nnames);
+}
+
+/* Print what playing back a recording cost and exit */
+void
+upstream_replay_report(struct upstream_state *state) {
+	struct histogram *conv = &upstream_hists[HIST_CONVERGENCE];
+	struct histogram *run = &upstream_hists[HIST_BACKEND];
+	uint64_t applied = upstream_counters[CNT_APPLIED].value;
+	double secs = 0;
+
+	if (state->t_last > state->t_first)
+		secs = (state->t_last - state->t_first) / 1e9;
+
+	printf("updates: %llu in %.3f s, %.1f/s\n", (unsigned long long) applied, secs,
+	       secs > 0? applied / secs: 0);
+	printf("backend runs: %llu, %.3f ms on average\n",
+	       (unsigned long long) upstream_counters[CNT_BACKEND].value,
+	       run->count? run->sum / 1e6 / run->count: 0);
+	printf("convergence: %.3f ms on average, p50 <= %g s, p99 <= %g s\n",
+	       conv->count? conv->sum / 1e6 / conv->count: 0, metrics_quantile(conv, 0.5),
+	       metrics_quantile(conv, 0.99));
+	fflush(stdout);
+	log_flush();
+	exit(0);
+}
+
+/* Called when the grace period of a staged switch in `rd' is over */
+void
+upstream_unbound_drain(struct upstream_state *state, struct upstream_rdomain *rd,
+                       struct config *config) {
+	if (!rd->staged)
+		return;
+	rd->staged = 0;
+	log_debug("grace period over rdomain=%d", rd->rdomain);
+	upstream_unbound_commit(rd, config, rd->pending.ns, rd->pending.nslen);
+	ns_list_set(&rd->pending, NULL, 0);
+	state->t_last = metrics_now();
+	if (state->replay_done && !upstream_staged(state))
+		upstream_replay_report(state);
+}
+
+/*
+ * Stage a switch to the servers in `rd->requested' of which those in
+ * `verified' answered their probe.
+ */
+void
+upstream_unbound_stage(struct upstream_state *state, struct upstream_rdomain *rd,
+                       struct config *config, struct ns_list *verified) {
+	struct ns_list staged;
+	struct kevent ev;
+	char *p;
+
+	/* Only switch over to servers that actually answer. If none of them
+	 * does, the network probably isn't ready yet and we use all of them. */
+	if (verified->nslen == 0)
+		ns_list_set(&rd->pending, rd->requested.ns,
+		            ns_list_prefix(rd->requested.ns, rd->requested.nslen, MAX_NAME_SERVERS));
+	else
+		ns_list_set(&rd->pending, verified->ns,
+		            ns_list_prefix(verified->ns, verified->nslen, MAX_NAME_SERVERS));
+
+	/* What answers is what we already use, so there's nothing to switch */
+	if (ns_list_equal(&rd->committed, rd->pending.ns, rd->pending.nslen)) {
+		log_debug("forwarders verified unchanged rdomain=%d", rd->rdomain);
+		if (rd->staged)
+			upstream_unbound_forward(rd, ".", rd->committed.ns, rd->committed.nslen,
+			                         MAX_NAME_SERVERS);
+		ns_list_set(&rd->active, rd->committed.ns, rd->committed.nslen);
+		ns_list_set(&rd->pending, NULL, 0);
+		rd->staged = 0;
+		return;
 	}
 
-	if (msg->nslen <= 0) {
+	/* Add the servers that answered in front of those of the last switch, all of which are kept */
+	memset(&staged, 0x00, sizeof(staged));
+	for (p = rd->pending.ns; p < rd->pending.ns + rd->pending.nslen; p += strlen(p) + 1)
+		ns_list_append(&staged, p);
+	for (p = rd->committed.ns; p < rd->committed.ns + rd->committed.nslen; p += strlen(p) + 1) {
+		if (!ns_list_contains(&staged, p))
+			ns_list_append(&staged, p);
+	}
+	upstream_unbound_forward(rd, ".", staged.ns, staged.nslen, MAX_STAGED_SERVERS);
+	ns_list_set(&rd->active, staged.ns, staged.nslen);
+	free(staged.ns);
+
+	log_debug("forwarders staged rdomain=%d nslen=%zu verified=%zu grace=%lld", rd->rdomain,
+	          rd->requested.nslen, verified->nslen, (long long) config->grace);
+
+	/* (Re-)start the grace period, each routing domain has its own timer */
+	EV_SET(&ev, rd->rdomain, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, config->grace * 1000, rd);
+	if (kevent(state->kq, &ev, 1, NULL, 0, NULL) < 0)
+		err(1, "kevent");
+	rd->staged = 1;
+}
+
+/* The probes of `rd' are all answered or timed out, stage the switch */
+void
+upstream_unbound_probed(struct upstream_state *state, struct upstream_rdomain *rd,
+                        struct config *config) {
+	struct ns_list verified;
+
+	if (rd->probe == NULL)
+		return;
+	memset(&verified, 0x00, sizeof(verified));
+	verified.ns = upstream_probe_finish(rd->probe, &verified.nslen);
+	rd->probe = NULL;
+	upstream_unbound_stage(state, rd, config, &verified);
+	free(verified.ns);
+	state->t_last = metrics_now();
+	if (state->replay_done && !upstream_staged(state))
+		upstream_replay_report(state);
+}
+
+/* Cancel the probes `rd' is waiting for, if any */
+void
+upstream_unbound_cancel_probe(struct upstream_rdomain *rd) {
+	if (rd->probe == NULL)
+		return;
+	(void) upstream_probe_finish(rd->probe, NULL);
+	rd->probe = NULL;
+}
+
+void
+upstream_update_dispatch_unbound(struct upstream_update_msg *msg, struct upstream_state *state,
+                                 struct upstream_rdomain *rd, struct config *config) {
+	struct ns_list verified;
+
+	/* Refreshes of the same servers mustn't cost a probe, a flush and a warm-up */
+	if (rd->applied && ns_list_equal(&rd->requested, msg->ns, msg->nslen)) {
+		log_debug("forwarders unchanged rdomain=%d", rd->rdomain);
 		return;
 	}
 
-	for (numns = 0; numns < MAX_NAME_SERVERS; numns++) {
-		if (srv[numns] == NULL)
-			break;
-		free(srv[numns]);
+	if (msg->nslen == 0) {
+		if (!config->allow_empty) {
+			log_warnx("no name servers left, keeping current forwarders rdomain=%d",
+			          rd->rdomain);
+			return;
+		}
+		upstream_unbound_cancel_probe(rd);
+		ns_list_set(&rd->requested, NULL, 0);
+		rd->applied = 1;
+		rd->staged = 0;
+		ns_list_set(&rd->pending, NULL, 0);
+		upstream_unbound_commit(rd, config, NULL, 0);
+		return;
+	}
+	ns_list_set(&rd->requested, msg->ns, msg->nslen);
+	rd->applied = 1;
+	/* Newer servers replace those still being probed */
+	upstream_unbound_cancel_probe(rd);
+
+	if (config->grace == 0 || rd->committed.nslen == 0) {
+		/* Nothing to drain, switch right away */
+		rd->staged = 0;
+		ns_list_set(&rd->pending, NULL, 0);
+		upstream_unbound_commit(rd, config, msg->ns, msg->nslen);
+		return;
+	}
+
+	/* The answers come in through our kqueue, other routing domains don't wait for them */
+	rd->probe = upstream_probe_start(rd->requested.ns, rd->requested.nslen, rd->rdomain,
+	                                 state->kq, PROBE_TIMER(rd->rdomain), rd);
+	if (rd->probe == NULL) {
+		memset(&verified, 0x00, sizeof(verified));
+		upstream_unbound_stage(state, rd, config, &verified);
 	}
 }
 
 void
-upstream_update_handle_imsg(struct imsgbuf *ibuf, struct config *config) {
+upstream_update_handle_imsg(struct imsgbuf *ibuf, struct upstream_state *state, struct config *config) {
 	struct upstream_update_msg msg;
+	struct upstream_rdomain *rd;
 	struct imsg imsg;
 	ssize_t n, datalen;
+	uint32_t imsg_type;
+	uint64_t t_received, t_done;
 	char *idata;
 
 	if ((n = imsg_read(ibuf)) == -1 || n == 0) {
@@ -147,45 +614,92 @@ upstream_update_handle_imsg(struct imsgbuf *ibuf, struct config *config) {
 			return;
 
 		datalen = imsg.hdr.len - IMSG_HEADER_SIZE;
+		imsg_type = imsg.hdr.type;
 
 		switch (imsg.hdr.type) {
 			case MSG_UPSTREAM_UPDATE:
+			case MSG_UPSTREAM_ZONE:
 				break;
+			case MSG_UPSTREAM_REAPPLY:
+				/* Forgotten zones are installed again by the updates that follow */
+				imsg_free(&imsg);
+				TAILQ_FOREACH(rd, &state->rdomains, entry) {
+					upstream_zones_clear(&rd->zones);
+					rd->applied = 0;
+				}
+				continue;
+			case MSG_REPLAY_DONE:
+				imsg_free(&imsg);
+				/* A staged switch still has to be drained */
+				state->replay_done = 1;
+				if (!upstream_staged(state))
+					upstream_replay_report(state);
+				continue;
 			default:
-				warnx("%llu: unknown IMSG received: %d", time(NULL), imsg.hdr.type);
+				log_warnx("unknown message type=%d", imsg.hdr.type);
 				continue;
 		}
 
-		if ((idata = calloc(1, datalen)) == NULL) {
-			err(1, "calloc");
-		}
-		memcpy(idata, imsg.data, datalen);
+		/* The message points into the imsg, which is freed once it's handled */
+		if (datalen < 1)
+			errx(1, "invalid update msg");
+		idata = imsg.data;
 		idata[datalen - 1] = '\0';
-		imsg_free(&imsg);
-
 		if (!upstream_update_msg_unpack(&msg, idata, datalen))
 			errx(1, "failed to unpack update msg");
-		free(idata);
-#ifndef NDEBUG
-		fprintf(stderr, "%llu: device=\"%s\", nslen=%ld lifetime=%u\n",
-		        time(NULL), msg.device, msg.nslen, msg.lifetime);
-#endif
+		log_debug("update dev=%s rdomain=%d nslen=%zu lifetime=%u", msg.device, msg.rdomain,
+		          msg.nslen, msg.lifetime);
+		rd = upstream_rdomain_get(state, config, msg.rdomain);
+		if (imsg_type == MSG_UPSTREAM_ZONE) {
+			upstream_zone_stage(rd, &msg);
+			imsg_free(&imsg);
+			continue;
+		}
+
+		t_received = metrics_now();
+		if (state->t_first == 0 || (msg.t_event != 0 && msg.t_event < state->t_first))
+			state->t_first = msg.t_event? msg.t_event: t_received;
+		if (msg.t_repo != 0)
+			metrics_observe(&upstream_hists[HIST_TO_UPSTREAM], t_received - msg.t_repo);
 		if (config->srvtype == SRV_UNBOUND) {
-			upstream_update_dispatch_unbound(&msg);
+			upstream_update_dispatch_unbound(&msg, state, rd, config);
+			upstream_unbound_zones(rd);
 		} else {
-			upstream_update_dispatch_rebound(&msg);
+			/* rebound has no forward zones */
+			upstream_zones_clear(&rd->pending_zones);
+			/* and there's only the one in the default routing domain */
+			if (msg.rdomain == 0)
+				upstream_update_dispatch_rebound(&msg);
+			else
+				log_warnx("rebound: ignoring servers rdomain=%d", msg.rdomain);
 		}
-		upstream_update_msg_cleanup(&msg);
+
+		t_done = metrics_now();
+		metrics_observe(&upstream_hists[HIST_APPLY], t_done - t_received);
+		if (msg.t_event != 0)
+			metrics_observe(&upstream_hists[HIST_CONVERGENCE], t_done - msg.t_event);
+		upstream_counters[CNT_APPLIED].value++;
+		state->t_last = t_done;
+		log_info("update applied trace=%u ms=%llu", msg.trace,
+		         msg.t_event? (unsigned long long) (t_done - msg.t_event) / 1000000: 0);
+		imsg_free(&imsg);
+		metrics_send(ibuf->fd, upstream_hists,
+		             sizeof(upstream_hists) / sizeof(upstream_hists[0]),
+		             upstream_counters, sizeof(upstream_counters) / sizeof(upstream_counters[0]));
 	}
 }
 
 int
 upstream_update_loop(int msg_fd, struct config *config) {
+	struct upstream_state state;
 	struct imsgbuf ibuf;
 	struct kevent ev;
-	int kq;
 
 	setproctitle("upstream update loop");
+	log_procname("upstream update loop");
+
+	if (config->backend != NULL)
+		backend = config->backend;
 
 	if (config->srvtype != SRV_REBOUND) {
 		/* XXX: move signalling in upstream_update_dispatch_rebound to parent */
@@ -194,70 +708,116 @@ upstream_update_loop(int msg_fd, struct config *config) {
 	}
 
 	imsg_init(&ibuf, msg_fd);
+	memset(&state, 0x00, sizeof(state));
+	TAILQ_INIT(&state.rdomains);
 
-	if ((kq = kqueue()) < 0) {
+	if ((state.kq = kqueue()) < 0) {
 		err(1, "kqueue");
 	}
 
 	EV_SET(&ev, msg_fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
 
-	if (kevent(kq, &ev, 1, NULL, 0, NULL) < 0) {
+	if (kevent(state.kq, &ev, 1, NULL, 0, NULL) < 0) {
 		err(1, "kevent");
 	}
 
 	for (;;) {
-		if (kevent(kq, NULL, 0, &ev, 1, NULL) < 1) {
+		log_flush();
+		if (kevent(state.kq, NULL, 0, &ev, 1, NULL) < 1) {
 			err(1, "kevent");
 		}
-		upstream_update_handle_imsg(&ibuf, config);
+		if (ev.filter == EVFILT_TIMER && ev.ident > RDOMAIN_MAX)
+			upstream_unbound_probed(&state, ev.udata, config);
+		else if (ev.filter == EVFILT_TIMER)
+			upstream_unbound_drain(&state, ev.udata, config);
+		else if (ev.ident != (uintptr_t) msg_fd) {
+			struct upstream_rdomain *rd = ev.udata;
+
+			if (rd->probe != NULL && upstream_probe_read(rd->probe, ev.ident))
+				upstream_unbound_probed(&state, rd, config);
+		} else
+			upstream_update_handle_imsg(&ibuf, &state, config);
 	}
 
 	return 1;
 }
 
+/* trace, t_event, t_parsed and t_repo */
+#define UPSTREAM_TRACE_LEN (sizeof(uint32_t) + 3 * sizeof(uint64_t))
+
+/*
+ * Pack `msg' into a buffer that is reused by the next call, don't free it.
+ * The buffer only grows, so packing the same kind of update again allocates
+ * nothing.
+ */
 char *
 upstream_update_msg_pack(struct upstream_update_msg *msg, size_t *len) {
-	char *p = NULL;
+	static char *buf = NULL;
+	static size_t cap = 0;
+	size_t need, off = 0;
+	char *p;
 
 	if (msg->device == NULL) {
-		warnx("%llu: tried to pack an incomplete upstream update msg", time(NULL));
-		goto exit_fail;
+		log_warnx("tried to pack an incomplete upstream update msg");
+		return NULL;
 	}
 
-	if ((p = calloc(1, sizeof(msg->type))) == NULL)
-		goto exit_fail;
-	memcpy(p, &msg->type, sizeof(msg->type));
-	*len = sizeof(msg->type);
-
-	if ((p = realloc(p, *len + sizeof(msg->nslen))) == NULL)
-		goto exit_fail;
-	memcpy(p + *len, &msg->nslen, sizeof(msg->nslen));
-	*len += sizeof(msg->nslen);
-
-	if ((p = realloc(p, *len + sizeof(msg->lifetime))) == NULL)
-		goto exit_fail;
-	memcpy(p + *len, &msg->lifetime, sizeof(msg->lifetime));
-	*len += sizeof(msg->lifetime);
+	need = sizeof(msg->type) + sizeof(msg->nslen) + sizeof(msg->domainslen) +
+	       sizeof(msg->lifetime) + sizeof(msg->rdomain) + sizeof(msg->server) +
+	       UPSTREAM_TRACE_LEN + strlen(msg->device) + 1;
+	if (msg->ns != NULL)
+		need += msg->nslen;
+	if (msg->domains != NULL)
+		need += msg->domainslen;
+	if (need > cap) {
+		if ((p = realloc(buf, need)) == NULL)
+			return NULL;
+		buf = p;
+		cap = need;
+	}
 
-	if ((p = realloc(p, *len + strlen(msg->device) + 1)) == NULL)
-		goto exit_fail;
-	(void) strlcpy(p + *len, msg->device, strlen(msg->device) + 1);
-	*len += strlen(msg->device) + 1;
+	memcpy(buf + off, &msg->type, sizeof(msg->type));
+	off += sizeof(msg->type);
+	memcpy(buf + off, &msg->nslen, sizeof(msg->nslen));
+	off += sizeof(msg->nslen);
+	memcpy(buf + off, &msg->domainslen, sizeof(msg->domainslen));
+	off += sizeof(msg->domainslen);
+	memcpy(buf + off, &msg->lifetime, sizeof(msg->lifetime));
+	off += sizeof(msg->lifetime);
+	memcpy(buf + off, &msg->rdomain, sizeof(msg->rdomain));
+	off += sizeof(msg->rdomain);
+	memcpy(buf + off, &msg->server, sizeof(msg->server));
+	off += sizeof(msg->server);
+
+	memcpy(buf + off, &msg->trace, sizeof(msg->trace));
+	memcpy(buf + off + sizeof(msg->trace), &msg->t_event, sizeof(msg->t_event));
+	memcpy(buf + off + sizeof(msg->trace) + sizeof(uint64_t), &msg->t_parsed,
+	       sizeof(msg->t_parsed));
+	memcpy(buf + off + sizeof(msg->trace) + 2 * sizeof(uint64_t), &msg->t_repo,
+	       sizeof(msg->t_repo));
+	off += UPSTREAM_TRACE_LEN;
+
+	memcpy(buf + off, msg->device, strlen(msg->device) + 1);
+	off += strlen(msg->device) + 1;
 
 	if (msg->ns != NULL) {
-		if ((p = realloc(p, *len + msg->nslen)) == NULL)
-			goto exit_fail;
-		memcpy(p + *len, msg->ns, msg->nslen);
-		*len += msg->nslen;
+		memcpy(buf + off, msg->ns, msg->nslen);
+		off += msg->nslen;
 	}
 
-	return p;
+	if (msg->domains != NULL) {
+		memcpy(buf + off, msg->domains, msg->domainslen);
+		off += msg->domainslen;
+	}
 
-exit_fail:
-	free(p);
-	return NULL;
+	*len = off;
+	return buf;
 }
 
+/*
+ * Unpack `src' into `msg' without copying: the device, name servers and domains
+ * point into `src', which has to outlive `msg'. Don't clean `msg' up.
+ */
 int
 upstream_update_msg_unpack(struct upstream_update_msg *msg, char *src, size_t srclen) {
 	size_t off = 0, len;
@@ -265,8 +825,7 @@ upstream_update_msg_unpack(struct upstream_update_msg *msg, char *src, size_t sr
 	memset(msg, 0x00, sizeof(*msg));
 
 	if (srclen < sizeof(msg->type)) {
-		warnx("%llu: tried to unpack short update msg (%ld < %ld)",
-		      time(NULL), srclen, sizeof(msg->nslen));
+		log_warnx("tried to unpack short update msg (%ld < %ld)", srclen, sizeof(msg->nslen));
 		goto exit_fail;
 	}
 	memcpy(&msg->type, src, sizeof(msg->type));
@@ -274,50 +833,84 @@ upstream_update_msg_unpack(struct upstream_update_msg *msg, char *src, size_t sr
 
 	len = srclen - off;
 	if (len < sizeof(msg->nslen)) {
-		warnx("%llu: tried to unpack short update msg (%ld < %ld)",
-		      time(NULL), len, sizeof(msg->nslen));
+		log_warnx("tried to unpack short update msg (%ld < %ld)", len, sizeof(msg->nslen));
 		goto exit_fail;
 	}
 	memcpy(&msg->nslen, src + off, sizeof(msg->nslen));
 	off += sizeof(msg->nslen);
 
+	if (srclen - off < sizeof(msg->domainslen)) {
+		log_warnx("tried to unpack short update msg (%ld < %ld)", srclen - off, sizeof(msg->domainslen));
+		goto exit_fail;
+	}
+	memcpy(&msg->domainslen, src + off, sizeof(msg->domainslen));
+	off += sizeof(msg->domainslen);
+
 	if (srclen - off < sizeof(msg->lifetime)) {
-		warnx("%llu: tried to unpack short update msg (%ld < %ld)",
-		      time(NULL), srclen - off, sizeof(msg->lifetime));
+		log_warnx("tried to unpack short update msg (%ld < %ld)", srclen - off, sizeof(msg->lifetime));
 		goto exit_fail;
 	}
 	memcpy(&msg->lifetime, src + off, sizeof(msg->lifetime));
 	off += sizeof(msg->lifetime);
 
+	if (srclen - off < sizeof(msg->rdomain)) {
+		log_warnx("tried to unpack short update msg (%ld < %ld)", srclen - off, sizeof(msg->rdomain));
+		goto exit_fail;
+	}
+	memcpy(&msg->rdomain, src + off, sizeof(msg->rdomain));
+	off += sizeof(msg->rdomain);
+	if (msg->rdomain < 0 || msg->rdomain > RDOMAIN_MAX) {
+		log_warnx("update msg for invalid rdomain %d", msg->rdomain);
+		goto exit_fail;
+	}
+
+	if (srclen - off < sizeof(msg->server)) {
+		log_warnx("tried to unpack short update msg (%ld < %ld)", srclen - off, sizeof(msg->server));
+		goto exit_fail;
+	}
+	memcpy(&msg->server, src + off, sizeof(msg->server));
+	off += sizeof(msg->server);
+
+	if (srclen - off < UPSTREAM_TRACE_LEN) {
+		log_warnx("tried to unpack short update msg (%ld < %ld)", srclen - off, UPSTREAM_TRACE_LEN);
+		goto exit_fail;
+	}
+	memcpy(&msg->trace, src + off, sizeof(msg->trace));
+	memcpy(&msg->t_event, src + off + sizeof(msg->trace), sizeof(msg->t_event));
+	memcpy(&msg->t_parsed, src + off + sizeof(msg->trace) + sizeof(uint64_t),
+	       sizeof(msg->t_parsed));
+	memcpy(&msg->t_repo, src + off + sizeof(msg->trace) + 2 * sizeof(uint64_t),
+	       sizeof(msg->t_repo));
+	off += UPSTREAM_TRACE_LEN;
+
 	len = srclen - off;
 	if (len < strnlen(src + off, len) + 1) {
-		warnx("%llu: tried to unpack short update msg (%ld < %ld)",
-		      time(NULL), len, strnlen(src + off, len) + 1);
+		log_warnx("tried to unpack short update msg (%ld < %ld)", len, strnlen(src + off, len) + 1);
 		goto exit_fail;
 	}
-	if ((msg->device = calloc(1, strnlen(src + off, len) + 1)) == NULL)
-		goto exit_fail;
-	(void) strlcpy(msg->device, src + off, strnlen(src + off, len) + 1);
+	msg->device = src + off;
 	off += strlen(msg->device) + 1;
 
-	if (msg->nslen > 0) {
-		if (srclen - off < 1) {
-			warnx("%llu: tried to unpack short update msg (%ld - %ld < 1), nslen = %ld",
-			      time(NULL), srclen, off, msg->nslen);
-			goto exit_fail;
-		}
+	if (srclen - off < msg->nslen + msg->domainslen) {
+		log_warnx("tried to unpack short update msg (%ld - %ld < %ld), nslen = %ld", srclen, off, msg->nslen + msg->domainslen, msg->nslen);
+		goto exit_fail;
+	}
 
-		len = srclen - off;
-		if ((msg->ns = calloc(1, len)) == NULL)
-			goto exit_fail;
-		memcpy(msg->ns, src + off, len);
+	if (msg->nslen > 0) {
+		msg->ns = src + off;
+		off += msg->nslen;
 	} else
 		msg->ns = NULL;
 
+	if (msg->domainslen > 0)
+		msg->domains = src + off;
+	else
+		msg->domains = NULL;
+
 	return 1;
 
 exit_fail:
-	upstream_update_msg_cleanup(msg);
+	memset(msg, 0x00, sizeof(*msg));
 	return 0;
 }
 
@@ -331,9 +924,20 @@ upstream_update_msg_append_ns(struct upstream_update_msg *msg, const char *ns) {
 	return 1;
 }
 
+int
+upstream_update_msg_append_domain(struct upstream_update_msg *msg, const char *domain) {
+	msg->domains = realloc(msg->domains, msg->domainslen + strlen(domain) + 1);
+	if (msg->domains == NULL)
+		return 0;
+	(void) strlcpy(msg->domains + msg->domainslen, domain, strlen(domain) + 1);
+	msg->domainslen += strlen(domain) + 1;
+	return 1;
+}
+
 void
 upstream_update_msg_cleanup(struct upstream_update_msg *msg) {
 	free(msg->device);
 	free(msg->ns);
+	free(msg->domains);
 	memset(msg, 0x00, sizeof(*msg));
 }
@@ -1,30 +1,127 @@
 #ifndef _UNBOUND_UPDATE_H
 #define _UNBOUND_UPDATE_H
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <limits.h>
+
 #include "config.h"
 
 enum upstream_msg_type {
-	MSG_UPSTREAM_UPDATE
+	MSG_UPSTREAM_UPDATE,
+	/* Forward zones for the domains in the message, followed by an update */
+	MSG_UPSTREAM_ZONE,
+	/* A link went up or down, carries a struct link_state_msg */
+	MSG_LINK_STATE,
+	/* All sources have been read once after startup */
+	MSG_SYNC_DONE,
+	/* A source was added to or removed from the configuration, carries a struct source_msg */
+	MSG_SOURCE_ADD,
+	MSG_SOURCE_DEL,
+	/* An interface arrived or came up, carries a struct link_state_msg */
+	MSG_IFACE_ARRIVAL,
+	/* Read a source again on request of dnsfooctl, carries a struct source_msg */
+	MSG_SOURCE_RESCAN,
+	/* Forget the rate limit state of all routers */
+	MSG_RATELIMIT_CLEAR,
+	/* Install all forward zones again with the next update */
+	MSG_UPSTREAM_REAPPLY,
+	/* Metrics of the sending process in the Prometheus text format */
+	MSG_METRICS,
+	/* Everything in a recording has been played back, see dnsfoo -r */
+	MSG_REPLAY_DONE,
+	/* A device statement of a reloaded configuration, carries a struct device_msg */
+	MSG_CONFIG_DEVICE,
+	/* All device statements have been sent, they replace the repository's */
+	MSG_CONFIG_DONE
+};
+
+struct link_state_msg {
+	char device[IF_NAMESIZE];
+	int up;
+};
+
+struct source_msg {
+	enum srctype type;
+	char device[IF_NAMESIZE];
+	/* Source from the configuration, empty if the source type takes none */
+	char source[PATH_MAX];
+	/* Routing domain of the device */
+	int rdomain;
+};
+
+/* What the server repository needs to know about a device statement */
+struct device_msg {
+	/* Name or pattern */
+	char device[NAME_MAX + 1];
+	long long priority;
+	int rdomain;
+	/* Priority of the first source of each type that has one, -1 if none does */
+	long long priorities[SRC_UNKNOWN];
 };
 
 /* Packed message layout:
- * | type | nslen | lifetime | device | nameservers |
+ * | type | nslen | domainslen | lifetime | rdomain | server | trace | t_event | t_parsed |
+ * | t_repo | device | nameservers | domains |
  */
 struct upstream_update_msg {
 	/* Source type this message originated from */
 	enum srctype type;
 	/* update life time, ~0 means infinity */
 	uint32_t lifetime;
+	/* Routing domain whose DNS server the update is for, set by the repository */
+	int rdomain;
+	/* DHCP server the lease or acknowledgement is from, network byte order, 0 if unknown */
+	uint32_t server;
+	/* Event this update resulted from, 0 if it isn't traced */
+	uint32_t trace;
+	/* When the event was seen, its handler was done and the repository passed
+	 * it on, in nanoseconds of CLOCK_MONOTONIC */
+	uint64_t t_event;
+	uint64_t t_parsed;
+	uint64_t t_repo;
 	/* Device these name servers come from */
 	char *device;
 	/* Total length of the name server list in this message */
 	size_t nslen;
 	/* sequence of '\0'-separated name server addresses */
 	char *ns;
+	/* Total length of the search domain list in this message */
+	size_t domainslen;
+	/* sequence of '\0'-separated search domains served by these name servers */
+	char *domains;
 };
 
 char *upstream_update_msg_pack(struct upstream_update_msg *, size_t *);
 int upstream_update_msg_unpack(struct upstream_update_msg *, char *, size_t);
 int upstream_update_msg_append_ns(struct upstream_update_msg *, const char *);
+int upstream_update_msg_append_domain(struct upstream_update_msg *, const char *);
 int upstream_update_loop(int, struct config*);
 void upstream_update_msg_cleanup(struct upstream_update_msg *);
+
+/* Probes of new name servers, answered through the updater's kqueue */
+struct upstream_probe;
+struct upstream_probe *upstream_probe_start(const char *, size_t, int, int, uintptr_t, void *);
+int upstream_probe_read(struct upstream_probe *, int);
+char *upstream_probe_finish(struct upstream_probe *, size_t *);
+
+#define WARMUP_A	0x01
+#define WARMUP_AAAA	0x02
+
+/* A name to prefetch after the forwarders changed */
+struct warmup_name {
+	char *name;
+	/* Number of cached (name, type) answers for this name */
+	int entries;
+	/* Longest remaining TTL of those answers, in seconds */
+	long long ttl;
+	/* WARMUP_A and/or WARMUP_AAAA */
+	int types;
+};
+
+struct warmup_name *warmup_collect(const char *, const char *, int, size_t, size_t *);
+void warmup_prefetch(struct warmup_name *, size_t, int);
+void warmup_free(struct warmup_name *, size_t);
+extern in_port_t warmup_port;
 #endif /* _UNBOUND_UPDATE_H */
@@ -0,0 +1,254 @@
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "upstream_update.h"
+#include "log.h"
+
+/* Address of the local resolver we prefetch through */
+#define WARMUP_RESOLVER "127.0.0.1"
+/* How long we wait for answers to the prefetch queries, in milliseconds */
+#define WARMUP_TIMEOUT 3000
+
+/* Port the local resolver listens on, dnsfoo-bench points it at a stub resolver */
+in_port_t warmup_port = NAMESERVER_PORT;
+
+struct warmup_node {
+	RB_ENTRY(warmup_node) entry;
+	struct warmup_name n;
+};
+
+RB_HEAD(warmup_tree, warmup_node);
+
+static int
+warmup_node_cmp(struct warmup_node *a, struct warmup_node *b) {
+	return strcmp(a->n.name, b->n.name);
+}
+
+RB_GENERATE_STATIC(warmup_tree, warmup_node, entry, warmup_node_cmp)
+
+static int
+warmup_name_cmp(const void *a, const void *b) {
+	const struct warmup_name *na = a, *nb = b;
+
+	if (na->entries != nb->entries)
+		return nb->entries - na->entries;
+	if (na->ttl != nb->ttl)
+		return (na->ttl > nb->ttl)? -1: 1;
+	return strcmp(na->name, nb->name);
+}
+
+/*
+ * Collect names clients have been asking for from unbounds message cache.
+ * unbound doesn't count queries per name, so this is a heuristic: names with
+ * answers for more types come first, then those whose answers would have
+ * stayed cached the longest and so save the most queries when prefetched.
+ * Returns at most `max' names. `unbound' is the configuration of the unbound
+ * in `rdomain', NULL for the default one.
+ */
+struct warmup_name *
+warmup_collect(const char *backend, const char *unbound, int rdomain, size_t max,
+               size_t *nnames) {
+	struct warmup_tree tree = RB_INITIALIZER(&tree);
+	struct warmup_node *node, *next, key;
+	struct warmup_name *names = NULL;
+	char name[NS_MAXDNAME], class[16], type[16], cmd[2 * PATH_MAX + 64];
+	int in_msgs = 0, off = 0;
+	long long ttl;
+	size_t len, idx = 0, total = 0;
+	char *line;
+	FILE *f;
+
+	*nnames = 0;
+
+	if (rdomain != 0)
+		off = snprintf(cmd, sizeof(cmd), "/sbin/route -T %d exec ", rdomain);
+	if (unbound != NULL)
+		(void) snprintf(cmd + off, sizeof(cmd) - off, "%s -c %s dump_cache", backend, unbound);
+	else
+		(void) snprintf(cmd + off, sizeof(cmd) - off, "%s dump_cache", backend);
+	if ((f = popen(cmd, "r")) == NULL) {
+		log_warn("popen");
+		return NULL;
+	}
+
+	while ((line = fgetln(f, &len)) != NULL) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		else
+			continue; /* Ignore overlong or truncated lines */
+
+		if (!strcmp(line, "START_MSG_CACHE")) {
+			in_msgs = 1;
+			continue;
+		} else if (!strcmp(line, "END_MSG_CACHE"))
+			break;
+		if (!in_msgs || strncmp(line, "msg ", 4) != 0)
+			continue;
+
+		/* msg <qname> <qclass> <qtype> <flags> <qdcount> <ttl> ... */
+		if (sscanf(line, "msg %1024s %15s %15s %*d %*d %lld", name, class, type, &ttl) != 4)
+			continue;
+		if (strcmp(class, "IN") != 0)
+			continue;
+
+		key.n.name = name;
+		if ((node = RB_FIND(warmup_tree, &tree, &key)) == NULL) {
+			if ((node = calloc(1, sizeof(*node))) == NULL)
+				err(1, "calloc");
+			if ((node->n.name = strdup(name)) == NULL)
+				err(1, "strdup");
+			RB_INSERT(warmup_tree, &tree, node);
+			total++;
+		}
+		node->n.entries++;
+		if (ttl > node->n.ttl)
+			node->n.ttl = ttl;
+		if (!strcmp(type, "A"))
+			node->n.types |= WARMUP_A;
+		else if (!strcmp(type, "AAAA"))
+			node->n.types |= WARMUP_AAAA;
+	}
+	pclose(f);
+
+	if (total == 0)
+		return NULL;
+
+	if ((names = calloc(total, sizeof(*names))) == NULL)
+		err(1, "calloc");
+	RB_FOREACH_SAFE(node, warmup_tree, &tree, next) {
+		RB_REMOVE(warmup_tree, &tree, node);
+		if (node->n.types != 0)
+			names[idx++] = node->n;
+		else
+			free(node->n.name);
+		free(node);
+	}
+
+	qsort(names, idx, sizeof(*names), warmup_name_cmp);
+	while (idx > max)
+		free(names[--idx].name);
+	*nnames = idx;
+
+	log_debug("warm-up names=%zu cached=%zu", *nnames, total);
+	return names;
+}
+
+/*
+ * Query the local resolver of `rdomain' for all names in `names' so that its
+ * cache is populated through the new forwarders before clients ask for them. The
+ * queries are sent from a child process all at once, so this doesn't delay
+ * further upstream updates.
+ */
+void
+warmup_prefetch(struct warmup_name *names, size_t nnames, int rdomain) {
+	const int types[] = { WARMUP_A, WARMUP_AAAA };
+	const int qtypes[] = { T_A, T_AAAA };
+	u_char buf[PACKETSZ];
+	struct sockaddr_in sin;
+	struct pollfd pfd;
+	struct timespec deadline, now;
+	int outstanding = 0, full = 0, timeout, qlen;
+	size_t idx, t;
+	pid_t child;
+
+	/* Reap previous warm-up runs */
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+
+	if (nnames == 0)
+		return;
+
+	log_flush();
+	switch ((child = fork())) {
+		case -1:
+			log_warn("fork");
+			return;
+		case 0:
+			break;
+		default:
+			return;
+	}
+
+	setproctitle("cache warm-up");
+	log_procname("cache warm-up");
+
+	if (rdomain != 0 && setrtable(rdomain) < 0)
+		err(1, "setrtable %d", rdomain);
+
+	memset(&sin, 0x00, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_len = sizeof(sin);
+	sin.sin_port = htons(warmup_port);
+	if (inet_pton(AF_INET, WARMUP_RESOLVER, &sin.sin_addr) != 1)
+		err(1, "inet_pton");
+
+	if ((pfd.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0)
+		err(1, "socket");
+	if (connect(pfd.fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		err(1, "connect");
+	pfd.events = POLLIN;
+
+	/* Stop sending once the socket is full, the answers free it up again too late */
+	for (idx = 0; idx < nnames && !full; idx++) {
+		for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+			if (!(names[idx].types & types[t]))
+				continue;
+			qlen = res_mkquery(QUERY, names[idx].name, C_IN, qtypes[t],
+			                   NULL, 0, NULL, buf, sizeof(buf));
+			if (qlen < 0)
+				continue;
+			if (send(pfd.fd, buf, qlen, 0) < 0) {
+				if (errno == EAGAIN || errno == ENOBUFS) {
+					full = 1;
+					break;
+				}
+				err(1, "send");
+			}
+			outstanding++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += WARMUP_TIMEOUT / 1000;
+
+	/* We don't care about the answers, only that unbound has cached them */
+	while (outstanding > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (deadline.tv_sec - now.tv_sec) * 1000 +
+		          (deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (timeout <= 0)
+			break;
+		if (poll(&pfd, 1, timeout) <= 0)
+			break;
+		while (recv(pfd.fd, buf, sizeof(buf), 0) >= 0)
+			outstanding--;
+	}
+
+	log_info("warm-up done unanswered=%d", outstanding);
+	exit(0);
+}
+
+void
+warmup_free(struct warmup_name *names, size_t nnames) {
+	size_t idx;
+
+	for (idx = 0; idx < nnames; idx++)
+		free(names[idx].name);
+	free(names);
+}